@@ -0,0 +1,75 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
+
+// Thread safe queue with a maximum number of items, for passing work from a producer thread to a consumer thread.
+template<typename T>
+class BoundedQueue
+{
+public:
+  BoundedQueue( const size_t capacity ) : m_Capacity( capacity ) {}
+
+  // Adds an item, waiting while the queue is full. Returns false (discarding the item) if the queue has been cancelled.
+  bool Push( T item )
+  {
+    std::unique_lock<std::mutex> lock( m_Mutex );
+    m_Condition.wait( lock, [ this ] { return m_Cancelled || ( m_Items.size() < m_Capacity ); } );
+    if ( m_Cancelled )
+      return false;
+    m_Items.push_back( std::move( item ) );
+    lock.unlock();
+    m_Condition.notify_all();
+    return true;
+  }
+
+  // Removes the next item, waiting while the queue is empty. Returns nullopt once the queue has been closed and emptied, or if it has been cancelled.
+  std::optional<T> Pop()
+  {
+    std::unique_lock<std::mutex> lock( m_Mutex );
+    m_Condition.wait( lock, [ this ] { return m_Cancelled || m_Closed || !m_Items.empty(); } );
+    if ( m_Cancelled || m_Items.empty() )
+      return std::nullopt;
+    std::optional<T> item( std::move( m_Items.front() ) );
+    m_Items.pop_front();
+    lock.unlock();
+    m_Condition.notify_all();
+    return item;
+  }
+
+  // Signals that no more items will be added, once the remaining items have been removed.
+  void Close()
+  {
+    {
+      std::lock_guard<std::mutex> lock( m_Mutex );
+      m_Closed = true;
+    }
+    m_Condition.notify_all();
+  }
+
+  // Releases any waiting producer or consumer, with subsequent calls returning immediately.
+  void Cancel()
+  {
+    {
+      std::lock_guard<std::mutex> lock( m_Mutex );
+      m_Cancelled = true;
+    }
+    m_Condition.notify_all();
+  }
+
+  bool IsCancelled() const
+  {
+    std::lock_guard<std::mutex> lock( m_Mutex );
+    return m_Cancelled;
+  }
+
+private:
+  const size_t m_Capacity;
+  mutable std::mutex m_Mutex;
+  std::condition_variable m_Condition;
+  std::deque<T> m_Items;
+  bool m_Closed = false;
+  bool m_Cancelled = false;
+};
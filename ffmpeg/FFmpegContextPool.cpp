@@ -0,0 +1,222 @@
+#include "FFmpegContextPool.h"
+
+#include <algorithm>
+#include <cstring>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libswresample/swresample.h>
+}
+
+FFmpegContextPool& FFmpegContextPool::Get()
+{
+  static FFmpegContextPool pool;
+  return pool;
+}
+
+FFmpegContextPool::~FFmpegContextPool()
+{
+  // Any decoders with worker threads have already been released, when the last input was closed.
+  for ( auto& frame : m_Frames )
+    av_frame_free( &frame );
+  for ( auto& [ decoderContext, key ] : m_Decoders ) {
+    avcodec_free_context( &decoderContext );
+    avcodec_parameters_free( &key.CodecParams );
+  }
+  for ( auto& [ resampleContext, key ] : m_Resamplers )
+    swr_free( &resampleContext );
+}
+
+AVFrame* FFmpegContextPool::AcquireFrame()
+{
+  {
+    std::lock_guard<std::mutex> lock( m_Mutex );
+    if ( !m_Frames.empty() ) {
+      AVFrame* frame = m_Frames.back();
+      m_Frames.pop_back();
+      return frame;
+    }
+  }
+  return av_frame_alloc();
+}
+
+void FFmpegContextPool::ReleaseFrame( AVFrame* frame )
+{
+  if ( nullptr == frame )
+    return;
+  av_frame_unref( frame );
+  {
+    std::lock_guard<std::mutex> lock( m_Mutex );
+    if ( m_Frames.size() < kMaximumFrames ) {
+      m_Frames.push_back( frame );
+      return;
+    }
+  }
+  av_frame_free( &frame );
+}
+
+bool FFmpegContextPool::Matches( const DecoderKey& key, const AVCodecParameters* codecParams, const int threadCount )
+{
+  // Decoders are only reused for identical parameters (including the codec configuration in the extradata), so that the flushed decoder is in the same state as a new one.
+  const AVCodecParameters* params = key.CodecParams;
+  return ( key.ThreadCount == threadCount ) &&
+    ( params->codec_id == codecParams->codec_id ) &&
+    ( params->codec_tag == codecParams->codec_tag ) &&
+    ( params->format == codecParams->format ) &&
+    ( params->sample_rate == codecParams->sample_rate ) &&
+    ( 0 == av_channel_layout_compare( &params->ch_layout, &codecParams->ch_layout ) ) &&
+    ( params->bits_per_coded_sample == codecParams->bits_per_coded_sample ) &&
+    ( params->bits_per_raw_sample == codecParams->bits_per_raw_sample ) &&
+    ( params->block_align == codecParams->block_align ) &&
+    ( params->frame_size == codecParams->frame_size ) &&
+    ( params->initial_padding == codecParams->initial_padding ) &&
+    ( params->extradata_size == codecParams->extradata_size ) &&
+    ( ( 0 == params->extradata_size ) || ( 0 == std::memcmp( params->extradata, codecParams->extradata, params->extradata_size ) ) );
+}
+
+bool FFmpegContextPool::Matches( const ResamplerKey& a, const ResamplerKey& b )
+{
+  return ( 0 == av_channel_layout_compare( &a.SrcLayout, &b.SrcLayout ) ) && ( a.SrcFormat == b.SrcFormat ) && ( a.SrcRate == b.SrcRate ) &&
+    ( a.DstChannels == b.DstChannels ) && ( a.DstFormat == b.DstFormat ) && ( a.DstRate == b.DstRate ) && ( a.Quality == b.Quality );
+}
+
+AVCodecContext* FFmpegContextPool::AcquireDecoder( const AVCodec* codec, const AVCodecParameters* codecParams, const int threadCount, const std::function<void( AVCodecContext* )>& configure )
+{
+  {
+    std::unique_lock<std::mutex> lock( m_Mutex );
+    const auto decoder = std::find_if( m_Decoders.begin(), m_Decoders.end(), [ codec, codecParams, threadCount ] ( const auto& entry ) {
+      return ( entry.first->codec == codec ) && Matches( entry.second, codecParams, threadCount );
+    } );
+    if ( m_Decoders.end() != decoder ) {
+      AVCodecContext* decoderContext = decoder->first;
+      m_DecodersInUse.insert( *decoder );
+      m_Decoders.erase( decoder );
+      lock.unlock();
+      avcodec_flush_buffers( decoderContext );
+      return decoderContext;
+    }
+  }
+
+  AVCodecContext* decoderContext = avcodec_alloc_context3( codec );
+  if ( nullptr == decoderContext )
+    return nullptr;
+  int result = avcodec_parameters_to_context( decoderContext, codecParams );
+  decoderContext->thread_count = threadCount;
+  if ( configure )
+    configure( decoderContext );
+  if ( result >= 0 )
+    result = avcodec_open2( decoderContext, codec, nullptr );
+  DecoderKey key{ avcodec_parameters_alloc(), threadCount };
+  if ( ( result < 0 ) || ( nullptr == key.CodecParams ) || ( avcodec_parameters_copy( key.CodecParams, codecParams ) < 0 ) ) {
+    // The decoder can still be used if the parameters could not be recorded, but it will not be pooled.
+    avcodec_parameters_free( &key.CodecParams );
+    if ( result < 0 )
+      avcodec_free_context( &decoderContext );
+    return decoderContext;
+  }
+
+  std::lock_guard<std::mutex> lock( m_Mutex );
+  m_DecodersInUse.insert( { decoderContext, key } );
+  return decoderContext;
+}
+
+void FFmpegContextPool::ReleaseDecoder( AVCodecContext* decoderContext )
+{
+  if ( nullptr == decoderContext )
+    return;
+
+  std::unique_lock<std::mutex> lock( m_Mutex );
+  const auto decoder = m_DecodersInUse.find( decoderContext );
+  if ( m_DecodersInUse.end() == decoder ) {
+    lock.unlock();
+    avcodec_free_context( &decoderContext );
+    return;
+  }
+
+  // Make room by freeing the least recently used decoder.
+  std::pair<AVCodecContext*, DecoderKey> evicted = {};
+  if ( m_Decoders.size() >= kMaximumDecoders ) {
+    evicted = m_Decoders.front();
+    m_Decoders.erase( m_Decoders.begin() );
+  }
+  m_Decoders.push_back( *decoder );
+  m_DecodersInUse.erase( decoder );
+  lock.unlock();
+
+  if ( nullptr != evicted.first ) {
+    avcodec_free_context( &evicted.first );
+    avcodec_parameters_free( &evicted.second.CodecParams );
+  }
+}
+
+SwrContext* FFmpegContextPool::AcquireResampler( const ResamplerKey& key, const std::function<SwrContext*()>& create )
+{
+  // Only native (or unspecified) channel layouts can be held in a key, since other layouts own their channel maps.
+  const bool poolable = ( AV_CHANNEL_ORDER_NATIVE == key.SrcLayout.order ) || ( AV_CHANNEL_ORDER_UNSPEC == key.SrcLayout.order );
+  if ( poolable ) {
+    std::unique_lock<std::mutex> lock( m_Mutex );
+    const auto resampler = std::find_if( m_Resamplers.begin(), m_Resamplers.end(), [ &key ] ( const auto& entry ) { return Matches( entry.second, key ); } );
+    if ( m_Resamplers.end() != resampler ) {
+      SwrContext* resampleContext = resampler->first;
+      m_ResamplersInUse.insert( *resampler );
+      m_Resamplers.erase( resampler );
+      lock.unlock();
+      // Reinitialising clears any samples held from the previous file.
+      if ( swr_init( resampleContext ) >= 0 )
+        return resampleContext;
+      lock.lock();
+      m_ResamplersInUse.erase( resampleContext );
+      lock.unlock();
+      swr_free( &resampleContext );
+    }
+  }
+
+  SwrContext* resampleContext = create();
+  if ( poolable && ( nullptr != resampleContext ) ) {
+    std::lock_guard<std::mutex> lock( m_Mutex );
+    m_ResamplersInUse.insert( { resampleContext, key } );
+  }
+  return resampleContext;
+}
+
+void FFmpegContextPool::ReleaseResampler( SwrContext* resampleContext )
+{
+  if ( nullptr == resampleContext )
+    return;
+
+  std::unique_lock<std::mutex> lock( m_Mutex );
+  const auto resampler = m_ResamplersInUse.find( resampleContext );
+  if ( m_ResamplersInUse.end() == resampler ) {
+    lock.unlock();
+    swr_free( &resampleContext );
+    return;
+  }
+
+  SwrContext* evicted = nullptr;
+  if ( m_Resamplers.size() >= kMaximumResamplers ) {
+    evicted = m_Resamplers.front().first;
+    m_Resamplers.erase( m_Resamplers.begin() );
+  }
+  m_Resamplers.push_back( *resampler );
+  m_ResamplersInUse.erase( resampler );
+  lock.unlock();
+
+  swr_free( &evicted );
+}
+
+void FFmpegContextPool::ReleaseThreadedDecoders()
+{
+  std::vector<std::pair<AVCodecContext*, DecoderKey>> released;
+  {
+    std::lock_guard<std::mutex> lock( m_Mutex );
+    // A decoder only has worker threads if threading was activated when it was opened (which depends on the codec, as well as the thread count requested).
+    const auto threaded = std::stable_partition( m_Decoders.begin(), m_Decoders.end(), [] ( const auto& entry ) { return 0 == entry.first->active_thread_type; } );
+    released.assign( threaded, m_Decoders.end() );
+    m_Decoders.erase( threaded, m_Decoders.end() );
+  }
+  for ( auto& [ decoderContext, key ] : released ) {
+    avcodec_free_context( &decoderContext );
+    avcodec_parameters_free( &key.CodecParams );
+  }
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <vector>
+
+extern "C"
+{
+#include <libavutil/channel_layout.h>
+#include <libavutil/samplefmt.h>
+}
+
+struct AVCodec;
+struct AVCodecContext;
+struct AVCodecParameters;
+struct AVFrame;
+struct SwrContext;
+
+// Process wide pool of FFmpeg objects, so that importing a batch of similar files does not need to create and open new decoders for each file.
+// Packets are not pooled here, since each decoder recycles its own packets.
+class FFmpegContextPool
+{
+public:
+  // Parameters identifying a resampler.
+  struct ResamplerKey
+  {
+    AVChannelLayout SrcLayout = {};
+    AVSampleFormat SrcFormat = AV_SAMPLE_FMT_NONE;
+    int SrcRate = 0;
+    int DstChannels = 0;
+    AVSampleFormat DstFormat = AV_SAMPLE_FMT_NONE;
+    int DstRate = 0;
+    int32_t Quality = 0;
+  };
+
+  // Returns the pool, which is destroyed when the library is unloaded.
+  static FFmpegContextPool& Get();
+
+  ~FFmpegContextPool();
+
+  AVFrame* AcquireFrame();
+  void ReleaseFrame( AVFrame* frame );
+
+  // Returns an open decoder for the codec parameters, reusing (and flushing) a pooled decoder with identical parameters if there is one. Returns nullptr on failure.
+  // The configure function is called on a newly allocated context, before it is opened.
+  AVCodecContext* AcquireDecoder( const AVCodec* codec, const AVCodecParameters* codecParams, const int threadCount, const std::function<void( AVCodecContext* )>& configure = {} );
+
+  // Returns a decoder to the pool (or frees it, if it was not acquired from the pool).
+  void ReleaseDecoder( AVCodecContext* decoderContext );
+
+  // Returns an initialised resampler for the key, reusing (and resetting) a pooled resampler if there is one, otherwise using the create function.
+  SwrContext* AcquireResampler( const ResamplerKey& key, const std::function<SwrContext*()>& create );
+
+  // Returns a resampler to the pool (or frees it, if it was not acquired from the pool).
+  void ReleaseResampler( SwrContext* resampleContext );
+
+  // Frees the idle decoders which run their own worker threads, so that none are left to be stopped when the library is unloaded (under the loader lock).
+  void ReleaseThreadedDecoders();
+
+private:
+  // Maximum number of each type of object held by the pool.
+  static constexpr size_t kMaximumFrames = 8;
+  static constexpr size_t kMaximumDecoders = 4;
+  static constexpr size_t kMaximumResamplers = 4;
+
+  struct DecoderKey
+  {
+    AVCodecParameters* CodecParams = nullptr;
+    int ThreadCount = 0;
+  };
+
+  FFmpegContextPool() = default;
+
+  static bool Matches( const DecoderKey& key, const AVCodecParameters* codecParams, const int threadCount );
+  static bool Matches( const ResamplerKey& a, const ResamplerKey& b );
+
+  std::mutex m_Mutex;
+  std::vector<AVFrame*> m_Frames;
+
+  // Idle objects (oldest first), and those currently in use along with the parameters they were created with.
+  std::vector<std::pair<AVCodecContext*, DecoderKey>> m_Decoders;
+  std::map<AVCodecContext*, DecoderKey> m_DecodersInUse;
+  std::vector<std::pair<SwrContext*, ResamplerKey>> m_Resamplers;
+  std::map<SwrContext*, ResamplerKey> m_ResamplersInUse;
+};
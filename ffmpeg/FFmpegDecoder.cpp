@@ -1,35 +1,299 @@
 #include "FFmpegDecoder.h"
+#include "FFmpegContextPool.h"
 #include "utils.h"
 
 #include <algorithm>
 #include <array>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <limits>
 
 extern "C"
 {
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
+#include <libavutil/opt.h>
 #include <libswresample/swresample.h>
 }
 
+#if defined( _M_X64 ) || ( defined( _M_IX86_FP ) && ( _M_IX86_FP >= 2 ) ) || defined( __SSE2__ )
+#define FFMPEG_DECODER_SSE2
+#include <emmintrin.h>
+#endif
+
+// Cool Edit expects floating point samples with a nominal range of +/-32768.
+constexpr float kFloatScale = 32768.f;
+
+static int16_t FloatToInt16( const float value )
+{
+  return static_cast<int16_t>( std::clamp( std::lrintf( value * kFloatScale ), -32768L, 32767L ) );
+}
+
+// Interleaves (or copies, for packed formats) the samples of a frame into the output, using the conversion function for each sample.
+template<typename In, typename Out, typename Convert>
+static void Interleave( const AVFrame* frame, const bool planar, const uint32_t channels, Out* output, Convert convert )
+{
+  const uint32_t samples = static_cast<uint32_t>( frame->nb_samples );
+  if ( planar ) {
+    for ( uint32_t channel = 0; channel < channels; channel++ ) {
+      const In* input = reinterpret_cast<const In*>( frame->extended_data[ channel ] );
+      Out* dest = output + channel;
+      for ( uint32_t i = 0; i < samples; i++, dest += channels )
+        *dest = convert( input[ i ] );
+    }
+  } else {
+    const In* input = reinterpret_cast<const In*>( frame->extended_data[ 0 ] );
+    for ( uint32_t i = 0; i < samples * channels; i++ )
+      output[ i ] = convert( input[ i ] );
+  }
+}
+
+// Converts floating point samples to Cool Edit's range, interleaving stereo planar samples, returning the number of samples handled (with any remainder left for the scalar conversion).
+static uint32_t ConvertFloatSIMD( const AVFrame* frame, const bool planar, const uint32_t channels, float* output )
+{
+  uint32_t converted = 0;
+#ifdef FFMPEG_DECODER_SSE2
+  const uint32_t samples = static_cast<uint32_t>( frame->nb_samples );
+  const __m128 scale = _mm_set1_ps( kFloatScale );
+  if ( planar && ( 2 == channels ) ) {
+    const float* left = reinterpret_cast<const float*>( frame->extended_data[ 0 ] );
+    const float* right = reinterpret_cast<const float*>( frame->extended_data[ 1 ] );
+    for ( ; converted + 4 <= samples; converted += 4 ) {
+      const __m128 l = _mm_mul_ps( _mm_loadu_ps( left + converted ), scale );
+      const __m128 r = _mm_mul_ps( _mm_loadu_ps( right + converted ), scale );
+      _mm_storeu_ps( output + 2 * converted, _mm_unpacklo_ps( l, r ) );
+      _mm_storeu_ps( output + 2 * converted + 4, _mm_unpackhi_ps( l, r ) );
+    }
+  } else if ( !planar || ( 1 == channels ) ) {
+    const float* input = reinterpret_cast<const float*>( frame->extended_data[ 0 ] );
+    for ( ; ( converted + 4 ) * channels <= samples * channels; converted += 4 ) {
+      for ( uint32_t channel = 0; channel < channels; channel++ )
+        _mm_storeu_ps( output + converted * channels + 4 * channel, _mm_mul_ps( _mm_loadu_ps( input + converted * channels + 4 * channel ), scale ) );
+    }
+  }
+#endif
+  return converted;
+}
+
+// Converts floating point samples to 16-bit, interleaving stereo planar samples, returning the number of samples handled (with any remainder left for the scalar conversion).
+static uint32_t ConvertInt16SIMD( const AVFrame* frame, const bool planar, const uint32_t channels, int16_t* output )
+{
+  uint32_t converted = 0;
+#ifdef FFMPEG_DECODER_SSE2
+  const uint32_t samples = static_cast<uint32_t>( frame->nb_samples );
+  const __m128 scale = _mm_set1_ps( kFloatScale );
+  if ( planar && ( 2 == channels ) ) {
+    const float* left = reinterpret_cast<const float*>( frame->extended_data[ 0 ] );
+    const float* right = reinterpret_cast<const float*>( frame->extended_data[ 1 ] );
+    for ( ; converted + 4 <= samples; converted += 4 ) {
+      // Round to nearest, then saturate when packing to 16-bit.
+      const __m128i l = _mm_cvtps_epi32( _mm_mul_ps( _mm_loadu_ps( left + converted ), scale ) );
+      const __m128i r = _mm_cvtps_epi32( _mm_mul_ps( _mm_loadu_ps( right + converted ), scale ) );
+      _mm_storeu_si128( reinterpret_cast<__m128i*>( output + 2 * converted ), _mm_packs_epi32( _mm_unpacklo_epi32( l, r ), _mm_unpackhi_epi32( l, r ) ) );
+    }
+  } else if ( !planar || ( 1 == channels ) ) {
+    const float* input = reinterpret_cast<const float*>( frame->extended_data[ 0 ] );
+    const uint32_t total = samples * channels;
+    for ( uint32_t i = 0; i + 8 <= total; i += 8 ) {
+      const __m128i a = _mm_cvtps_epi32( _mm_mul_ps( _mm_loadu_ps( input + i ), scale ) );
+      const __m128i b = _mm_cvtps_epi32( _mm_mul_ps( _mm_loadu_ps( input + i + 4 ), scale ) );
+      _mm_storeu_si128( reinterpret_cast<__m128i*>( output + i ), _mm_packs_epi32( a, b ) );
+    }
+    converted = ( total / 8 ) * 8 / channels;
+  }
+#endif
+  return converted;
+}
+
+struct FFmpegDecoder::Segment
+{
+  Segment( FFmpegDecoder& decoder, const SegmentRange& range ) :
+    m_Decoder( decoder ),
+    m_Range( range ),
+    m_Thread( &Segment::Run, this )
+  {
+  }
+
+  ~Segment()
+  {
+    m_Output.Cancel();
+    m_Thread.join();
+  }
+
+  // Returns the next buffer of decoded samples, or nullopt once the whole segment has been returned.
+  std::optional<SampleBuffer> Pop()
+  {
+    return m_Output.Pop();
+  }
+
+private:
+  void Run()
+  {
+    const int streamIndex = m_Decoder.m_StreamIndex;
+    std::unique_ptr<FFmpegMappedIO> mappedIO;
+    AVFormatContext* formatContext = nullptr;
+    AVCodecContext* codecContext = nullptr;
+    SwrContext* resampleContext = nullptr;
+    FFmpegContextPool& pool = FFmpegContextPool::Get();
+    PacketPtr packetPtr = m_Decoder.AcquirePacket();
+    AVPacket* packet = packetPtr.get();
+    AVFrame* frame = pool.AcquireFrame();
+
+    bool valid = ( nullptr != packet ) && ( nullptr != frame ) && ( 0 == FFmpegMappedIO::OpenInput( &formatContext, m_Decoder.m_Filename, mappedIO ) ) && ( static_cast<unsigned int>( streamIndex ) < formatContext->nb_streams );
+    if ( valid ) {
+      for ( unsigned int i = 0; i < formatContext->nb_streams; i++ )
+        formatContext->streams[ i ]->discard = ( static_cast<int>( i ) == streamIndex ) ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+
+      // Use the same codec parameters as the main decoder, with each segment decoded on a single thread.
+      codecContext = pool.AcquireDecoder( m_Decoder.m_DecoderContext->codec, m_Decoder.m_FormatContext->streams[ streamIndex ]->codecpar, 1 );
+      valid = ( nullptr != codecContext );
+      resampleContext = m_Decoder.CreateResampleContext( codecContext );
+      valid = valid && ( nullptr != resampleContext );
+      if ( valid && m_Range.Seek )
+        valid = ( av_seek_frame( formatContext, streamIndex, m_Range.Start, AVSEEK_FLAG_BACKWARD ) >= 0 );
+    }
+
+    bool finished = !valid;
+    while ( !finished && !m_Output.IsCancelled() ) {
+      // Packets are decoded from the start of the segment up to (but not including) the first packet of the next segment, after which the decoder is flushed.
+      finished = ( av_read_frame( formatContext, packet ) < 0 );
+      if ( !finished ) {
+        if ( streamIndex != packet->stream_index ) {
+          av_packet_unref( packet );
+          continue;
+        }
+        if ( AV_NOPTS_VALUE != packet->pts ) {
+          if ( m_Range.Seek && ( packet->pts < m_Range.Start ) ) {
+            av_packet_unref( packet );
+            continue;
+          }
+          if ( m_Range.End && ( packet->pts >= *m_Range.End ) )
+            finished = true;
+        }
+      }
+      SampleBuffer buffer = m_Decoder.AcquireBuffer();
+      m_Decoder.DecodePacket( codecContext, frame, resampleContext, finished ? nullptr : packet, buffer );
+      av_packet_unref( packet );
+      if ( 0 == buffer.Size )
+        m_Decoder.ReleaseBuffer( std::move( buffer ) );
+      else if ( !m_Output.Push( std::move( buffer ) ) )
+        break;
+    }
+    m_Output.Close();
+
+    m_Decoder.ReleasePacket( std::move( packetPtr ) );
+    pool.ReleaseFrame( frame );
+    pool.ReleaseResampler( resampleContext );
+    pool.ReleaseDecoder( codecContext );
+    avformat_close_input( &formatContext );
+  }
+
+  FFmpegDecoder& m_Decoder;
+  const SegmentRange m_Range;
+
+  // The whole segment is held in memory, with the number of segments decoded at once limiting the total.
+  BoundedQueue<SampleBuffer> m_Output{ std::numeric_limits<size_t>::max() };
+
+  std::thread m_Thread;
+};
+
+struct FFmpegDecoder::TrackWriter
+{
+  TrackWriter( FFmpegDecoder& decoder, const AVStream* stream, std::unique_ptr<FFmpegTrackCache> cache ) :
+    m_Decoder( decoder ),
+    m_Cache( std::move( cache ) )
+  {
+    // Each of the other streams is decoded on a single thread, since they are all decoded at once.
+    const AVCodec* codec = avcodec_find_decoder( stream->codecpar->codec_id );
+    FFmpegContextPool& pool = FFmpegContextPool::Get();
+    m_CodecContext = ( nullptr != codec ) ? pool.AcquireDecoder( codec, stream->codecpar, 1 ) : nullptr;
+    if ( nullptr != m_CodecContext ) {
+      m_ResampleContext = decoder.CreateResampleContext( m_CodecContext );
+      m_Frame = pool.AcquireFrame();
+      if ( ( nullptr != m_ResampleContext ) && ( nullptr != m_Frame ) )
+        m_Thread = std::thread( &TrackWriter::Run, this );
+    }
+  }
+
+  ~TrackWriter()
+  {
+    m_Packets.Cancel();
+    if ( m_Thread.joinable() )
+      m_Thread.join();
+    FFmpegContextPool& pool = FFmpegContextPool::Get();
+    pool.ReleaseFrame( m_Frame );
+    pool.ReleaseResampler( m_ResampleContext );
+    pool.ReleaseDecoder( m_CodecContext );
+  }
+
+  bool IsValid() const { return m_Thread.joinable(); }
+
+  // Queues a packet for decoding, returning false if the writer has been cancelled.
+  bool Push( PacketPtr packet ) { return m_Packets.Push( std::move( packet ) ); }
+
+  // Signals the end of the stream, after which the decoder is flushed and the cache finished.
+  void Close() { m_Packets.Close(); }
+
+  void Cancel() { m_Packets.Cancel(); }
+
+private:
+  void Run()
+  {
+    bool valid = true;
+    while ( valid ) {
+      auto packet = m_Packets.Pop();
+      if ( !packet && m_Packets.IsCancelled() )
+        return;
+
+      SampleBuffer buffer = m_Decoder.AcquireBuffer();
+      m_Decoder.DecodePacket( m_CodecContext, m_Frame, m_ResampleContext, packet ? packet->get() : nullptr, buffer );
+      if ( buffer.Size > 0 )
+        valid = m_Cache->Write( buffer.Data.get(), buffer.Size );
+      m_Decoder.ReleaseBuffer( std::move( buffer ) );
+      if ( !packet ) {
+        m_Cache->Finish();
+        return;
+      }
+      m_Decoder.ReleasePacket( std::move( *packet ) );
+    }
+    // Keep accepting packets, so that the demux thread is not held up by a failed cache.
+    while ( auto packet = m_Packets.Pop() )
+      m_Decoder.ReleasePacket( std::move( *packet ) );
+  }
+
+  FFmpegDecoder& m_Decoder;
+  std::unique_ptr<FFmpegTrackCache> m_Cache;
+  AVCodecContext* m_CodecContext = nullptr;
+  SwrContext* m_ResampleContext = nullptr;
+  AVFrame* m_Frame = nullptr;
+  BoundedQueue<PacketPtr> m_Packets{ kPacketQueueSize };
+  std::thread m_Thread;
+};
+
 std::string FFmpegDecoder::GetVersion()
 {
   return ( nullptr != av_version_info() ) ? std::string( "FFmpeg " ) + av_version_info() : std::string( "FFmpeg" );
 }
 
-FFmpegDecoder::FFmpegDecoder( const std::string& filename )
+FFmpegDecoder::FFmpegDecoder( const std::string& filename, const Options& options )
 {
 	m_FormatContext = avformat_alloc_context();
 	if ( nullptr != m_FormatContext ) {
-		if ( 0 == avformat_open_input( &m_FormatContext, filename.c_str(), nullptr, nullptr ) ) {
-			if ( avformat_find_stream_info( m_FormatContext, nullptr ) >= 0 ) {
+		if ( 0 == FFmpegMappedIO::OpenInput( &m_FormatContext, filename, m_MappedIO, options.FastProbe ) ) {
+			if ( FindStreamInfo( filename, options ) ) {
 				const AVCodec* codec = nullptr;
-				m_StreamIndex = av_find_best_stream( m_FormatContext, AVMediaType::AVMEDIA_TYPE_AUDIO, -1, -1, &codec, 0 );
+				m_StreamIndex = av_find_best_stream( m_FormatContext, AVMediaType::AVMEDIA_TYPE_AUDIO, FindAudioStream( options.AudioTrack ), -1, &codec, 0 );
 				if ( ( m_StreamIndex >= 0 ) && ( nullptr != codec ) ) {
+          DiscardOtherStreams( m_StreamIndex, options.CacheTracks );
 					if ( AVStream* stream = m_FormatContext->streams[ m_StreamIndex ]; nullptr != stream ) {
 						if ( AVCodecParameters* codecParams = stream->codecpar; nullptr != codecParams ) {
 							if ( codecParams->ch_layout.nb_channels > 0 ) {
 								m_Channels = std::min( 2u, static_cast<uint32_t>( codecParams->ch_layout.nb_channels ) );
 								m_SampleRate = static_cast<uint32_t>( codecParams->sample_rate );
+                m_SourceSampleRate = m_SampleRate;
+                m_ResampleQuality = options.Quality;
 
                 if ( codecParams->bit_rate > 0 )
 									m_BitRate = static_cast<uint32_t>( std::lroundf( codecParams->bit_rate / 1000.0f ) );
@@ -37,20 +301,30 @@ FFmpegDecoder::FFmpegDecoder( const std::string& filename )
                 const double duration = ( stream->duration > 0 ) ? ( stream->duration * av_q2d( stream->time_base ) ) : ( static_cast<double>( m_FormatContext->duration ) / AV_TIME_BASE );
                 m_TotalSamples = static_cast<uint64_t>( std::llround( duration * m_SampleRate ) );
 
-                const int bitsPerSample = std::max( codecParams->bits_per_coded_sample, codecParams->bits_per_raw_sample );
-                switch ( bitsPerSample ) {
-                  case 8:
-                  case 16:
-                  case 32:
-                    m_BitsPerSample = bitsPerSample;
-                    break;
-                  default:
-                    m_BitsPerSample = 32;
-                    break;
+                // The duration is only an estimate for many formats, so use an exact count of the samples in each packet if required.
+                if ( options.ExactLength ) {
+                  m_Index = FFmpegIndex::Load( filename, m_StreamIndex );
+                  if ( !m_Index ) {
+                    m_Index = FFmpegIndex::Scan( filename, m_StreamIndex );
+                    if ( m_Index )
+                      m_Index->Save();
+                  }
+                  if ( m_Index && ( m_Index->GetSampleRate() == m_SampleRate ) )
+                    m_TotalSamples = m_Index->GetTotalSamples();
                 }
-                // Don't use 32-bit samples if this will take us over Cool Edit's 2Gb limit.
-                if ( ( 32 == m_BitsPerSample ) && ( m_TotalSamples * m_Channels * 32 / 8 ) > std::numeric_limits<int>().max() )
-                  m_BitsPerSample = 16;
+
+                ApplyRange( filename, options );
+
+                // When converting to a different sample rate, all sample positions from here on are in terms of the output rate.
+                if ( ( options.SampleRate > 0 ) && ( m_SourceSampleRate > 0 ) && ( static_cast<uint32_t>( options.SampleRate ) != m_SourceSampleRate ) ) {
+                  m_SampleRate = static_cast<uint32_t>( options.SampleRate );
+                  m_TotalSamples = GetOutputPosition( m_TotalSamples );
+                  m_RangeStart = GetOutputPosition( m_RangeStart );
+                  if ( m_RangeRemaining )
+                    m_RangeRemaining = m_TotalSamples;
+                }
+
+                m_BitsPerSample = GetBitsPerSample( codecParams, m_TotalSamples, m_Channels );
 
                 if ( nullptr != codec->long_name )
                   m_Description = std::string( codec->long_name ) + "\n";
@@ -59,40 +333,50 @@ FFmpegDecoder::FFmpegDecoder( const std::string& filename )
                 if ( m_BitRate > 0 )
                   m_Description += std::to_string( m_BitRate ) + " kbps, ";
                 m_Description += std::to_string( codecParams->ch_layout.nb_channels ) + std::string( ( 1 == codecParams->ch_layout.nb_channels ) ? " channel" : " channels" );
+                if ( m_SampleRate != m_SourceSampleRate )
+                  m_Description += ", resampled from " + std::to_string( m_SourceSampleRate ) + " Hz";
+                int audioTracks = 0;
+                int track = 0;
+                for ( unsigned int i = 0; i < m_FormatContext->nb_streams; i++ ) {
+                  if ( AVMEDIA_TYPE_AUDIO == m_FormatContext->streams[ i ]->codecpar->codec_type ) {
+                    if ( static_cast<int>( i ) == m_StreamIndex )
+                      track = audioTracks + 1;
+                    audioTracks++;
+                  }
+                }
+                if ( audioTracks > 1 )
+                  m_Description += "\nTrack " + std::to_string( track ) + " of " + std::to_string( audioTracks );
+                if ( m_RangeRemaining ) {
+                  const int32_t start = static_cast<int32_t>( std::min<uint64_t>( m_RangeStart * 1000 / m_SampleRate, std::numeric_limits<int32_t>::max() ) );
+                  const int32_t end = static_cast<int32_t>( std::min<uint64_t>( ( m_RangeStart + m_TotalSamples ) * 1000 / m_SampleRate, std::numeric_limits<int32_t>::max() ) );
+                  m_Description += "\nRange " + Options::FormatTime( start ) + " - " + Options::FormatTime( end );
+                }
+                ReadChapters();
 
-								m_DecoderContext = avcodec_alloc_context3( codec );
+                // Frame threading is used by decoders which support it (e.g. ALAC, FLAC and WavPack), otherwise slice threading.
+                // A pooled decoder left open by a previous file with the same codec parameters is reused, if there is one.
+                FFmpegContextPool& pool = FFmpegContextPool::Get();
+								m_DecoderContext = pool.AcquireDecoder( codec, codecParams, options.ThreadCount, [] ( AVCodecContext* decoderContext ) {
+                  decoderContext->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+                } );
 								if ( nullptr != m_DecoderContext ) {
-									int result = avcodec_parameters_to_context( m_DecoderContext, codecParams );
-									if ( result >= 0 )
-										result = avcodec_open2( m_DecoderContext, codec, nullptr );
-									if ( result >= 0 ) {
-										m_Packet = av_packet_alloc();
-										m_Frame = av_frame_alloc();
-
-                    const auto srcLayout = m_DecoderContext->ch_layout;
-                    const auto srcFormat = m_DecoderContext->sample_fmt;
-                    AVChannelLayout dstLayout = {};
-                    av_channel_layout_default( &dstLayout, static_cast<int>( m_Channels ) );
-                    AVSampleFormat dstFormat = AV_SAMPLE_FMT_NONE;
-                    switch ( m_BitsPerSample ) {
-                      case 8:
-                        dstFormat = AV_SAMPLE_FMT_U8;
-                        break;
-                      case 16:
-                        dstFormat = AV_SAMPLE_FMT_S16;
-                        break;
-                      case 32:
-                        dstFormat = AV_SAMPLE_FMT_FLT;
-                        break;
-                    }
-                    result = swr_alloc_set_opts2( &m_ResampleContext, &dstLayout, dstFormat, codecParams->sample_rate, &srcLayout, srcFormat, codecParams->sample_rate, 0, nullptr );
-                    if ( result >= 0 ) {
-                      if ( swr_init( m_ResampleContext ) < 0 ) {
-                        swr_free( &m_ResampleContext );
-                        m_ResampleContext = nullptr;
-                      }
-                    }
-									}
+									m_Packet = av_packet_alloc();
+									m_Frame = pool.AcquireFrame();
+
+                  // Size the sample buffers to hold several frames of the largest size expected from the codec.
+                  constexpr size_t kMinimumBufferSize = 65536;
+                  const size_t frameSize = static_cast<size_t>( GetOutputPosition( static_cast<uint64_t>( std::max( { m_DecoderContext->frame_size, codecParams->frame_size, 0 } ) ) ) + 1 );
+                  m_BufferSize = std::max( kMinimumBufferSize, 4 * frameSize * m_Channels * m_BitsPerSample / 8 );
+
+                  m_ResampleContext = CreateResampleContext( m_DecoderContext );
+
+                  // Codecs without inter-frame state can be decoded in separate segments, given an index of the packets.
+                  m_Filename = filename;
+                  SeekToRange();
+                  CreateSegments( options );
+
+                  if ( options.CacheTracks && !m_RangeRemaining )
+                    OpenTrackCache( filename );
 								}
 							}
 						}
@@ -103,44 +387,420 @@ FFmpegDecoder::FFmpegDecoder( const std::string& filename )
 	}
 
 	if ( ( nullptr == m_FormatContext ) || ( nullptr == m_DecoderContext ) || ( nullptr == m_Packet ) || ( nullptr == m_Frame ) || ( nullptr == m_ResampleContext ) ) {
-		if ( nullptr != m_Packet ) {
-			av_packet_free( &m_Packet );
-		}
-		if ( nullptr != m_Frame ) {
-			av_frame_free( &m_Frame );
-		}
-		if ( nullptr != m_DecoderContext ) {
-			avcodec_free_context( &m_DecoderContext );
-		}
+		FFmpegContextPool& pool = FFmpegContextPool::Get();
+		av_packet_free( &m_Packet );
+		pool.ReleaseFrame( m_Frame );
+		pool.ReleaseDecoder( m_DecoderContext );
 		if ( nullptr != m_FormatContext ) {
 			avformat_close_input( &m_FormatContext );
 		}
-		if ( nullptr != m_ResampleContext ) {
-			swr_free( &m_ResampleContext );
-		}
+		pool.ReleaseResampler( m_ResampleContext );
 		throw std::runtime_error( "FFmpegDecoder failed to initialise" );
 	}
 }
 
 FFmpegDecoder::~FFmpegDecoder()
 {
-	if ( nullptr != m_Packet ) {
-		av_packet_free( &m_Packet );
-	}
-	av_frame_free( &m_Frame );
-	avcodec_free_context( &m_DecoderContext );
+  m_Segments.clear();
+  StopThreads( m_ReadComplete );
+  FFmpegContextPool& pool = FFmpegContextPool::Get();
+  av_packet_free( &m_Packet );
+  pool.ReleaseFrame( m_Frame );
+  pool.ReleaseDecoder( m_DecoderContext );
 	avformat_close_input( &m_FormatContext );
-  swr_free( &m_ResampleContext );
+  pool.ReleaseResampler( m_ResampleContext );
+}
+
+std::optional<int32_t> FFmpegDecoder::Options::ParseTime( const std::string& time )
+{
+  double seconds = 0;
+  size_t start = 0;
+  try {
+    while ( start <= time.size() ) {
+      const size_t end = std::min( time.find( ':', start ), time.size() );
+      size_t processed = 0;
+      const std::string field = time.substr( start, end - start );
+      const double value = std::stod( field, &processed );
+      if ( ( processed != field.size() ) || ( value < 0 ) )
+        return std::nullopt;
+      seconds = seconds * 60 + value;
+      start = end + 1;
+    }
+  } catch ( const std::logic_error& ) {
+    return std::nullopt;
+  }
+  if ( seconds * 1000 > std::numeric_limits<int32_t>::max() )
+    return std::nullopt;
+  return static_cast<int32_t>( std::llround( seconds * 1000 ) );
+}
+
+std::string FFmpegDecoder::Options::FormatTime( const int32_t milliseconds )
+{
+  std::array<char, 32> buffer = {};
+  snprintf( buffer.data(), buffer.size(), "%d:%02d:%02d.%03d", milliseconds / 3600000, ( milliseconds / 60000 ) % 60, ( milliseconds / 1000 ) % 60, milliseconds % 1000 );
+  return buffer.data();
+}
+
+void FFmpegDecoder::ApplyRange( const std::string& filename, const Options& options )
+{
+  std::optional<int32_t> start;
+  std::optional<int32_t> end;
+
+  // A sidecar file takes precedence over the options.
+  if ( std::ifstream sidecar( std::filesystem::path( UTF8ToWideString( filename + ".range" ) ) ); sidecar.is_open() ) {
+    std::string startTime, endTime;
+    sidecar >> startTime >> endTime;
+    start = Options::ParseTime( startTime );
+    end = endTime.empty() ? std::nullopt : Options::ParseTime( endTime );
+  } else if ( options.Range ) {
+    start = options.RangeStart;
+    if ( options.RangeEnd > 0 )
+      end = options.RangeEnd;
+  }
+  if ( !start || ( 0 == m_SampleRate ) )
+    return;
+
+  m_RangeStart = std::min( static_cast<uint64_t>( *start ) * m_SampleRate / 1000, m_TotalSamples );
+  const uint64_t rangeEnd = end ? std::clamp( static_cast<uint64_t>( *end ) * m_SampleRate / 1000, m_RangeStart, m_TotalSamples ) : m_TotalSamples;
+  m_TotalSamples = rangeEnd - m_RangeStart;
+  m_RangeRemaining = m_TotalSamples;
+
+  // Allow a little extra beyond the end of the range, to cover any decoder delay.
+  const AVStream* stream = m_FormatContext->streams[ m_StreamIndex ];
+  const int64_t startTime = ( AV_NOPTS_VALUE != stream->start_time ) ? stream->start_time : 0;
+  m_DemuxEndTimestamp = startTime + av_rescale_q( static_cast<int64_t>( rangeEnd + m_SampleRate ), AVRational{ 1, static_cast<int>( m_SampleRate ) }, stream->time_base );
+}
+
+void FFmpegDecoder::SeekToRange()
+{
+  if ( !m_RangeRemaining || ( 0 == m_RangeStart ) )
+    return;
+
+  // Decoding starts at least one frame (plus the codec delay) ahead of the range, so that the first frame in the range is decoded with its overlap from the previous frame.
+  // The samples before the range are then trimmed as usual.
+  const AVStream* stream = m_FormatContext->streams[ m_StreamIndex ];
+  const AVCodecParameters* codecParams = stream->codecpar;
+  const int64_t frameSize = std::max( codecParams->frame_size, m_DecoderContext->frame_size );
+  const int64_t preRoll = std::max<int64_t>( ( ( frameSize > 0 ) ? frameSize : kDefaultRangePreRoll ) + std::max( codecParams->initial_padding, 0 ), codecParams->seek_preroll );
+
+  // The position to decode from is at the sample rate of the file (as are the index positions).
+  const int64_t position = std::max<int64_t>( av_rescale( static_cast<int64_t>( m_RangeStart ), m_SourceSampleRate, m_SampleRate ) - preRoll, 0 );
+
+  // Use an indexed key frame if there is one, otherwise let the demuxer find the nearest key frame before the position.
+  const int64_t startTime = ( AV_NOPTS_VALUE != stream->start_time ) ? stream->start_time : 0;
+  int64_t timestamp = startTime + av_rescale_q( position, AVRational{ 1, static_cast<int>( m_SourceSampleRate ) }, stream->time_base );
+  if ( m_Index ) {
+    const auto seekPoint = m_Index->FindSeekPoint( static_cast<uint64_t>( position ) );
+    timestamp = seekPoint ? seekPoint->Timestamp : startTime;
+  }
+
+  // If seeking fails, decoding starts from the beginning and the samples before the range are skipped.
+  m_RangeTrimmed = false;
+  if ( av_seek_frame( m_FormatContext, m_StreamIndex, timestamp, AVSEEK_FLAG_BACKWARD ) < 0 ) {
+    m_FirstFramePosition = 0;
+  } else {
+    m_TrackFirstFrame = true;
+    avcodec_flush_buffers( m_DecoderContext );
+  }
+}
+
+bool FFmpegDecoder::FindStreamInfo( const std::string& filename, const Options& options )
+{
+  // If the container header describes the streams, discard everything apart from the audio before probing, so that video is not decoded to find its parameters.
+  if ( const int streamIndex = av_find_best_stream( m_FormatContext, AVMediaType::AVMEDIA_TYPE_AUDIO, FindAudioStream( options.AudioTrack ), -1, nullptr, 0 ); streamIndex >= 0 )
+    DiscardOtherStreams( streamIndex, options.CacheTracks );
+  const bool found = ( avformat_find_stream_info( m_FormatContext, nullptr ) >= 0 );
+  if ( !options.FastProbe )
+    return found;
+
+  // The limited probe might have stopped before the audio stream was found, or before its parameters were known.
+  if ( found ) {
+    const int streamIndex = av_find_best_stream( m_FormatContext, AVMediaType::AVMEDIA_TYPE_AUDIO, FindAudioStream( options.AudioTrack ), -1, nullptr, 0 );
+    if ( streamIndex >= 0 ) {
+      const AVCodecParameters* codecParams = m_FormatContext->streams[ streamIndex ]->codecpar;
+      if ( ( AV_CODEC_ID_NONE != codecParams->codec_id ) && ( codecParams->sample_rate > 0 ) && ( codecParams->ch_layout.nb_channels > 0 ) && ( AV_SAMPLE_FMT_NONE != codecParams->format ) )
+        return true;
+    }
+  }
+
+  avformat_close_input( &m_FormatContext );
+  if ( 0 != FFmpegMappedIO::OpenInput( &m_FormatContext, filename, m_MappedIO ) )
+    return false;
+  Options fullProbe = options;
+  fullProbe.FastProbe = false;
+  return FindStreamInfo( filename, fullProbe );
+}
+
+void FFmpegDecoder::ReadChapters()
+{
+  // The chapter which is under way at the start of the range (if any) is marked at the start.
+  std::optional<Chapter> current;
+  const AVStream* stream = m_FormatContext->streams[ m_StreamIndex ];
+  for ( unsigned int i = 0; i < m_FormatContext->nb_chapters; i++ ) {
+    const AVChapter* chapter = m_FormatContext->chapters[ i ];
+    const uint64_t start = GetSamplePosition( av_rescale_q( chapter->start, chapter->time_base, stream->time_base ) );
+    const uint64_t end = GetSamplePosition( av_rescale_q( chapter->end, chapter->time_base, stream->time_base ) );
+    const AVDictionaryEntry* title = av_dict_get( chapter->metadata, "title", nullptr, 0 );
+    Chapter marker = { 0, ( ( nullptr != title ) && ( 0 != *title->value ) ) ? std::string( title->value ) : ( "Chapter " + std::to_string( 1 + i ) ) };
+    if ( start <= m_RangeStart ) {
+      if ( ( end > start ) && ( end <= m_RangeStart ) )
+        current.reset();
+      else
+        current = std::move( marker );
+    } else if ( start - m_RangeStart < m_TotalSamples ) {
+      marker.Position = start - m_RangeStart;
+      m_Chapters.push_back( std::move( marker ) );
+    }
+  }
+  if ( current )
+    m_Chapters.insert( m_Chapters.begin(), std::move( *current ) );
+}
+
+std::optional<std::string> FFmpegDecoder::GetTagValue( const std::string& name ) const
+{
+  // Dictionary keys are matched without regard to case.
+  const AVDictionaryEntry* tag = av_dict_get( m_FormatContext->metadata, name.c_str(), nullptr, 0 );
+  if ( nullptr == tag )
+    tag = av_dict_get( m_FormatContext->streams[ m_StreamIndex ]->metadata, name.c_str(), nullptr, 0 );
+  if ( nullptr != tag )
+    return std::string( tag->value );
+  return std::nullopt;
+}
+
+uint64_t FFmpegDecoder::GetSamplePosition( const int64_t timestamp ) const
+{
+  const AVStream* stream = m_FormatContext->streams[ m_StreamIndex ];
+  const int64_t startTime = ( AV_NOPTS_VALUE != stream->start_time ) ? stream->start_time : 0;
+  return static_cast<uint64_t>( std::max<int64_t>( 0, av_rescale_q( timestamp - startTime, stream->time_base, AVRational{ 1, static_cast<int>( m_SampleRate ) } ) ) );
+}
+
+// Sets the resampler's channel matrix to the one it would use by default, multiplied by the floating point scale for Cool Edit, so that no separate rescaling pass is needed.
+// Since the scale is a power of two, the output is identical to scaling afterwards.
+static bool SetScaledMatrix( SwrContext* resampleContext, const AVChannelLayout& srcLayout, const AVChannelLayout& dstLayout )
+{
+  // As in swr_init, an unspecified input layout is treated as the default layout for the number of channels.
+  AVChannelLayout inputLayout = {};
+  if ( ( AV_CHANNEL_ORDER_UNSPEC == srcLayout.order ) || ( av_channel_layout_copy( &inputLayout, &srcLayout ) < 0 ) )
+    av_channel_layout_default( &inputLayout, srcLayout.nb_channels );
+
+  double centerLevel = 0, surroundLevel = 0, lfeLevel = 0, volume = 0;
+  av_opt_get_double( resampleContext, "center_mix_level", 0, &centerLevel );
+  av_opt_get_double( resampleContext, "surround_mix_level", 0, &surroundLevel );
+  av_opt_get_double( resampleContext, "lfe_mix_level", 0, &lfeLevel );
+  av_opt_get_double( resampleContext, "rematrix_volume", 0, &volume );
+
+  const int inputChannels = inputLayout.nb_channels;
+  std::vector<double> matrix( static_cast<size_t>( inputChannels ) * dstLayout.nb_channels );
+  bool success = ( inputChannels > 0 ) && ( swr_build_matrix2( &inputLayout, &dstLayout, centerLevel, surroundLevel, lfeLevel, std::numeric_limits<int>::max(), volume, matrix.data(), inputChannels, AV_MATRIX_ENCODING_NONE, nullptr ) >= 0 );
+  if ( success ) {
+    std::for_each( matrix.begin(), matrix.end(), [] ( double& coefficient ) { coefficient *= kFloatScale; } );
+    success = ( swr_set_matrix( resampleContext, matrix.data(), inputChannels ) >= 0 );
+  }
+  av_channel_layout_uninit( &inputLayout );
+  return success;
+}
+
+SwrContext* FFmpegDecoder::CreateResampleContext( const AVCodecContext* decoderContext ) const
+{
+  const auto srcLayout = decoderContext->ch_layout;
+  const auto srcFormat = decoderContext->sample_fmt;
+  AVChannelLayout dstLayout = {};
+  av_channel_layout_default( &dstLayout, static_cast<int>( m_Channels ) );
+  AVSampleFormat dstFormat = AV_SAMPLE_FMT_NONE;
+  switch ( m_BitsPerSample ) {
+    case 8:
+      dstFormat = AV_SAMPLE_FMT_U8;
+      break;
+    case 16:
+      dstFormat = AV_SAMPLE_FMT_S16;
+      break;
+    case 32:
+      dstFormat = AV_SAMPLE_FMT_FLT;
+      break;
+  }
+  FFmpegContextPool::ResamplerKey key;
+  key.SrcLayout = srcLayout;
+  key.SrcFormat = srcFormat;
+  key.SrcRate = decoderContext->sample_rate;
+  key.DstChannels = static_cast<int>( m_Channels );
+  key.DstFormat = dstFormat;
+  key.DstRate = static_cast<int>( m_SampleRate );
+  key.Quality = static_cast<int32_t>( m_ResampleQuality );
+  return FFmpegContextPool::Get().AcquireResampler( key, [ & ] () {
+    SwrContext* resampleContext = nullptr;
+    if ( swr_alloc_set_opts2( &resampleContext, &dstLayout, dstFormat, static_cast<int>( m_SampleRate ), &srcLayout, srcFormat, decoderContext->sample_rate, 0, nullptr ) >= 0 ) {
+      if ( static_cast<int>( m_SampleRate ) != decoderContext->sample_rate ) {
+        // Longer filters (with more phases, and a cutoff closer to Nyquist) give a flatter passband and better stopband attenuation, at the cost of speed.
+        switch ( m_ResampleQuality ) {
+          case Options::ResampleQuality::Fast:
+            av_opt_set_int( resampleContext, "filter_size", 8, 0 );
+            av_opt_set_int( resampleContext, "phase_shift", 6, 0 );
+            av_opt_set_int( resampleContext, "linear_interp", 1, 0 );
+            av_opt_set_double( resampleContext, "cutoff", 0.9, 0 );
+            break;
+          case Options::ResampleQuality::Normal:
+            av_opt_set_int( resampleContext, "filter_size", 32, 0 );
+            av_opt_set_int( resampleContext, "phase_shift", 10, 0 );
+            av_opt_set_double( resampleContext, "cutoff", 0.97, 0 );
+            break;
+          case Options::ResampleQuality::Best:
+            av_opt_set_int( resampleContext, "filter_size", 64, 0 );
+            av_opt_set_int( resampleContext, "phase_shift", 14, 0 );
+            av_opt_set_int( resampleContext, "linear_interp", 1, 0 );
+            av_opt_set_double( resampleContext, "cutoff", 0.985, 0 );
+            break;
+        }
+      }
+      // Floating point audio is rescaled for Cool Edit as part of the conversion.
+      if ( ( ( AV_SAMPLE_FMT_FLT == dstFormat ) && !SetScaledMatrix( resampleContext, srcLayout, dstLayout ) ) || ( swr_init( resampleContext ) < 0 ) )
+        swr_free( &resampleContext );
+    }
+    return resampleContext;
+  } );
+}
+
+uint64_t FFmpegDecoder::GetOutputPosition( const uint64_t sourcePosition ) const
+{
+  return ( m_SampleRate == m_SourceSampleRate ) ? sourcePosition : static_cast<uint64_t>( av_rescale( static_cast<int64_t>( sourcePosition ), m_SampleRate, m_SourceSampleRate ) );
+}
+
+void FFmpegDecoder::CreateSegments( const Options& options )
+{
+  // Resampling is not split, since the resampler state at each segment boundary would be lost.
+  if ( !m_Index || m_RangeRemaining || ( 1 == options.ThreadCount ) || ( m_SampleRate != m_SourceSampleRate ) || ( nullptr == m_FormatContext->pb ) || ( 0 == ( m_FormatContext->pb->seekable & AVIO_SEEKABLE_NORMAL ) ) )
+    return;
+
+  // Decoding can only start at a key frame without affecting the output if the codec has no state carried between frames.
+  // This is not implied by the codec properties (e.g. lossless TrueHD and MLP decoders drop frames until the next major sync), so only codecs known to decode each frame independently are split.
+  const AVCodecID codecId = m_DecoderContext->codec_id;
+  const bool pcm = ( codecId >= AV_CODEC_ID_PCM_S16LE ) && ( codecId < AV_CODEC_ID_ADPCM_IMA_QT );
+  if ( !pcm && ( AV_CODEC_ID_FLAC != codecId ) && ( AV_CODEC_ID_ALAC != codecId ) && ( AV_CODEC_ID_WAVPACK != codecId ) && ( AV_CODEC_ID_TTA != codecId ) && ( AV_CODEC_ID_APE != codecId ) )
+    return;
+
+  // Divide the stream at the indexed key frames nearest to each segment boundary.
+  const uint64_t segmentLength = static_cast<uint64_t>( m_SampleRate ) * kSegmentSeconds;
+  const auto& seekPoints = m_Index->GetSeekPoints();
+  std::vector<SegmentRange> segments( 1 );
+  for ( const auto& seekPoint : seekPoints ) {
+    if ( ( seekPoint.Position > 0 ) && ( seekPoint.Position >= segments.size() * segmentLength ) ) {
+      segments.back().End = seekPoint.Timestamp;
+      segments.push_back( { seekPoint.Timestamp, std::nullopt, true } );
+    }
+  }
+  if ( segments.size() < 2 )
+    return;
+
+  m_SegmentRanges = std::move( segments );
+  // Each segment is held in memory until it is read, so limit the number of segments when choosing automatically.
+  m_MaximumSegments = ( options.ThreadCount > 0 ) ? static_cast<size_t>( options.ThreadCount ) : std::clamp( std::thread::hardware_concurrency(), 2u, 8u );
+}
+
+bool FFmpegDecoder::DecodeSegments()
+{
+  while ( !m_Segments.empty() || ( m_NextSegment < m_SegmentRanges.size() ) ) {
+    // Keep the maximum number of segments decoding, in order, ahead of the reader.
+    while ( ( m_Segments.size() < m_MaximumSegments ) && ( m_NextSegment < m_SegmentRanges.size() ) )
+      m_Segments.push_back( std::make_unique<Segment>( *this, m_SegmentRanges[ m_NextSegment++ ] ) );
+    if ( auto buffer = m_Segments.front()->Pop(); buffer ) {
+      m_Buffer = std::move( *buffer );
+      return true;
+    }
+    m_Segments.pop_front();
+  }
+  return false;
+}
+
+void FFmpegDecoder::DiscardOtherStreams( const int streamIndex, const bool keepAudio )
+{
+  // Packets for discarded streams are skipped by the demuxer (without being read into memory or parsed, for most containers).
+  for ( unsigned int i = 0; i < m_FormatContext->nb_streams; i++ ) {
+    if ( AVStream* stream = m_FormatContext->streams[ i ]; nullptr != stream )
+      stream->discard = ( ( static_cast<int>( i ) == streamIndex ) || ( keepAudio && ( AVMEDIA_TYPE_AUDIO == stream->codecpar->codec_type ) ) ) ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+  }
+}
+
+int FFmpegDecoder::FindAudioStream( const int32_t track ) const
+{
+  int32_t audioTrack = 0;
+  for ( unsigned int i = 0; ( track > 0 ) && ( i < m_FormatContext->nb_streams ); i++ ) {
+    if ( ( AVMEDIA_TYPE_AUDIO == m_FormatContext->streams[ i ]->codecpar->codec_type ) && ( ++audioTrack == track ) )
+      return static_cast<int>( i );
+  }
+  return -1;
+}
+
+uint32_t FFmpegDecoder::GetBitsPerSample( const AVCodecParameters* codecParams, const uint64_t totalSamples, const uint32_t channels )
+{
+  uint32_t bitsPerSample = 32;
+  switch ( std::max( codecParams->bits_per_coded_sample, codecParams->bits_per_raw_sample ) ) {
+    case 8:
+      bitsPerSample = 8;
+      break;
+    case 16:
+      bitsPerSample = 16;
+      break;
+  }
+  // Don't use 32-bit samples if this will take us over Cool Edit's 2Gb limit.
+  if ( ( 32 == bitsPerSample ) && ( totalSamples * channels * 32 / 8 ) > std::numeric_limits<int>().max() )
+    bitsPerSample = 16;
+  return bitsPerSample;
+}
+
+void FFmpegDecoder::OpenTrackCache( const std::string& filename )
+{
+  m_CachedTrack = FFmpegTrackCache::Open( filename, m_StreamIndex, m_SampleRate, m_Channels, m_BitsPerSample );
+  if ( m_CachedTrack ) {
+    m_TotalSamples = m_CachedTrack->GetTotalSamples();
+    m_Description += " (cached)";
+  } else {
+    m_CacheTracks = true;
+  }
+  // Segments are decoded separately from the other streams, so they cannot be used when caching.
+  m_SegmentRanges.clear();
+}
+
+void FFmpegDecoder::StartTrackWriters()
+{
+  m_CacheWriter = FFmpegTrackCache::Create( m_Filename, m_StreamIndex, m_SampleRate, m_Channels, m_BitsPerSample );
+  if ( !m_CacheWriter )
+    return;
+
+  // The other streams are decoded to the same output format as this stream, so only those which would be imported in that format are cached
+  // (apart from any which already have a cache).
+  for ( unsigned int i = 0; i < m_FormatContext->nb_streams; i++ ) {
+    AVStream* stream = m_FormatContext->streams[ i ];
+    const AVCodecParameters* codecParams = stream->codecpar;
+    if ( ( static_cast<int>( i ) == m_StreamIndex ) || ( AVMEDIA_TYPE_AUDIO != codecParams->codec_type ) || ( codecParams->ch_layout.nb_channels <= 0 ) )
+      continue;
+    const uint32_t channels = std::min( 2u, static_cast<uint32_t>( codecParams->ch_layout.nb_channels ) );
+    const double duration = ( stream->duration > 0 ) ? ( stream->duration * av_q2d( stream->time_base ) ) : ( static_cast<double>( m_FormatContext->duration ) / AV_TIME_BASE );
+    const uint64_t totalSamples = static_cast<uint64_t>( std::llround( std::max( duration, 0.0 ) * m_SampleRate ) );
+    const bool sameRate = ( m_SampleRate != m_SourceSampleRate ) || ( static_cast<uint32_t>( codecParams->sample_rate ) == m_SampleRate );
+    const bool sameFormat = sameRate && ( channels == m_Channels ) && ( GetBitsPerSample( codecParams, totalSamples, channels ) == m_BitsPerSample );
+    if ( sameFormat && !FFmpegTrackCache::Open( m_Filename, static_cast<int32_t>( i ), m_SampleRate, m_Channels, m_BitsPerSample ) ) {
+      if ( auto cache = FFmpegTrackCache::Create( m_Filename, static_cast<int32_t>( i ), m_SampleRate, m_Channels, m_BitsPerSample ); cache ) {
+        if ( auto writer = std::make_unique<TrackWriter>( *this, stream, std::move( cache ) ); writer->IsValid() )
+          m_TrackWriters.emplace( static_cast<int>( i ), std::move( writer ) );
+      }
+    }
+    if ( m_TrackWriters.end() == m_TrackWriters.find( static_cast<int>( i ) ) )
+      stream->discard = AVDISCARD_ALL;
+  }
 }
 
 uint32_t FFmpegDecoder::Read( unsigned char* destBuffer, const long byteCount )
 {
-  const uint32_t sampleCount = static_cast<uint32_t>( byteCount ) / m_Channels / ( m_BitsPerSample / 8 );
+  uint32_t sampleCount = static_cast<uint32_t>( byteCount ) / m_Channels / ( m_BitsPerSample / 8 );
+  if ( m_CachedTrack )
+    return static_cast<uint32_t>( m_CachedTrack->Read( destBuffer, sampleCount * m_Channels * m_BitsPerSample / 8 ) );
+
+  if ( m_RangeRemaining )
+    sampleCount = static_cast<uint32_t>( std::min<uint64_t>( sampleCount, *m_RangeRemaining ) );
 	uint32_t samplesRead = 0;
 	while ( samplesRead < sampleCount ) {
-		if ( m_BufferPos < m_Buffer.size() ) {
-      const uint32_t samplesToRead = std::min( ( m_Buffer.size() - m_BufferPos ) / m_Channels / ( m_BitsPerSample / 8 ), sampleCount - samplesRead );
-      const auto srcFirst = m_Buffer.begin() + m_BufferPos;
+		if ( m_BufferPos < m_Buffer.Size ) {
+      const uint32_t samplesToRead = std::min<uint32_t>( ( m_Buffer.Size - m_BufferPos ) / m_Channels / ( m_BitsPerSample / 8 ), sampleCount - samplesRead );
+      const auto srcFirst = m_Buffer.Data.get() + m_BufferPos;
       const auto srcLast = srcFirst + samplesToRead * m_Channels * m_BitsPerSample / 8;
       std::copy( srcFirst, srcLast, destBuffer );
       samplesRead += samplesToRead;
@@ -150,50 +810,321 @@ uint32_t FFmpegDecoder::Read( unsigned char* destBuffer, const long byteCount )
 			break;
 		}
 	}
+  if ( m_RangeRemaining )
+    *m_RangeRemaining -= samplesRead;
+  m_SamplesRead += samplesRead;
+  if ( ( samplesRead < sampleCount ) || ( ( m_TotalSamples > 0 ) && ( m_SamplesRead >= m_TotalSamples ) ) )
+    m_ReadComplete = true;
 	return samplesRead * m_Channels * m_BitsPerSample / 8;
 }
 
 bool FFmpegDecoder::Decode()
 {
-	m_Buffer.clear();
-	m_BufferPos = 0;
-	while ( ( nullptr != m_Packet ) && m_Buffer.empty() ) {
-		if ( av_read_frame( m_FormatContext, m_Packet ) < 0 ) {
-			// Flush the decoder.
-			av_packet_free( &m_Packet );
-			m_Packet = nullptr;
-		}
-		if ( ( nullptr == m_Packet ) || ( m_StreamIndex == m_Packet->stream_index ) ) {
-			int result = avcodec_send_packet( m_DecoderContext, m_Packet );
-			while ( result >= 0 ) {
-				result = avcodec_receive_frame( m_DecoderContext, m_Frame );
-				if ( result >= 0 ) {
-					ConvertSampleData( m_Frame );
-					av_frame_unref( m_Frame );
-				}
-			}
-		}
-		if ( nullptr != m_Packet ) {
-			av_packet_unref( m_Packet );
-		}
-	}
-	return !m_Buffer.empty();
+  m_BufferPos = 0;
+  if ( m_Buffer.Data )
+    ReleaseBuffer( std::move( m_Buffer ) );
+  m_Buffer = {};
+  if ( !m_SegmentRanges.empty() )
+    return DecodeSegments();
+
+  if ( !m_DecodeThread.joinable() ) {
+    if ( m_CacheTracks )
+      StartTrackWriters();
+    m_DemuxThread = std::thread( &FFmpegDecoder::DemuxThread, this );
+    m_DecodeThread = std::thread( &FFmpegDecoder::DecodeThread, this );
+  }
+  if ( auto buffer = m_SampleQueue.Pop(); buffer ) {
+    m_Buffer = std::move( *buffer );
+    if ( !m_RangeTrimmed ) {
+      // Skip any samples before the start of the range, given the position of the first decoded frame (which is set before its buffer is queued).
+      const uint64_t frameBytes = m_Channels * m_BitsPerSample / 8;
+      if ( !m_TrimPosition ) {
+        const int64_t firstFramePosition = m_FirstFramePosition;
+        m_TrimPosition = ( firstFramePosition >= 0 ) ? static_cast<uint64_t>( firstFramePosition ) : m_RangeStart;
+      }
+      const uint64_t skipBytes = ( m_RangeStart > *m_TrimPosition ) ? ( m_RangeStart - *m_TrimPosition ) * frameBytes : 0;
+      if ( skipBytes >= m_Buffer.Size ) {
+        *m_TrimPosition += m_Buffer.Size / frameBytes;
+        m_Buffer.Size = 0;
+        return true;
+      }
+      m_BufferPos = static_cast<uint32_t>( skipBytes );
+      m_RangeTrimmed = true;
+    }
+    return true;
+  }
+  return false;
 }
 
-void FFmpegDecoder::ConvertSampleData( const AVFrame* frame )
+void FFmpegDecoder::DemuxThread()
 {
-  const uint32_t previousBufferSize = m_Buffer.size();
-  m_Buffer.resize( previousBufferSize + frame->nb_samples * m_Channels * m_BitsPerSample / 8 );
-  uint8_t* buffer = m_Buffer.data() + previousBufferSize;
-  const int samples = swr_convert( m_ResampleContext, &buffer, frame->nb_samples, frame->data, frame->nb_samples );
-  if ( samples > 0 ) {
-    m_Buffer.resize( previousBufferSize + samples * m_Channels * m_BitsPerSample / 8 );
-    if ( 32 == m_BitsPerSample ) {
-      // Floating point audio needs to be rescaled for Cool Edit.
-      float* buf = reinterpret_cast<float*>( m_Buffer.data() + previousBufferSize );
-      std::for_each( buf, buf + samples * m_Channels, [] ( float& f ) { f *= 32768.f; } );
+  while ( !m_StopDemux && ( av_read_frame( m_FormatContext, m_Packet ) >= 0 ) ) {
+    if ( m_RangeRemaining && ( AV_NOPTS_VALUE != m_Packet->pts ) && ( m_Packet->pts > m_DemuxEndTimestamp ) && ( m_StreamIndex == m_Packet->stream_index ) )
+      break;
+    const auto writer = m_TrackWriters.find( m_Packet->stream_index );
+    if ( ( m_StreamIndex == m_Packet->stream_index ) || ( m_TrackWriters.end() != writer ) ) {
+      PacketPtr packet = AcquirePacket();
+      if ( !packet )
+        break;
+      av_packet_move_ref( packet.get(), m_Packet );
+      // Carry on reading the other streams being cached if the decode thread has stopped.
+      if ( m_TrackWriters.end() != writer )
+        writer->second->Push( std::move( packet ) );
+      else if ( !m_PacketQueue.Push( std::move( packet ) ) && m_TrackWriters.empty() )
+        break;
+    } else {
+      av_packet_unref( m_Packet );
     }
-  } else {
-    m_Buffer.resize( previousBufferSize );
   }
+  av_packet_unref( m_Packet );
+  m_PacketQueue.Close();
+  for ( auto& [ streamIndex, writer ] : m_TrackWriters )
+    writer->Close();
+}
+
+void FFmpegDecoder::DecodeThread()
+{
+  while ( !m_PacketQueue.IsCancelled() ) {
+    auto packet = m_PacketQueue.Pop();
+    // A cancelled queue means decoding was abandoned, so the cache must not be finished (which would mark it as complete).
+    if ( !packet && m_PacketQueue.IsCancelled() )
+      break;
+    SampleBuffer buffer = AcquireBuffer();
+
+    // Once all the packets have been read (and the queue closed), flush the decoder to obtain any delayed output.
+    const bool flush = !packet.has_value();
+    DecodePacket( m_DecoderContext, m_Frame, m_ResampleContext, flush ? nullptr : packet->get(), buffer );
+    if ( !flush )
+      ReleasePacket( std::move( *packet ) );
+    if ( m_CacheWriter && ( buffer.Size > 0 ) && !m_CacheWriter->Write( buffer.Data.get(), buffer.Size ) )
+      m_CacheWriter.reset();
+    if ( 0 == buffer.Size )
+      ReleaseBuffer( std::move( buffer ) );
+    else if ( !m_SampleQueue.Push( std::move( buffer ) ) && !m_CacheWriter )
+      break;
+    if ( flush ) {
+      if ( m_CacheWriter )
+        m_CacheWriter->Finish();
+      break;
+    }
+  }
+  m_SampleQueue.Close();
+  // Release the demux thread, which may still be reading the other streams being cached.
+  m_PacketQueue.Cancel();
+}
+
+void FFmpegDecoder::StopThreads( const bool finishCaches )
+{
+  // When finishing the caches, the threads carry on until the end of the file, with the decoded samples for this stream no longer queued for reading.
+  if ( !finishCaches ) {
+    m_StopDemux = true;
+    m_PacketQueue.Cancel();
+    for ( auto& [ streamIndex, writer ] : m_TrackWriters )
+      writer->Cancel();
+  }
+  m_SampleQueue.Cancel();
+  if ( m_DemuxThread.joinable() )
+    m_DemuxThread.join();
+  if ( m_DecodeThread.joinable() )
+    m_DecodeThread.join();
+  m_TrackWriters.clear();
+  m_CacheWriter.reset();
+}
+
+void FFmpegDecoder::PacketDeleter::operator()( AVPacket* packet ) const
+{
+  av_packet_free( &packet );
+}
+
+void FFmpegDecoder::DecodePacket( AVCodecContext* decoderContext, AVFrame* frame, SwrContext* resampleContext, const AVPacket* packet, SampleBuffer& buffer )
+{
+  int result = avcodec_send_packet( decoderContext, packet );
+  if ( AVERROR( EAGAIN ) == result ) {
+    // A frame threaded decoder can hold several frames of output, which need to be received before the packet is accepted.
+    ReceiveFrames( decoderContext, frame, resampleContext, buffer );
+    result = avcodec_send_packet( decoderContext, packet );
+  }
+  // When flushing, frames are received until the decoder signals the end of the stream, which includes the delayed output of all the frame threads.
+  if ( result >= 0 )
+    ReceiveFrames( decoderContext, frame, resampleContext, buffer );
+  if ( nullptr == packet )
+    DrainResampler( resampleContext, buffer );
+}
+
+int FFmpegDecoder::ReceiveFrames( AVCodecContext* decoderContext, AVFrame* frame, SwrContext* resampleContext, SampleBuffer& buffer )
+{
+  int result = 0;
+  while ( result >= 0 ) {
+    result = avcodec_receive_frame( decoderContext, frame );
+    if ( result >= 0 ) {
+      if ( m_TrackFirstFrame && ( decoderContext == m_DecoderContext ) && ( AV_NOPTS_VALUE != frame->best_effort_timestamp ) ) {
+        m_FirstFramePosition = static_cast<int64_t>( GetSamplePosition( frame->best_effort_timestamp ) );
+        m_TrackFirstFrame = false;
+      }
+      ConvertSampleData( frame, resampleContext, buffer );
+      av_frame_unref( frame );
+    }
+  }
+  return result;
+}
+
+bool FFmpegDecoder::ConvertDirect( const AVFrame* frame, uint8_t* output ) const
+{
+  // Without any remixing, conversion is just a matter of interleaving and scaling, which can be done in a single pass.
+  if ( ( frame->ch_layout.nb_channels != static_cast<int>( m_Channels ) ) || ( frame->sample_rate != static_cast<int>( m_SampleRate ) ) )
+    return false;
+
+  const AVSampleFormat format = static_cast<AVSampleFormat>( frame->format );
+  const bool planar = ( 0 != av_sample_fmt_is_planar( format ) );
+  switch ( m_BitsPerSample ) {
+    case 16: {
+      int16_t* dest = reinterpret_cast<int16_t*>( output );
+      switch ( format ) {
+        case AV_SAMPLE_FMT_FLT:
+        case AV_SAMPLE_FMT_FLTP: {
+          const uint32_t converted = ConvertInt16SIMD( frame, planar, m_Channels, dest );
+          if ( converted < static_cast<uint32_t>( frame->nb_samples ) ) {
+            const uint32_t channels = m_Channels;
+            for ( uint32_t channel = 0; channel < channels; channel++ ) {
+              const float* input = reinterpret_cast<const float*>( frame->extended_data[ planar ? channel : 0 ] );
+              for ( uint32_t i = converted; i < static_cast<uint32_t>( frame->nb_samples ); i++ )
+                dest[ i * channels + channel ] = FloatToInt16( planar ? input[ i ] : input[ i * channels + channel ] );
+            }
+          }
+          return true;
+        }
+        case AV_SAMPLE_FMT_S16:
+        case AV_SAMPLE_FMT_S16P:
+          Interleave<int16_t>( frame, planar, m_Channels, dest, [] ( const int16_t s ) { return s; } );
+          return true;
+        case AV_SAMPLE_FMT_S32:
+        case AV_SAMPLE_FMT_S32P:
+          Interleave<int32_t>( frame, planar, m_Channels, dest, [] ( const int32_t s ) { return static_cast<int16_t>( s >> 16 ); } );
+          return true;
+        default:
+          return false;
+      }
+    }
+    case 32: {
+      float* dest = reinterpret_cast<float*>( output );
+      switch ( format ) {
+        case AV_SAMPLE_FMT_FLT:
+        case AV_SAMPLE_FMT_FLTP: {
+          const uint32_t converted = ConvertFloatSIMD( frame, planar, m_Channels, dest );
+          if ( converted < static_cast<uint32_t>( frame->nb_samples ) ) {
+            const uint32_t channels = m_Channels;
+            for ( uint32_t channel = 0; channel < channels; channel++ ) {
+              const float* input = reinterpret_cast<const float*>( frame->extended_data[ planar ? channel : 0 ] );
+              for ( uint32_t i = converted; i < static_cast<uint32_t>( frame->nb_samples ); i++ )
+                dest[ i * channels + channel ] = kFloatScale * ( planar ? input[ i ] : input[ i * channels + channel ] );
+            }
+          }
+          return true;
+        }
+        case AV_SAMPLE_FMT_S16:
+        case AV_SAMPLE_FMT_S16P:
+          Interleave<int16_t>( frame, planar, m_Channels, dest, [] ( const int16_t s ) { return static_cast<float>( s ); } );
+          return true;
+        case AV_SAMPLE_FMT_S32:
+        case AV_SAMPLE_FMT_S32P:
+          Interleave<int32_t>( frame, planar, m_Channels, dest, [] ( const int32_t s ) { return static_cast<float>( s ) * ( kFloatScale / 2147483648.f ); } );
+          return true;
+        default:
+          return false;
+      }
+    }
+    default:
+      return false;
+  }
+}
+
+// Grows the buffer to fit the given number of additional bytes (this only happens until the pooled buffers have reached a sufficient size).
+static void ReserveSampleBuffer( std::unique_ptr<uint8_t[]>& data, size_t& capacity, const size_t size, const size_t bytes )
+{
+  if ( size + bytes > capacity ) {
+    const size_t newCapacity = std::max( size + bytes, 2 * capacity );
+    auto newData = std::make_unique_for_overwrite<uint8_t[]>( newCapacity );
+    std::copy( data.get(), data.get() + size, newData.get() );
+    data = std::move( newData );
+    capacity = newCapacity;
+  }
+}
+
+void FFmpegDecoder::ConvertSampleData( const AVFrame* frame, SwrContext* resampleContext, SampleBuffer& outputBuffer )
+{
+  // When resampling, the output can be longer than the frame (including samples held back by the resampler from previous frames).
+  const size_t frameBytes = static_cast<size_t>( frame->nb_samples ) * m_Channels * m_BitsPerSample / 8;
+  const int outputSamples = std::max( frame->nb_samples, swr_get_out_samples( resampleContext, frame->nb_samples ) );
+  ReserveSampleBuffer( outputBuffer.Data, outputBuffer.Capacity, outputBuffer.Size, static_cast<size_t>( outputSamples ) * m_Channels * m_BitsPerSample / 8 );
+
+  uint8_t* buffer = outputBuffer.Data.get() + outputBuffer.Size;
+  if ( ConvertDirect( frame, buffer ) ) {
+    outputBuffer.Size += frameBytes;
+    return;
+  }
+
+  const int samples = swr_convert( resampleContext, &buffer, outputSamples, frame->data, frame->nb_samples );
+  if ( samples > 0 )
+    outputBuffer.Size += static_cast<size_t>( samples ) * m_Channels * m_BitsPerSample / 8;
+}
+
+void FFmpegDecoder::DrainResampler( SwrContext* resampleContext, SampleBuffer& outputBuffer )
+{
+  const int outputSamples = swr_get_out_samples( resampleContext, 0 );
+  if ( outputSamples <= 0 )
+    return;
+
+  ReserveSampleBuffer( outputBuffer.Data, outputBuffer.Capacity, outputBuffer.Size, static_cast<size_t>( outputSamples ) * m_Channels * m_BitsPerSample / 8 );
+  uint8_t* buffer = outputBuffer.Data.get() + outputBuffer.Size;
+  const int samples = swr_convert( resampleContext, &buffer, outputSamples, nullptr, 0 );
+  if ( samples > 0 )
+    outputBuffer.Size += static_cast<size_t>( samples ) * m_Channels * m_BitsPerSample / 8;
+}
+
+FFmpegDecoder::SampleBuffer FFmpegDecoder::AcquireBuffer()
+{
+  {
+    std::lock_guard<std::mutex> lock( m_PoolMutex );
+    if ( !m_BufferPool.empty() ) {
+      SampleBuffer buffer = std::move( m_BufferPool.back() );
+      m_BufferPool.pop_back();
+      buffer.Size = 0;
+      return buffer;
+    }
+  }
+  SampleBuffer buffer;
+  buffer.Data = std::make_unique_for_overwrite<uint8_t[]>( m_BufferSize );
+  buffer.Capacity = m_BufferSize;
+  return buffer;
+}
+
+void FFmpegDecoder::ReleaseBuffer( SampleBuffer buffer )
+{
+  // Buffers are only held by the sample queue, the decode thread and the reader, which bounds the size of the pool.
+  std::lock_guard<std::mutex> lock( m_PoolMutex );
+  if ( m_BufferPool.size() < kSampleQueueSize + 2 )
+    m_BufferPool.push_back( std::move( buffer ) );
+}
+
+FFmpegDecoder::PacketPtr FFmpegDecoder::AcquirePacket()
+{
+  {
+    std::lock_guard<std::mutex> lock( m_PoolMutex );
+    if ( !m_PacketPool.empty() ) {
+      PacketPtr packet = std::move( m_PacketPool.back() );
+      m_PacketPool.pop_back();
+      return packet;
+    }
+  }
+  return PacketPtr( av_packet_alloc() );
+}
+
+void FFmpegDecoder::ReleasePacket( PacketPtr packet )
+{
+  if ( !packet )
+    return;
+  av_packet_unref( packet.get() );
+  std::lock_guard<std::mutex> lock( m_PoolMutex );
+  if ( m_PacketPool.size() < kPacketQueueSize + 2 )
+    m_PacketPool.push_back( std::move( packet ) );
 }
@@ -5,8 +5,21 @@
 #include <string>
 #include <optional>
 #include <map>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "boundedqueue.h"
+#include "FFmpegIndex.h"
+#include "FFmpegMappedIO.h"
+#include "FFmpegTrackCache.h"
+#include "utils.h"
 
 struct AVCodecContext;
+struct AVCodecParameters;
 struct AVFormatContext;
 struct AVFrame;
 struct AVPacket;
@@ -15,8 +28,170 @@ struct SwrContext;
 class FFmpegDecoder
 {
 public:
+  struct Options {
+    // A thread count of zero lets FFmpeg choose, based on the number of processors.
+    static constexpr int32_t kDefaultThreadCount = 0;
+    static constexpr int32_t kMaximumThreadCount = 16;
+    static constexpr int32_t kMaximumAudioTrack = 16;
+
+    // Resampling quality, which determines the length of the resampling filter (and so the speed of the conversion).
+    enum class ResampleQuality : int32_t { Fast, Normal, Best };
+
+    Options()
+    {
+      Read();
+    }
+
+    Options( const int32_t threadCount, const int32_t audioTrack, const bool cacheTracks, const int32_t sampleRate, const ResampleQuality resampleQuality, const bool fastProbe, const bool exactLength, const bool range, const int32_t rangeStart, const int32_t rangeEnd ) :
+      ThreadCount( threadCount ),
+      AudioTrack( audioTrack ),
+      CacheTracks( cacheTracks ),
+      SampleRate( sampleRate ),
+      Quality( resampleQuality ),
+      FastProbe( fastProbe ),
+      ExactLength( exactLength ),
+      Range( range ),
+      RangeStart( rangeStart ),
+      RangeEnd( rangeEnd )
+    {
+      Write();
+    }
+
+    static std::map<int32_t, std::wstring> GetThreadCountOptions()
+    {
+      return {
+        { 0, L"Automatic" },
+        { 1, L"1 (no threading)" },
+        { 2, L"2" },
+        { 4, L"4" },
+        { 8, L"8" },
+        { 16, L"16" }
+      };
+    }
+
+    static std::map<int32_t, std::wstring> GetAudioTrackOptions()
+    {
+      std::map<int32_t, std::wstring> options = { { 0, L"Default" } };
+      for ( int32_t track = 1; track <= kMaximumAudioTrack; track++ )
+        options.insert( { track, std::to_wstring( track ) } );
+      return options;
+    }
+
+    static std::map<int32_t, std::wstring> GetSampleRateOptions()
+    {
+      return {
+        { 0, L"Original" },
+        { 22050, L"22050 Hz" },
+        { 32000, L"32000 Hz" },
+        { 44100, L"44100 Hz" },
+        { 48000, L"48000 Hz" },
+        { 88200, L"88200 Hz" },
+        { 96000, L"96000 Hz" }
+      };
+    }
+
+    static std::map<ResampleQuality, std::wstring> GetResampleQualityOptions()
+    {
+      return {
+        { ResampleQuality::Fast, L"Fast" },
+        { ResampleQuality::Normal, L"Normal" },
+        { ResampleQuality::Best, L"Best" }
+      };
+    }
+
+    int32_t ThreadCount = kDefaultThreadCount;
+
+    // Audio track to import, numbered from one in stream order (with zero meaning the default audio track chosen by FFmpeg).
+    int32_t AudioTrack = 0;
+
+    // Whether to decode all the audio tracks in a single pass, caching the decoded samples so that the other tracks can be imported without decoding.
+    bool CacheTracks = false;
+
+    // Sample rate to convert to when decoding (with zero meaning the original sample rate of the file).
+    int32_t SampleRate = 0;
+    ResampleQuality Quality = ResampleQuality::Normal;
+
+    // Whether to open files using a format hint from the extension and a limited amount of probing, opening again with full probing if the audio parameters are incomplete.
+    bool FastProbe = false;
+
+    // Whether to scan the file for an exact sample count (which is cached), rather than estimating it from the duration.
+    bool ExactLength = false;
+
+    // Whether to import only part of each file, between the start and end times in milliseconds (with an end time of zero meaning the end of the file).
+    // A range can also be given for an individual file by a sidecar file (with the extension .range), containing the start and end times.
+    bool Range = false;
+    int32_t RangeStart = 0;
+    int32_t RangeEnd = 0;
+
+    // Converts a time in the form [[h:]m:]s[.fff] to milliseconds, returning nullopt if the time is not valid.
+    static std::optional<int32_t> ParseTime( const std::string& time );
+
+    // Converts a time in milliseconds to the form h:mm:ss.fff.
+    static std::string FormatTime( const int32_t milliseconds );
+
+  private:
+    static constexpr char kSettingThreadCount[] = "ffmpegThreadCount";
+    static constexpr char kSettingAudioTrack[] = "ffmpegAudioTrack";
+    static constexpr char kSettingCacheTracks[] = "ffmpegCacheTracks";
+    static constexpr char kSettingSampleRate[] = "ffmpegSampleRate";
+    static constexpr char kSettingResampleQuality[] = "ffmpegResampleQuality";
+    static constexpr char kSettingFastProbe[] = "ffmpegFastProbe";
+    static constexpr char kSettingExactLength[] = "ffmpegExactLength";
+    static constexpr char kSettingRange[] = "ffmpegRange";
+    static constexpr char kSettingRangeStart[] = "ffmpegRangeStart";
+    static constexpr char kSettingRangeEnd[] = "ffmpegRangeEnd";
+
+    void Validate()
+    {
+      ThreadCount = std::clamp( ThreadCount, 0, kMaximumThreadCount );
+      AudioTrack = std::clamp( AudioTrack, 0, kMaximumAudioTrack );
+      if ( const auto sampleRates = GetSampleRateOptions(); sampleRates.end() == sampleRates.find( SampleRate ) )
+        SampleRate = 0;
+      Quality = static_cast<ResampleQuality>( std::clamp( static_cast<int32_t>( Quality ), static_cast<int32_t>( ResampleQuality::Fast ), static_cast<int32_t>( ResampleQuality::Best ) ) );
+      RangeStart = std::max( RangeStart, 0 );
+      RangeEnd = std::max( RangeEnd, 0 );
+    }
+
+    void Read()
+    {
+      ThreadCount = ReadSetting( kSettingThreadCount ).value_or( kDefaultThreadCount );
+      AudioTrack = ReadSetting( kSettingAudioTrack ).value_or( 0 );
+      CacheTracks = ( 0 != ReadSetting( kSettingCacheTracks ).value_or( 0 ) );
+      SampleRate = ReadSetting( kSettingSampleRate ).value_or( 0 );
+      Quality = static_cast<ResampleQuality>( ReadSetting( kSettingResampleQuality ).value_or( static_cast<int32_t>( ResampleQuality::Normal ) ) );
+      FastProbe = ( 0 != ReadSetting( kSettingFastProbe ).value_or( 0 ) );
+      ExactLength = ( 0 != ReadSetting( kSettingExactLength ).value_or( 0 ) );
+      Range = ( 0 != ReadSetting( kSettingRange ).value_or( 0 ) );
+      RangeStart = ReadSetting( kSettingRangeStart ).value_or( 0 );
+      RangeEnd = ReadSetting( kSettingRangeEnd ).value_or( 0 );
+      Validate();
+    }
+
+    void Write()
+    {
+      Validate();
+      WriteSetting( kSettingThreadCount, ThreadCount );
+      WriteSetting( kSettingAudioTrack, AudioTrack );
+      WriteSetting( kSettingCacheTracks, CacheTracks ? 1 : 0 );
+      WriteSetting( kSettingSampleRate, SampleRate );
+      WriteSetting( kSettingResampleQuality, static_cast<int32_t>( Quality ) );
+      WriteSetting( kSettingFastProbe, FastProbe ? 1 : 0 );
+      WriteSetting( kSettingExactLength, ExactLength ? 1 : 0 );
+      WriteSetting( kSettingRange, Range ? 1 : 0 );
+      WriteSetting( kSettingRangeStart, RangeStart );
+      WriteSetting( kSettingRangeEnd, RangeEnd );
+    }
+  };
+
+  // Chapter marker, with its position in samples from the start of the imported audio.
+  struct Chapter
+  {
+    uint64_t Position = 0;
+    std::string Title;
+  };
+
 	// Throws std::runtime_error if the file could not be loaded.
-	FFmpegDecoder( const std::string& filename );
+	FFmpegDecoder( const std::string& filename, const Options& options = {} );
 
 	virtual ~FFmpegDecoder();
 
@@ -25,13 +200,135 @@ public:
   uint32_t GetSampleRate() const { return m_SampleRate; }
   uint64_t GetTotalSamples() const { return m_TotalSamples; }
   const std::string& GetDescription() const { return m_Description; }
+  const std::vector<Chapter>& GetChapters() const { return m_Chapters; }
   static std::string GetVersion();
 
+  // Returns the value (in UTF-8) of a metadata tag from the container, or from the audio stream if the container does not have the tag.
+  std::optional<std::string> GetTagValue( const std::string& name ) const;
+
 	uint32_t Read( unsigned char* buffer, const long byteCount );
 
 private:
+  struct PacketDeleter
+  {
+    void operator()( AVPacket* packet ) const;
+  };
+  using PacketPtr = std::unique_ptr<AVPacket, PacketDeleter>;
+
+  // Block of converted samples, which is allocated without initialisation and recycled through the buffer pool.
+  struct SampleBuffer
+  {
+    std::unique_ptr<uint8_t[]> Data;
+    size_t Capacity = 0;
+    size_t Size = 0;
+  };
+
+  // Number of packets read ahead by the demux thread, and the number of decoded buffers held by the decode thread.
+  static constexpr size_t kPacketQueueSize = 256;
+  static constexpr size_t kSampleQueueSize = 16;
+
+  // Approximate length of each segment, when decoding segments in parallel.
+  static constexpr uint32_t kSegmentSeconds = 20;
+
+  // Number of samples decoded ahead of the start of a range when the codec frame size is unknown (the largest Vorbis block size).
+  static constexpr int64_t kDefaultRangePreRoll = 8192;
+
+  // Range of packet timestamps for a segment, which starts at a key frame (or at the start of the stream, if there is no seek).
+  struct SegmentRange
+  {
+    int64_t Start = 0;
+    std::optional<int64_t> End;
+    bool Seek = false;
+  };
+
+  // Decodes one segment of the stream on a worker thread, using a separate format and codec context.
+  struct Segment;
+
+  // Decodes one of the other audio streams on a worker thread, from packets supplied by the demux thread, writing the samples to the track cache.
+  struct TrackWriter;
+
+  // Fills the sample buffer from the decode thread, starting the demux and decode threads on the first call. Returns false at the end of the stream.
 	bool Decode();
-	void ConvertSampleData( const AVFrame* frame ); 
+
+  // Reads audio packets from the file into the packet queue.
+  void DemuxThread();
+
+  // Decodes packets from the packet queue into the sample queue, flushing the decoder once the packet queue is closed.
+  void DecodeThread();
+
+  // Stops the demux and decode threads, first letting them finish decoding the streams being cached (if required).
+  void StopThreads( const bool finishCaches );
+
+  // Returns the index of an audio track (numbered from one in stream order), or -1 for the default audio track.
+  int FindAudioStream( const int32_t track ) const;
+
+  // Returns the number of bits per sample used to import a stream with the given number of samples (at the output sample rate) and output channels.
+  static uint32_t GetBitsPerSample( const AVCodecParameters* codecParams, const uint64_t totalSamples, const uint32_t channels );
+
+  // Opens the track cache for the stream, if it has already been decoded, otherwise arranges for all the audio streams to be cached as the stream is decoded.
+  void OpenTrackCache( const std::string& filename );
+
+  // Creates the cache for the stream and the writers for any other audio streams (in the same output format) which are not already cached.
+  void StartTrackWriters();
+
+  // Reads the stream parameters (after a fast probe, opening the file again with full probing if the parameters of the audio stream are incomplete). Returns false on failure.
+  bool FindStreamInfo( const std::string& filename, const Options& options );
+
+  // Determines the range of samples to import, from a sidecar file or the options, and limits the total number of samples accordingly.
+  void ApplyRange( const std::string& filename, const Options& options );
+
+  // Seeks to the start of the import range.
+  void SeekToRange();
+
+  // Reads the chapters which start within the imported audio.
+  void ReadChapters();
+
+  // Returns the position, in samples from the start of the stream, of a timestamp in the stream time base.
+  uint64_t GetSamplePosition( const int64_t timestamp ) const;
+
+  // Returns a new resampler, converting from the decoder output to the Cool Edit sample format (and to the output sample rate).
+  SwrContext* CreateResampleContext( const AVCodecContext* decoderContext ) const;
+
+  // Converts a position in samples at the sample rate of the file to the output sample rate.
+  uint64_t GetOutputPosition( const uint64_t sourcePosition ) const;
+
+  // Divides the stream into segments to be decoded in parallel, if the codec and index allow.
+  void CreateSegments( const Options& options );
+
+  // Fills the sample buffer from the segment decoders, starting later segments as earlier ones are finished. Returns false at the end of the stream.
+  bool DecodeSegments();
+
+  // Returns an empty sample buffer from the pool (or a new buffer, if there are none available).
+  SampleBuffer AcquireBuffer();
+
+  // Returns a sample buffer to the pool.
+  void ReleaseBuffer( SampleBuffer buffer );
+
+  // Returns an unused packet from the pool (or a new packet, if there are none available).
+  PacketPtr AcquirePacket();
+
+  // Returns a packet to the pool, after releasing its data.
+  void ReleasePacket( PacketPtr packet );
+
+  // Marks all streams apart from the given audio stream (and, optionally, the other audio streams) to be discarded by the demuxer.
+  void DiscardOtherStreams( const int streamIndex, const bool keepAudio );
+
+  // Sends a packet to the decoder (or flushes the decoder, if the packet is null), appending any decoded audio to the buffer.
+  void DecodePacket( AVCodecContext* decoderContext, AVFrame* frame, SwrContext* resampleContext, const AVPacket* packet, SampleBuffer& buffer );
+
+  // Receives all the frames currently available from the decoder, returning the result of the last call to avcodec_receive_frame.
+  int ReceiveFrames( AVCodecContext* decoderContext, AVFrame* frame, SwrContext* resampleContext, SampleBuffer& buffer );
+
+  // Converts the frame to the output format without using swresample, returning false if remixing is needed.
+  bool ConvertDirect( const AVFrame* frame, uint8_t* output ) const;
+
+	void ConvertSampleData( const AVFrame* frame, SwrContext* resampleContext, SampleBuffer& buffer );
+
+  // Appends any samples still held by the resampler, at the end of the stream.
+  void DrainResampler( SwrContext* resampleContext, SampleBuffer& buffer );
+
+  // Declared before the format context, which must be closed before the I/O object is destroyed.
+  std::unique_ptr<FFmpegMappedIO> m_MappedIO;
 
 	AVFormatContext* m_FormatContext = nullptr;
 	AVCodecContext* m_DecoderContext = nullptr;
@@ -39,14 +336,62 @@ private:
 	AVFrame* m_Frame = nullptr;
   SwrContext* m_ResampleContext = nullptr;
 	int m_StreamIndex = 0;
-	std::vector<uint8_t> m_Buffer;
+	SampleBuffer m_Buffer;
 	uint32_t m_BufferPos = 0;
 
+  BoundedQueue<PacketPtr> m_PacketQueue{ kPacketQueueSize };
+  BoundedQueue<SampleBuffer> m_SampleQueue{ kSampleQueueSize };
+
+  // Recycled sample buffers and packets, so that no allocations are needed once decoding has reached a steady state.
+  std::mutex m_PoolMutex;
+  std::vector<SampleBuffer> m_BufferPool;
+  std::vector<PacketPtr> m_PacketPool;
+
+  // Initial size of each sample buffer, based on the maximum frame size of the codec.
+  size_t m_BufferSize = 0;
+
+  // Import range, as the first sample to import, and the number of samples still to be read (if the range is limited).
+  uint64_t m_RangeStart = 0;
+  std::optional<uint64_t> m_RangeRemaining;
+
+  // Timestamp beyond which the demuxer can stop reading packets.
+  int64_t m_DemuxEndTimestamp = 0;
+
+  // Position of the first decoded frame after seeking (set by the decode thread), and the position of the next buffer to be read, until the start of the range is reached.
+  bool m_TrackFirstFrame = false;
+  std::atomic<int64_t> m_FirstFramePosition = -1;
+  std::optional<uint64_t> m_TrimPosition;
+  bool m_RangeTrimmed = true;
+
+  // Segments for parallel decoding, along with the segment decoders currently running (in stream order).
+  std::string m_Filename;
+  std::vector<SegmentRange> m_SegmentRanges;
+  std::deque<std::unique_ptr<Segment>> m_Segments;
+  size_t m_NextSegment = 0;
+  size_t m_MaximumSegments = 0;
+  std::thread m_DemuxThread;
+  std::thread m_DecodeThread;
+  std::atomic<bool> m_StopDemux = false;
+
+  // Samples read from the cache (if the stream has already been cached), or the cache being written by the decode thread, along with the writers for the other audio streams.
+  bool m_CacheTracks = false;
+  std::unique_ptr<FFmpegTrackCache> m_CachedTrack;
+  std::unique_ptr<FFmpegTrackCache> m_CacheWriter;
+  std::map<int, std::unique_ptr<TrackWriter>> m_TrackWriters;
+
+  // Whether all the samples have been read, in which case the caches are finished before closing.
+  uint64_t m_SamplesRead = 0;
+  bool m_ReadComplete = false;
+
   uint32_t m_BitsPerSample = 0;
   uint32_t m_Channels = 0;
   uint32_t m_SampleRate = 0;
+  uint32_t m_SourceSampleRate = 0;
+  Options::ResampleQuality m_ResampleQuality = Options::ResampleQuality::Normal;
   uint32_t m_BitRate = 0;
   uint64_t m_TotalSamples = 0;
+  std::optional<FFmpegIndex> m_Index;
   std::string m_Description;
+  std::vector<Chapter> m_Chapters;
 };
 
@@ -0,0 +1,299 @@
+#include "FFmpegEncoder.h"
+
+#include <algorithm>
+#include <cwctype>
+#include <stdexcept>
+#include <vector>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/audio_fifo.h>
+#include <libswresample/swresample.h>
+}
+
+// Cool Edit supplies floating point samples with a nominal range of +/-32768.
+constexpr float kFloatScale = 32768.f;
+
+// Returns the sample format supported by the encoder which best matches the source bit depth.
+static AVSampleFormat ChooseSampleFormat( const AVCodecContext* encoderContext, const AVCodec* encoder, const uint32_t bitsPerSample )
+{
+  const void* configs = nullptr;
+  int count = 0;
+  if ( ( avcodec_get_supported_config( encoderContext, encoder, AV_CODEC_CONFIG_SAMPLE_FORMAT, 0, &configs, &count ) < 0 ) || ( nullptr == configs ) || ( count <= 0 ) )
+    return AV_SAMPLE_FMT_NONE;
+
+  const AVSampleFormat* formats = static_cast<const AVSampleFormat*>( configs );
+  const std::vector<AVSampleFormat> preferred = ( 32 == bitsPerSample ) ?
+    std::vector<AVSampleFormat>{ AV_SAMPLE_FMT_FLTP, AV_SAMPLE_FMT_FLT, AV_SAMPLE_FMT_S32P, AV_SAMPLE_FMT_S32, AV_SAMPLE_FMT_S16P, AV_SAMPLE_FMT_S16 } :
+    std::vector<AVSampleFormat>{ AV_SAMPLE_FMT_S16P, AV_SAMPLE_FMT_S16, AV_SAMPLE_FMT_S32P, AV_SAMPLE_FMT_S32, AV_SAMPLE_FMT_FLTP, AV_SAMPLE_FMT_FLT };
+  for ( const auto format : preferred ) {
+    if ( formats + count != std::find( formats, formats + count, format ) )
+      return format;
+  }
+  return formats[ 0 ];
+}
+
+std::map<FFmpegEncoder::Options::Codec, std::wstring> FFmpegEncoder::Options::GetCodecOptions()
+{
+  std::map<Codec, std::wstring> options = {
+    { Codec::AAC, L"AAC (.m4a)" },
+    { Codec::ALAC, L"Apple Lossless (.m4a)" },
+    { Codec::WAV, L"WAV (.wav)" },
+    { Codec::W64, L"Wave64 (.w64)" },
+    { Codec::RF64, L"RF64 (.wav)" }
+  };
+  // MP3 encoding needs FFmpeg to be built with LAME.
+  if ( nullptr != avcodec_find_encoder_by_name( "libmp3lame" ) )
+    options.insert( { Codec::MP3, L"MP3 (.mp3)" } );
+  return options;
+}
+
+std::string FFmpegEncoder::Options::GetExtension( const Codec codec )
+{
+  switch ( codec ) {
+    case Codec::AAC:
+    case Codec::ALAC:
+      return ".m4a";
+    case Codec::MP3:
+      return ".mp3";
+    case Codec::W64:
+      return ".w64";
+    default:
+      return ".wav";
+  }
+}
+
+const char* FFmpegEncoder::Options::GetFormatName( const Codec codec, const std::filesystem::path& filename )
+{
+  std::wstring extension = filename.extension().wstring();
+  std::transform( extension.begin(), extension.end(), extension.begin(), [] ( wchar_t c ) { return std::towlower( c ); } );
+  if ( UTF8ToWideString( GetExtension( codec ) ) == extension ) {
+    switch ( codec ) {
+      case Codec::AAC:
+      case Codec::ALAC:
+        return "ipod";
+      case Codec::MP3:
+        return "mp3";
+      case Codec::W64:
+        return "w64";
+      default:
+        return "wav";
+    }
+  }
+  if ( ( L".mp4" == extension ) && ( ( Codec::AAC == codec ) || ( Codec::ALAC == codec ) || ( Codec::MP3 == codec ) ) )
+    return "mp4";
+  if ( ( L".mkv" == extension ) && ( Codec::W64 != codec ) && ( Codec::RF64 != codec ) )
+    return "matroska";
+  if ( ( L".avi" == extension ) && ( ( Codec::MP3 == codec ) || ( Codec::WAV == codec ) ) )
+    return "avi";
+  return nullptr;
+}
+
+FFmpegEncoder::FFmpegEncoder( const std::string& filename, const uint32_t sampleRate, const uint32_t bitsPerSample, const uint32_t channels, const Options& options ) :
+  m_BitsPerSample( bitsPerSample ),
+  m_Channels( channels )
+{
+  const char* formatName = Options::GetFormatName( options.OutputCodec, std::filesystem::path( UTF8ToWideString( filename ) ) );
+  AVCodecID codecID = ( 8 == bitsPerSample ) ? AV_CODEC_ID_PCM_U8 : ( ( 32 == bitsPerSample ) ? AV_CODEC_ID_PCM_F32LE : AV_CODEC_ID_PCM_S16LE );
+  const AVCodec* encoder = nullptr;
+  switch ( options.OutputCodec ) {
+    case Options::Codec::AAC:
+      encoder = avcodec_find_encoder( AV_CODEC_ID_AAC );
+      break;
+    case Options::Codec::MP3:
+      encoder = avcodec_find_encoder_by_name( "libmp3lame" );
+      break;
+    case Options::Codec::ALAC:
+      encoder = avcodec_find_encoder( AV_CODEC_ID_ALAC );
+      break;
+    default:
+      encoder = avcodec_find_encoder( codecID );
+      break;
+  }
+
+  AVChannelLayout layout = {};
+  av_channel_layout_default( &layout, static_cast<int>( channels ) );
+  const AVSampleFormat srcFormat = ( 8 == bitsPerSample ) ? AV_SAMPLE_FMT_U8 : ( ( 32 == bitsPerSample ) ? AV_SAMPLE_FMT_FLT : AV_SAMPLE_FMT_S16 );
+
+  if ( ( nullptr != encoder ) && ( nullptr != formatName ) && ( avformat_alloc_output_context2( &m_FormatContext, nullptr, formatName, filename.c_str() ) >= 0 ) ) {
+    m_EncoderContext = avcodec_alloc_context3( encoder );
+    if ( nullptr != m_EncoderContext ) {
+      m_EncoderContext->sample_rate = static_cast<int>( sampleRate );
+      m_EncoderContext->time_base = AVRational{ 1, static_cast<int>( sampleRate ) };
+      av_channel_layout_copy( &m_EncoderContext->ch_layout, &layout );
+      m_EncoderContext->sample_fmt = ChooseSampleFormat( m_EncoderContext, encoder, bitsPerSample );
+      if ( AV_CODEC_ID_ALAC == encoder->id )
+        m_EncoderContext->bits_per_raw_sample = ( AV_SAMPLE_FMT_S32P == m_EncoderContext->sample_fmt ) ? 24 : 16;
+      if ( Options::IsLossy( options.OutputCodec ) )
+        m_EncoderContext->bit_rate = static_cast<int64_t>( options.Bitrate ) * 1000;
+
+      // Frame threading is used by encoders which support it, otherwise slice threading.
+      m_EncoderContext->thread_count = 0;
+      m_EncoderContext->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+      if ( 0 != ( m_FormatContext->oformat->flags & AVFMT_GLOBALHEADER ) )
+        m_EncoderContext->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+      if ( avcodec_open2( m_EncoderContext, encoder, nullptr ) >= 0 ) {
+        m_FrameSize = ( ( 0 != ( encoder->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE ) ) || ( m_EncoderContext->frame_size <= 0 ) ) ? kDefaultFrameSize : m_EncoderContext->frame_size;
+        AVStream* stream = avformat_new_stream( m_FormatContext, nullptr );
+        if ( ( nullptr != stream ) && ( avcodec_parameters_from_context( stream->codecpar, m_EncoderContext ) >= 0 ) ) {
+          stream->time_base = m_EncoderContext->time_base;
+          if ( avio_open( &m_FormatContext->pb, filename.c_str(), AVIO_FLAG_WRITE ) >= 0 ) {
+            // RF64 headers are only used if the file turns out to be larger than a standard WAV file allows.
+            AVDictionary* muxerOptions = nullptr;
+            if ( Options::Codec::RF64 == options.OutputCodec )
+              av_dict_set( &muxerOptions, "rf64", "auto", 0 );
+            if ( avformat_write_header( m_FormatContext, &muxerOptions ) >= 0 ) {
+              if ( swr_alloc_set_opts2( &m_ResampleContext, &m_EncoderContext->ch_layout, m_EncoderContext->sample_fmt, m_EncoderContext->sample_rate, &layout, srcFormat, m_EncoderContext->sample_rate, 0, nullptr ) >= 0 ) {
+                if ( swr_init( m_ResampleContext ) < 0 )
+                  swr_free( &m_ResampleContext );
+              }
+              m_Fifo = av_audio_fifo_alloc( m_EncoderContext->sample_fmt, m_EncoderContext->ch_layout.nb_channels, m_FrameSize );
+              m_Frame = av_frame_alloc();
+            }
+            av_dict_free( &muxerOptions );
+          }
+        }
+      }
+    }
+  }
+  av_channel_layout_uninit( &layout );
+
+  if ( ( nullptr == m_ResampleContext ) || ( nullptr == m_Fifo ) || ( nullptr == m_Frame ) ) {
+    Free();
+    throw std::runtime_error( "FFmpegEncoder failed to initialise" );
+  }
+
+  m_MuxThread = std::thread( &FFmpegEncoder::MuxThread, this );
+}
+
+FFmpegEncoder::~FFmpegEncoder()
+{
+  Finish();
+  Free();
+}
+
+void FFmpegEncoder::Free()
+{
+  av_audio_fifo_free( m_Fifo );
+  m_Fifo = nullptr;
+  av_frame_free( &m_Frame );
+  swr_free( &m_ResampleContext );
+  avcodec_free_context( &m_EncoderContext );
+  if ( nullptr != m_FormatContext ) {
+    avio_closep( &m_FormatContext->pb );
+    avformat_free_context( m_FormatContext );
+    m_FormatContext = nullptr;
+  }
+}
+
+void FFmpegEncoder::PacketDeleter::operator()( AVPacket* packet ) const
+{
+  av_packet_free( &packet );
+}
+
+uint32_t FFmpegEncoder::Write( unsigned char* buffer, const long byteCount )
+{
+  const int sampleCount = static_cast<int>( static_cast<uint32_t>( byteCount ) / m_Channels / ( m_BitsPerSample / 8 ) );
+  if ( m_MuxError || ( sampleCount <= 0 ) )
+    return 0;
+
+  const uint8_t* input = buffer;
+  if ( 32 == m_BitsPerSample ) {
+    const float* source = reinterpret_cast<const float*>( buffer );
+    m_FloatBuffer.resize( static_cast<size_t>( sampleCount ) * m_Channels );
+    std::transform( source, source + m_FloatBuffer.size(), m_FloatBuffer.begin(), [] ( const float value ) { return value / kFloatScale; } );
+    input = reinterpret_cast<const uint8_t*>( m_FloatBuffer.data() );
+  }
+
+  uint8_t** converted = nullptr;
+  const int outputSamples = swr_get_out_samples( m_ResampleContext, sampleCount );
+  if ( av_samples_alloc_array_and_samples( &converted, nullptr, m_EncoderContext->ch_layout.nb_channels, outputSamples, m_EncoderContext->sample_fmt, 0 ) < 0 )
+    return 0;
+  const int samples = swr_convert( m_ResampleContext, converted, outputSamples, &input, sampleCount );
+  bool valid = ( samples >= 0 ) && ( av_audio_fifo_write( m_Fifo, reinterpret_cast<void**>( converted ), samples ) == samples );
+  av_freep( &converted[ 0 ] );
+  av_freep( &converted );
+
+  valid = valid && EncodeFrames( false );
+  return valid ? static_cast<uint32_t>( byteCount ) : 0;
+}
+
+bool FFmpegEncoder::EncodeFrames( const bool flush )
+{
+  const bool smallLastFrame = ( 0 != ( m_EncoderContext->codec->capabilities & ( AV_CODEC_CAP_SMALL_LAST_FRAME | AV_CODEC_CAP_VARIABLE_FRAME_SIZE ) ) );
+  while ( ( av_audio_fifo_size( m_Fifo ) >= m_FrameSize ) || ( flush && ( av_audio_fifo_size( m_Fifo ) > 0 ) ) ) {
+    // A new buffer is needed for each frame, since the encoder threads can hold on to previous frames.
+    const int samples = std::min( av_audio_fifo_size( m_Fifo ), m_FrameSize );
+    av_frame_unref( m_Frame );
+    m_Frame->nb_samples = smallLastFrame ? samples : m_FrameSize;
+    m_Frame->format = m_EncoderContext->sample_fmt;
+    m_Frame->sample_rate = m_EncoderContext->sample_rate;
+    if ( ( av_channel_layout_copy( &m_Frame->ch_layout, &m_EncoderContext->ch_layout ) < 0 ) || ( av_frame_get_buffer( m_Frame, 0 ) < 0 ) )
+      return false;
+    if ( av_audio_fifo_read( m_Fifo, reinterpret_cast<void**>( m_Frame->data ), samples ) < samples )
+      return false;
+    // Pad the last frame with silence, for encoders which need whole frames.
+    if ( samples < m_Frame->nb_samples )
+      av_samples_set_silence( m_Frame->data, samples, m_Frame->nb_samples - samples, m_Frame->ch_layout.nb_channels, m_EncoderContext->sample_fmt );
+    m_Frame->pts = m_NextPts;
+    m_NextPts += samples;
+    if ( !SendFrame( m_Frame ) )
+      return false;
+  }
+  return flush ? SendFrame( nullptr ) : true;
+}
+
+bool FFmpegEncoder::SendFrame( const AVFrame* frame )
+{
+  int result = avcodec_send_frame( m_EncoderContext, frame );
+  if ( AVERROR( EAGAIN ) == result ) {
+    // A frame threaded encoder can hold several packets of output, which need to be received before the frame is accepted.
+    if ( !ReceivePackets() )
+      return false;
+    result = avcodec_send_frame( m_EncoderContext, frame );
+  }
+  return ( result >= 0 ) && ReceivePackets();
+}
+
+bool FFmpegEncoder::ReceivePackets()
+{
+  const AVRational streamTimeBase = m_FormatContext->streams[ 0 ]->time_base;
+  while ( true ) {
+    PacketPtr packet( av_packet_alloc() );
+    if ( !packet )
+      return false;
+    const int result = avcodec_receive_packet( m_EncoderContext, packet.get() );
+    if ( ( AVERROR( EAGAIN ) == result ) || ( AVERROR_EOF == result ) )
+      return true;
+    if ( result < 0 )
+      return false;
+    packet->stream_index = 0;
+    av_packet_rescale_ts( packet.get(), m_EncoderContext->time_base, streamTimeBase );
+    if ( !m_PacketQueue.Push( std::move( packet ) ) )
+      return false;
+  }
+}
+
+void FFmpegEncoder::MuxThread()
+{
+  // Packets are still taken from the queue after an error, so that the encoder is not held up.
+  while ( auto packet = m_PacketQueue.Pop() ) {
+    if ( !m_MuxError && ( av_write_frame( m_FormatContext, packet->get() ) < 0 ) )
+      m_MuxError = true;
+  }
+}
+
+void FFmpegEncoder::Finish()
+{
+  if ( m_Finished || !m_MuxThread.joinable() )
+    return;
+  m_Finished = true;
+
+  EncodeFrames( true );
+  m_PacketQueue.Close();
+  m_MuxThread.join();
+  av_write_trailer( m_FormatContext );
+}
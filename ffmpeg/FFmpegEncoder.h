@@ -0,0 +1,156 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "boundedqueue.h"
+#include "utils.h"
+
+struct AVAudioFifo;
+struct AVCodecContext;
+struct AVFormatContext;
+struct AVFrame;
+struct AVPacket;
+struct SwrContext;
+
+class FFmpegEncoder
+{
+public:
+  struct Options {
+    enum class Codec : int32_t { AAC, MP3, ALAC, WAV, W64, RF64 };
+
+    static constexpr Codec kDefaultCodec = Codec::AAC;
+    static constexpr int32_t kDefaultBitrate = 192;
+
+    Options()
+    {
+      Read();
+    }
+
+    Options( const Codec codec, const int32_t bitrate ) :
+      OutputCodec( codec ),
+      Bitrate( bitrate )
+    {
+      Write();
+    }
+
+    // Returns the codecs which are available in this build of FFmpeg.
+    static std::map<Codec, std::wstring> GetCodecOptions();
+
+    static std::map<int32_t, std::wstring> GetBitrateOptions()
+    {
+      return {
+        { 96, L"96 kbps" },
+        { 128, L"128 kbps" },
+        { 160, L"160 kbps" },
+        { 192, L"192 kbps" },
+        { 256, L"256 kbps" },
+        { 320, L"320 kbps" }
+      };
+    }
+
+    // Returns the file extension for the codec, including the leading '.'.
+    static std::string GetExtension( const Codec codec );
+
+    // Returns the muxer for writing the codec to a file with the given name, based on its extension (or nullptr if the codec cannot be written to that type of file).
+    // As well as the codec's own extension, the containers also opened by the filter (MP4, Matroska and AVI) are written where they can hold the codec.
+    static const char* GetFormatName( const Codec codec, const std::filesystem::path& filename );
+
+    // Whether the codec is lossy, and so uses the bitrate.
+    static bool IsLossy( const Codec codec ) { return ( Codec::AAC == codec ) || ( Codec::MP3 == codec ); }
+
+    Codec OutputCodec = kDefaultCodec;
+
+    // Bitrate in kbps, for the lossy codecs.
+    int32_t Bitrate = kDefaultBitrate;
+
+  private:
+    static constexpr char kSettingCodec[] = "ffmpegEncoderCodec";
+    static constexpr char kSettingBitrate[] = "ffmpegEncoderBitrate";
+
+    void Validate()
+    {
+      if ( const auto codecs = GetCodecOptions(); codecs.end() == codecs.find( OutputCodec ) )
+        OutputCodec = kDefaultCodec;
+      if ( const auto bitrates = GetBitrateOptions(); bitrates.end() == bitrates.find( Bitrate ) )
+        Bitrate = kDefaultBitrate;
+    }
+
+    void Read()
+    {
+      OutputCodec = static_cast<Codec>( ReadSetting( kSettingCodec ).value_or( static_cast<int32_t>( kDefaultCodec ) ) );
+      Bitrate = ReadSetting( kSettingBitrate ).value_or( kDefaultBitrate );
+      Validate();
+    }
+
+    void Write()
+    {
+      Validate();
+      WriteSetting( kSettingCodec, static_cast<int32_t>( OutputCodec ) );
+      WriteSetting( kSettingBitrate, Bitrate );
+    }
+  };
+
+  // Throws std::runtime_error if the file could not be created.
+  FFmpegEncoder( const std::string& filename, const uint32_t sampleRate, const uint32_t bitsPerSample, const uint32_t channels, const Options& options = {} );
+
+  virtual ~FFmpegEncoder();
+
+  uint32_t Write( unsigned char* buffer, const long byteCount );
+
+private:
+  struct PacketDeleter
+  {
+    void operator()( AVPacket* packet ) const;
+  };
+  using PacketPtr = std::unique_ptr<AVPacket, PacketDeleter>;
+
+  // Number of encoded packets which can be queued for the muxer.
+  static constexpr size_t kPacketQueueSize = 64;
+
+  // Number of samples in each frame sent to encoders which accept any frame size.
+  static constexpr int kDefaultFrameSize = 4096;
+
+  // Writes the queued packets to the file.
+  void MuxThread();
+
+  // Sends whole frames from the FIFO to the encoder (or, when flushing, the remaining samples followed by the end of the stream).
+  bool EncodeFrames( const bool flush );
+
+  // Sends a frame to the encoder (or flushes the encoder, if the frame is null), queuing any encoded packets.
+  bool SendFrame( const AVFrame* frame );
+
+  // Queues all the packets currently available from the encoder for the muxer.
+  bool ReceivePackets();
+
+  // Flushes the encoder, finishes the muxer thread and writes the trailer.
+  void Finish();
+
+  // Frees the FFmpeg contexts, closing the file.
+  void Free();
+
+  const uint32_t m_BitsPerSample;
+  const uint32_t m_Channels;
+
+  AVFormatContext* m_FormatContext = nullptr;
+  AVCodecContext* m_EncoderContext = nullptr;
+  SwrContext* m_ResampleContext = nullptr;
+  AVAudioFifo* m_Fifo = nullptr;
+  AVFrame* m_Frame = nullptr;
+  int m_FrameSize = 0;
+  int64_t m_NextPts = 0;
+
+  // Floating point samples, rescaled from Cool Edit's range for the converter.
+  std::vector<float> m_FloatBuffer;
+
+  BoundedQueue<PacketPtr> m_PacketQueue{ kPacketQueueSize };
+  std::thread m_MuxThread;
+  std::atomic<bool> m_MuxError = false;
+  bool m_Finished = false;
+};
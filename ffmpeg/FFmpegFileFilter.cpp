@@ -1,9 +1,106 @@
 #include "FFmpegFileFilter.h"
+#include "FFmpegContextPool.h"
 #include "FFmpegDecoder.h"
+#include "FFmpegEncoder.h"
 #include "utils.h"
+#include "resource.h"
+#include "windowsx.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <optional>
+#include <tuple>
 
 constexpr long kChunkSize = 65536;
 
+// Number of open input handles, with pooled decoders which have worker threads being released once there are none.
+static std::atomic<uint32_t> s_OpenInputs = 0;
+
+static void ReleasePooledDecoders()
+{
+  if ( 0 == s_OpenInputs )
+    FFmpegContextPool::Get().ReleaseThreadedDecoders();
+}
+
+// FFmpeg's generic metadata keys (which the demuxers map their own tags to), and the corresponding INFO chunk types.
+static const std::map<std::string /*tag*/, std::string /*type*/> kTagToType = {
+	{ "artist", "IART" },
+	{ "comment", "ICMT" },
+	{ "copyright", "ICOP" },
+	{ "date", "ICRD" },
+	{ "genre", "IGNR" },
+	{ "keywords", "IKEY" },
+	{ "title", "INAM" },
+	{ "encoder", "ISFT" },
+	{ "source", "ISRC" },
+	{ "subject", "ISBJ" }
+};
+
+// Tags and chapters, laid out as special data when the file is opened.
+struct TagData
+{
+  using Tag = std::tuple<std::string /*listType*/, std::string /*type*/, std::vector<char> /*data*/, uint32_t /*count*/>;
+
+  TagData( const FFmpegDecoder* decoder )
+  {
+    for ( const auto& [ name, type ] : kTagToType ) {
+      if ( const auto tag = decoder->GetTagValue( name ); tag.has_value() && !tag->empty() ) {
+        const std::string value = WideStringToAnsiCodePage( UTF8ToWideString( *tag ) );
+        std::vector<char> data( value.begin(), value.end() );
+        data.push_back( 0 );
+        m_Tags.push_back( std::make_tuple( "INFO", type, std::move( data ), 1 ) );
+      }
+    }
+
+    // Mark the start of each chapter with a labelled cue point.
+    if ( const auto& chapters = decoder->GetChapters(); !chapters.empty() ) {
+      std::vector<char> cues;
+      std::vector<char> labels;
+      for ( uint32_t index = 0; index < chapters.size(); index++ ) {
+        const uint32_t name = 1 + index;
+        const uint32_t offset = static_cast<uint32_t>( std::min<uint64_t>( chapters[ index ].Position, std::numeric_limits<uint32_t>::max() ) );
+        AppendBytes( cues, &name, sizeof( name ) );
+        AppendBytes( cues, &offset, sizeof( offset ) );
+        const std::string label = WideStringToAnsiCodePage( UTF8ToWideString( chapters[ index ].Title ) );
+        AppendBytes( labels, &name, sizeof( name ) );
+        AppendBytes( labels, label.c_str(), 1 + label.size() );
+      }
+      const uint32_t count = static_cast<uint32_t>( chapters.size() );
+      m_Tags.push_back( std::make_tuple( "WAVE", "CUE ", std::move( cues ), count ) );
+      m_Tags.push_back( std::make_tuple( "adtl", "LABL", std::move( labels ), count ) );
+    }
+  }
+
+  const Tag* GetTag( const uint32_t index ) const
+  {
+    return ( index < m_Tags.size() ) ? &m_Tags[ index ] : nullptr;
+  }
+
+private:
+  static void AppendBytes( std::vector<char>& data, const void* bytes, const size_t size )
+  {
+    data.insert( data.end(), static_cast<const char*>( bytes ), static_cast<const char*>( bytes ) + size );
+  }
+
+  std::vector<Tag> m_Tags;
+};
+
+struct Input
+{
+  Input( std::unique_ptr<FFmpegDecoder> decoder ) : m_Decoder( std::move( decoder ) ), m_TagData( m_Decoder.get() ) {};
+
+  FFmpegDecoder* GetDecoder() { return m_Decoder.get(); }
+  const TagData* GetTagData() const { return &m_TagData; }
+
+private:
+  std::unique_ptr<FFmpegDecoder> m_Decoder;
+  TagData m_TagData;
+};
+
 int __stdcall QueryCoolFilter( COOLQUERY* cq )
 {
   _ASSERT_EXPR( 0, L"QueryCoolFilter" );
@@ -17,7 +114,7 @@ int __stdcall QueryCoolFilter( COOLQUERY* cq )
 	strcpy_s( cq->szName, 24, "FFmpeg" );		
 	strcpy_s( cq->szCopyright, 80, FFmpegDecoder::GetVersion().c_str() );
 	cq->lChunkSize = 0; 
-	cq->dwFlags = QF_CANLOAD | QF_RATEADJUSTABLE | QF_CANDO32BITFLOATS;
+	cq->dwFlags = QF_CANLOAD | QF_CANSAVE | QF_RATEADJUSTABLE | QF_CANDO32BITFLOATS | QF_HASOPTIONSBOX | QF_READSPECIALFIRST;
  	cq->Stereo8 = 0xFF;
  	cq->Stereo16 = 0xFF;
  	cq->Stereo32 = 0xFF;
@@ -30,9 +127,13 @@ int __stdcall QueryCoolFilter( COOLQUERY* cq )
 BOOL __stdcall FilterUnderstandsFormat( LPSTR filename )
 {
   try {
-    FFmpegDecoder decoder( AnsiCodePageToUTF8( filename ) );
+    {
+      FFmpegDecoder decoder( AnsiCodePageToUTF8( filename ) );
+    }
+    ReleasePooledDecoders();
     return TRUE;
   } catch ( const std::runtime_error& ) {
+    ReleasePooledDecoders();
     return FALSE;
   }
 }
@@ -40,7 +141,8 @@ BOOL __stdcall FilterUnderstandsFormat( LPSTR filename )
 HANDLE __stdcall OpenFilterInput( LPSTR filename, LONG* sampleRate, WORD* bitsPerSample, WORD* channels, HWND, LONG* chunkSize )
 {
   try {
-    auto decoder = new FFmpegDecoder( AnsiCodePageToUTF8( filename ) );
+    // Tags and chapters are read from the same open context as the audio.
+    auto decoder = std::make_unique<FFmpegDecoder>( AnsiCodePageToUTF8( filename ) );
     if ( nullptr != sampleRate )
       *sampleRate = static_cast<LONG>( decoder->GetSampleRate() );
     if ( nullptr != bitsPerSample )
@@ -49,15 +151,19 @@ HANDLE __stdcall OpenFilterInput( LPSTR filename, LONG* sampleRate, WORD* bitsPe
       *channels = static_cast<WORD>( decoder->GetChannels() );
     if ( nullptr != chunkSize )
       *chunkSize = kChunkSize;
-    return decoder;
+    Input* input = new Input( std::move( decoder ) );
+    ++s_OpenInputs;
+    return input;
   } catch ( const std::runtime_error& ) {
+    ReleasePooledDecoders();
     return 0;
   }
 }
 
 DWORD __stdcall FilterGetFileSize( HANDLE hInput )
 {
-  FFmpegDecoder* decoder = static_cast<FFmpegDecoder*>( hInput );
+  Input* input = static_cast<Input*>( hInput );
+  FFmpegDecoder* decoder = ( nullptr != input ) ? input->GetDecoder() : nullptr;
   if ( nullptr == decoder )
     return 0;
 
@@ -67,7 +173,8 @@ DWORD __stdcall FilterGetFileSize( HANDLE hInput )
 
 DWORD __stdcall ReadFilterInput( HANDLE hInput, BYTE* data, LONG bytes )
 {
-  FFmpegDecoder* decoder = static_cast<FFmpegDecoder*>( hInput );
+  Input* input = static_cast<Input*>( hInput );
+  FFmpegDecoder* decoder = ( nullptr != input ) ? input->GetDecoder() : nullptr;
   if ( nullptr == decoder )
     return 0;
   return decoder->Read( data, bytes );
@@ -75,15 +182,71 @@ DWORD __stdcall ReadFilterInput( HANDLE hInput, BYTE* data, LONG bytes )
 
 void __stdcall CloseFilterInput( HANDLE hInput )
 {
-  FFmpegDecoder* decoder = static_cast<FFmpegDecoder*>( hInput );
-  if ( nullptr != decoder )
-    delete decoder;
+  Input* input = static_cast<Input*>( hInput );
+  if ( nullptr != input ) {
+    delete input;
+    --s_OpenInputs;
+    ReleasePooledDecoders();
+  }
+}
+
+void __stdcall GetSuggestedSampleType( LONG* sampleRate, WORD* bitsPerSample, WORD* channels )
+{
+  *sampleRate = 0;
+  *bitsPerSample = 0;
+  *channels = 0;
+}
+
+// Returns the codec to write a file with the given extension, which is the chosen codec if it can be written to that type of file, otherwise the first available codec which can.
+static std::optional<FFmpegEncoder::Options::Codec> GetOutputCodec( const std::filesystem::path& filename, const FFmpegEncoder::Options::Codec chosenCodec )
+{
+  if ( nullptr != FFmpegEncoder::Options::GetFormatName( chosenCodec, filename ) )
+    return chosenCodec;
+  for ( const auto& [ codec, name ] : FFmpegEncoder::Options::GetCodecOptions() ) {
+    if ( nullptr != FFmpegEncoder::Options::GetFormatName( codec, filename ) )
+      return codec;
+  }
+  return std::nullopt;
+}
+
+HANDLE __stdcall OpenFilterOutput( LPSTR filename, LONG sampleRate, WORD bitsPerSample, WORD channels, LONG size, LONG* chunkSize, DWORD options )
+{
+  // Write to the file exactly as named, with the codec which matches its extension (failing if there isn't one, rather than writing a file whose contents don't match its name).
+  FFmpegEncoder::Options encoderOptions;
+  const std::filesystem::path path( AnsiCodePageToWideString( filename ) );
+  const auto codec = GetOutputCodec( path, encoderOptions.OutputCodec );
+  if ( !codec )
+    return 0;
+  encoderOptions.OutputCodec = *codec;
+  try {
+    FFmpegEncoder* encoder = new FFmpegEncoder( WideStringToUTF8( path.wstring() ), static_cast<uint32_t>( sampleRate ), static_cast<uint32_t>( bitsPerSample ), static_cast<uint32_t>( channels ), encoderOptions );
+    *chunkSize = kChunkSize;
+    return encoder;
+  } catch ( const std::runtime_error& ) {
+    return 0;
+  }
+}
+
+void __stdcall CloseFilterOutput( HANDLE output )
+{
+  FFmpegEncoder* encoder = static_cast<FFmpegEncoder*>( output );
+  if ( nullptr != encoder )
+    delete encoder;
+}
+
+DWORD __stdcall WriteFilterOutput( HANDLE output, BYTE* data, LONG bytes )
+{
+  FFmpegEncoder* encoder = static_cast<FFmpegEncoder*>( output );
+  if ( nullptr == encoder )
+    return 0;
+  return encoder->Write( data, bytes );
 }
 
 DWORD __stdcall FilterOptionsString( HANDLE hInput, LPSTR str )
 {
   constexpr uint32_t kMaxStringLength = 80;
-  FFmpegDecoder* decoder = static_cast<FFmpegDecoder*>( hInput );
+  Input* input = static_cast<Input*>( hInput );
+  FFmpegDecoder* decoder = ( nullptr != input ) ? input->GetDecoder() : nullptr;
   if ( nullptr != decoder ) {
     // We don't know the length of the destination buffer, so put a sensible limit on our string length.
     const uint32_t count = std::min( decoder->GetDescription().size(), kMaxStringLength - 1 );
@@ -92,3 +255,180 @@ DWORD __stdcall FilterOptionsString( HANDLE hInput, LPSTR str )
   }
   return 0;
 }
+
+DWORD GetNextTag( SPECIALDATA* specialData, const TagData* tagData )
+{
+  if ( nullptr == specialData || nullptr == tagData )
+    return 0;
+
+  uint32_t index = static_cast<uint32_t>( reinterpret_cast<uintptr_t>( specialData->hSpecialData ) );
+  const TagData::Tag* tag = tagData->GetTag( index );
+  if ( nullptr == tag )
+    return 0;
+
+  const auto& [ listType, type, data, count ] = *tag;
+
+  // The item is already laid out, so it is copied straight into a single block sized for it (it is not our responsibility to free this handle).
+  specialData->hData = GlobalAlloc( GMEM_MOVEABLE, data.size() );
+  if ( nullptr == specialData->hData )
+    return 0;
+
+  if ( char* block = static_cast<char*>( GlobalLock( specialData->hData ) ); nullptr != block ) {
+    std::copy( data.begin(), data.end(), block );
+    GlobalUnlock( specialData->hData );
+  }
+  specialData->dwExtra = count;
+  specialData->dwSize = static_cast<DWORD>( data.size() );
+  strcpy_s( specialData->szListType, 8, listType.c_str() );
+  strcpy_s( specialData->szType, 8, type.c_str() );
+
+  specialData->hSpecialData = reinterpret_cast<HANDLE>( static_cast<uintptr_t>( ++index ) );
+  return 1;
+}
+
+DWORD __stdcall FilterGetFirstSpecialData( HANDLE hInput, SPECIALDATA* specialData )
+{
+  Input* input = static_cast<Input*>( hInput );
+  const TagData* tagData = ( nullptr != input ) ? input->GetTagData() : nullptr;
+  if ( nullptr == tagData || nullptr == specialData )
+    return 0;
+
+  specialData->hSpecialData = 0;
+  return GetNextTag( specialData, tagData );
+}
+
+DWORD __stdcall FilterGetNextSpecialData( HANDLE hInput, SPECIALDATA* specialData )
+{
+  Input* input = static_cast<Input*>( hInput );
+  const TagData* tagData = ( nullptr != input ) ? input->GetTagData() : nullptr;
+  return GetNextTag( specialData, tagData );
+}
+
+INT_PTR CALLBACK DialogProc( HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam )
+{
+	switch ( message ) {
+		case WM_INITDIALOG : {
+      FFmpegDecoder::Options options;
+      const auto threadCountOptions = FFmpegDecoder::Options::GetThreadCountOptions();
+      for ( const auto& [ value, description ] : threadCountOptions ) {
+        ComboBox_AddString( GetDlgItem( hwnd, IDC_THREADCOUNT ), description.c_str() );
+        ComboBox_SetItemData( GetDlgItem( hwnd, IDC_THREADCOUNT ), ComboBox_GetCount( GetDlgItem( hwnd, IDC_THREADCOUNT ) ) - 1, value );
+        if ( value == options.ThreadCount )
+          ComboBox_SetCurSel( GetDlgItem( hwnd, IDC_THREADCOUNT ), ComboBox_GetCount( GetDlgItem( hwnd, IDC_THREADCOUNT ) ) - 1 );
+      }
+      const auto audioTrackOptions = FFmpegDecoder::Options::GetAudioTrackOptions();
+      for ( const auto& [ value, description ] : audioTrackOptions ) {
+        ComboBox_AddString( GetDlgItem( hwnd, IDC_AUDIOTRACK ), description.c_str() );
+        ComboBox_SetItemData( GetDlgItem( hwnd, IDC_AUDIOTRACK ), ComboBox_GetCount( GetDlgItem( hwnd, IDC_AUDIOTRACK ) ) - 1, value );
+        if ( value == options.AudioTrack )
+          ComboBox_SetCurSel( GetDlgItem( hwnd, IDC_AUDIOTRACK ), ComboBox_GetCount( GetDlgItem( hwnd, IDC_AUDIOTRACK ) ) - 1 );
+      }
+      Button_SetCheck( GetDlgItem( hwnd, IDC_CACHETRACKS ), options.CacheTracks ? BST_CHECKED : BST_UNCHECKED );
+      const auto sampleRateOptions = FFmpegDecoder::Options::GetSampleRateOptions();
+      for ( const auto& [ value, description ] : sampleRateOptions ) {
+        ComboBox_AddString( GetDlgItem( hwnd, IDC_SAMPLERATE ), description.c_str() );
+        ComboBox_SetItemData( GetDlgItem( hwnd, IDC_SAMPLERATE ), ComboBox_GetCount( GetDlgItem( hwnd, IDC_SAMPLERATE ) ) - 1, value );
+        if ( value == options.SampleRate )
+          ComboBox_SetCurSel( GetDlgItem( hwnd, IDC_SAMPLERATE ), ComboBox_GetCount( GetDlgItem( hwnd, IDC_SAMPLERATE ) ) - 1 );
+      }
+      const auto qualityOptions = FFmpegDecoder::Options::GetResampleQualityOptions();
+      for ( const auto& [ value, description ] : qualityOptions ) {
+        ComboBox_AddString( GetDlgItem( hwnd, IDC_RESAMPLEQUALITY ), description.c_str() );
+        ComboBox_SetItemData( GetDlgItem( hwnd, IDC_RESAMPLEQUALITY ), ComboBox_GetCount( GetDlgItem( hwnd, IDC_RESAMPLEQUALITY ) ) - 1, static_cast<int32_t>( value ) );
+        if ( value == options.Quality )
+          ComboBox_SetCurSel( GetDlgItem( hwnd, IDC_RESAMPLEQUALITY ), ComboBox_GetCount( GetDlgItem( hwnd, IDC_RESAMPLEQUALITY ) ) - 1 );
+      }
+      EnableWindow( GetDlgItem( hwnd, IDC_RESAMPLEQUALITY ), options.SampleRate > 0 );
+      Button_SetCheck( GetDlgItem( hwnd, IDC_FASTPROBE ), options.FastProbe ? BST_CHECKED : BST_UNCHECKED );
+      Button_SetCheck( GetDlgItem( hwnd, IDC_EXACTLENGTH ), options.ExactLength ? BST_CHECKED : BST_UNCHECKED );
+      Button_SetCheck( GetDlgItem( hwnd, IDC_RANGE ), options.Range ? BST_CHECKED : BST_UNCHECKED );
+      SetDlgItemTextA( hwnd, IDC_RANGESTART, FFmpegDecoder::Options::FormatTime( options.RangeStart ).c_str() );
+      SetDlgItemTextA( hwnd, IDC_RANGEEND, ( options.RangeEnd > 0 ) ? FFmpegDecoder::Options::FormatTime( options.RangeEnd ).c_str() : "" );
+      EnableWindow( GetDlgItem( hwnd, IDC_RANGESTART ), options.Range );
+      EnableWindow( GetDlgItem( hwnd, IDC_RANGEEND ), options.Range );
+
+      FFmpegEncoder::Options encoderOptions;
+      const auto codecOptions = FFmpegEncoder::Options::GetCodecOptions();
+      for ( const auto& [ value, description ] : codecOptions ) {
+        ComboBox_AddString( GetDlgItem( hwnd, IDC_CODEC ), description.c_str() );
+        ComboBox_SetItemData( GetDlgItem( hwnd, IDC_CODEC ), ComboBox_GetCount( GetDlgItem( hwnd, IDC_CODEC ) ) - 1, static_cast<int32_t>( value ) );
+        if ( value == encoderOptions.OutputCodec )
+          ComboBox_SetCurSel( GetDlgItem( hwnd, IDC_CODEC ), ComboBox_GetCount( GetDlgItem( hwnd, IDC_CODEC ) ) - 1 );
+      }
+      const auto bitrateOptions = FFmpegEncoder::Options::GetBitrateOptions();
+      for ( const auto& [ value, description ] : bitrateOptions ) {
+        ComboBox_AddString( GetDlgItem( hwnd, IDC_BITRATE ), description.c_str() );
+        ComboBox_SetItemData( GetDlgItem( hwnd, IDC_BITRATE ), ComboBox_GetCount( GetDlgItem( hwnd, IDC_BITRATE ) ) - 1, value );
+        if ( value == encoderOptions.Bitrate )
+          ComboBox_SetCurSel( GetDlgItem( hwnd, IDC_BITRATE ), ComboBox_GetCount( GetDlgItem( hwnd, IDC_BITRATE ) ) - 1 );
+      }
+      EnableWindow( GetDlgItem( hwnd, IDC_BITRATE ), FFmpegEncoder::Options::IsLossy( encoderOptions.OutputCodec ) );
+      return TRUE;
+		}
+    case WM_COMMAND : {
+			switch ( LOWORD( wParam ) ) {
+        case IDC_SAMPLERATE : {
+          if ( CBN_SELCHANGE == HIWORD( wParam ) )
+            EnableWindow( GetDlgItem( hwnd, IDC_RESAMPLEQUALITY ), ComboBox_GetItemData( GetDlgItem( hwnd, IDC_SAMPLERATE ), ComboBox_GetCurSel( GetDlgItem( hwnd, IDC_SAMPLERATE ) ) ) > 0 );
+          break;
+        }
+        case IDC_CODEC : {
+          if ( CBN_SELCHANGE == HIWORD( wParam ) ) {
+            const auto codec = static_cast<FFmpegEncoder::Options::Codec>( ComboBox_GetItemData( GetDlgItem( hwnd, IDC_CODEC ), ComboBox_GetCurSel( GetDlgItem( hwnd, IDC_CODEC ) ) ) );
+            EnableWindow( GetDlgItem( hwnd, IDC_BITRATE ), FFmpegEncoder::Options::IsLossy( codec ) );
+          }
+          break;
+        }
+        case IDC_RANGE : {
+          const bool range = ( BST_CHECKED == Button_GetCheck( GetDlgItem( hwnd, IDC_RANGE ) ) );
+          EnableWindow( GetDlgItem( hwnd, IDC_RANGESTART ), range );
+          EnableWindow( GetDlgItem( hwnd, IDC_RANGEEND ), range );
+          break;
+        }
+				case IDOK : {
+          // An empty (or invalid) end time means the end of the file.
+          std::array<char, 32> rangeStart = {};
+          std::array<char, 32> rangeEnd = {};
+          GetDlgItemTextA( hwnd, IDC_RANGESTART, rangeStart.data(), static_cast<int>( rangeStart.size() ) );
+          GetDlgItemTextA( hwnd, IDC_RANGEEND, rangeEnd.data(), static_cast<int>( rangeEnd.size() ) );
+          FFmpegDecoder::Options options(
+            ComboBox_GetItemData( GetDlgItem( hwnd, IDC_THREADCOUNT ), ComboBox_GetCurSel( GetDlgItem( hwnd, IDC_THREADCOUNT ) ) ),
+            ComboBox_GetItemData( GetDlgItem( hwnd, IDC_AUDIOTRACK ), ComboBox_GetCurSel( GetDlgItem( hwnd, IDC_AUDIOTRACK ) ) ),
+            BST_CHECKED == Button_GetCheck( GetDlgItem( hwnd, IDC_CACHETRACKS ) ),
+            ComboBox_GetItemData( GetDlgItem( hwnd, IDC_SAMPLERATE ), ComboBox_GetCurSel( GetDlgItem( hwnd, IDC_SAMPLERATE ) ) ),
+            static_cast<FFmpegDecoder::Options::ResampleQuality>( ComboBox_GetItemData( GetDlgItem( hwnd, IDC_RESAMPLEQUALITY ), ComboBox_GetCurSel( GetDlgItem( hwnd, IDC_RESAMPLEQUALITY ) ) ) ),
+            BST_CHECKED == Button_GetCheck( GetDlgItem( hwnd, IDC_FASTPROBE ) ),
+            BST_CHECKED == Button_GetCheck( GetDlgItem( hwnd, IDC_EXACTLENGTH ) ),
+            BST_CHECKED == Button_GetCheck( GetDlgItem( hwnd, IDC_RANGE ) ),
+            FFmpegDecoder::Options::ParseTime( rangeStart.data() ).value_or( 0 ),
+            FFmpegDecoder::Options::ParseTime( rangeEnd.data() ).value_or( 0 ) );
+          FFmpegEncoder::Options encoderOptions(
+            static_cast<FFmpegEncoder::Options::Codec>( ComboBox_GetItemData( GetDlgItem( hwnd, IDC_CODEC ), ComboBox_GetCurSel( GetDlgItem( hwnd, IDC_CODEC ) ) ) ),
+            ComboBox_GetItemData( GetDlgItem( hwnd, IDC_BITRATE ), ComboBox_GetCurSel( GetDlgItem( hwnd, IDC_BITRATE ) ) ) );
+				  EndDialog( hwnd, 1 );
+          return TRUE;
+        }
+				case IDCANCEL :
+					EndDialog( hwnd, 0 );
+					return TRUE;
+			}
+			break;
+		}
+	}
+	return FALSE;
+}
+
+DWORD __stdcall FilterOptions( HANDLE hInput )
+{
+	return 0;
+}
+
+DWORD __stdcall FilterGetOptions( HWND hwnd, HINSTANCE inst, LONG sampleRate, WORD channels, WORD bitsPerSample, DWORD options )
+{
+	return DialogBoxParam( inst, MAKEINTRESOURCE(IDD_CONFIG), hwnd, DialogProc, 0 );
+}
+
+DWORD __stdcall FilterSetOptions( HANDLE hInput, DWORD options, LONG sampleRate, WORD channels, WORD bitsPerSample )
+{
+	return 0;
+}
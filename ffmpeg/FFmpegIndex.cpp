@@ -0,0 +1,198 @@
+#include "FFmpegIndex.h"
+#include "FFmpegMappedIO.h"
+
+#include <algorithm>
+#include <fstream>
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/intreadwrite.h>
+}
+
+// Cache file identifier & version.
+constexpr uint32_t kIndexMagic = 0x58494646; // 'FFIX'
+constexpr uint32_t kIndexVersion = 2;
+
+constexpr char kIndexExtension[] = ".ffidx";
+
+// Maximum total size of the FFmpeg indexes in the cache folder (64Mb).
+constexpr uint64_t kMaximumIndexCacheSize = 64ull << 20;
+
+// Each stream of a file has its own index.
+static std::filesystem::path GetIndexFilename( const std::filesystem::path& filename, const int32_t streamIndex )
+{
+  return GetCacheFilename( filename, "." + std::to_string( streamIndex ) + kIndexExtension );
+}
+
+template<typename T>
+static void WriteValue( std::ofstream& stream, const T& value )
+{
+  stream.write( reinterpret_cast<const char*>( &value ), sizeof( T ) );
+}
+
+template<typename T>
+static T ReadValue( std::ifstream& stream )
+{
+  T value = {};
+  stream.read( reinterpret_cast<char*>( &value ), sizeof( T ) );
+  return value;
+}
+
+std::optional<FFmpegIndex> FFmpegIndex::Load( const std::string& filename, const int32_t streamIndex )
+{
+  const std::filesystem::path source( UTF8ToWideString( filename ) );
+  const auto identity = GetFileIdentity( source );
+  const auto cacheFilename = GetIndexFilename( source, streamIndex );
+  if ( !identity || cacheFilename.empty() )
+    return std::nullopt;
+
+  std::ifstream stream( cacheFilename, std::ios::binary );
+  if ( !stream.is_open() || ( kIndexMagic != ReadValue<uint32_t>( stream ) ) || ( kIndexVersion != ReadValue<uint32_t>( stream ) ) )
+    return std::nullopt;
+
+  const uint32_t filenameLength = ReadValue<uint32_t>( stream );
+  if ( filenameLength != filename.size() )
+    return std::nullopt;
+  std::string indexedFilename( filenameLength, 0 );
+  stream.read( indexedFilename.data(), indexedFilename.size() );
+  FileIdentity indexedIdentity;
+  indexedIdentity.Size = ReadValue<uint64_t>( stream );
+  indexedIdentity.LastWriteTime = ReadValue<int64_t>( stream );
+  if ( !stream.good() || ( indexedFilename != filename ) || ( indexedIdentity != *identity ) )
+    return std::nullopt;
+
+  const int32_t indexedStream = ReadValue<int32_t>( stream );
+  const uint32_t sampleRate = ReadValue<uint32_t>( stream );
+  const uint64_t totalSamples = ReadValue<uint64_t>( stream );
+  const uint32_t seekPointCount = ReadValue<uint32_t>( stream );
+  if ( !stream.good() || ( indexedStream != streamIndex ) || ( 0 == sampleRate ) || ( seekPointCount > identity->Size ) )
+    return std::nullopt;
+  std::vector<SeekPoint> seekPoints( seekPointCount );
+  for ( auto& seekPoint : seekPoints ) {
+    seekPoint.Timestamp = ReadValue<int64_t>( stream );
+    seekPoint.Position = ReadValue<uint64_t>( stream );
+  }
+  if ( !stream.good() )
+    return std::nullopt;
+
+  TouchCacheFile( cacheFilename );
+  return FFmpegIndex( filename, *identity, streamIndex, sampleRate, totalSamples, std::move( seekPoints ) );
+}
+
+std::optional<FFmpegIndex> FFmpegIndex::Scan( const std::string& filename, const int32_t streamIndex )
+{
+  const auto identity = GetFileIdentity( UTF8ToWideString( filename ) );
+  if ( !identity )
+    return std::nullopt;
+
+  std::unique_ptr<FFmpegMappedIO> mappedIO;
+  AVFormatContext* formatContext = nullptr;
+  if ( 0 != FFmpegMappedIO::OpenInput( &formatContext, filename, mappedIO ) )
+    return std::nullopt;
+
+  std::optional<FFmpegIndex> index;
+  if ( ( streamIndex >= 0 ) && ( static_cast<unsigned int>( streamIndex ) < formatContext->nb_streams ) ) {
+    // Only the audio packets are needed, so the demuxer can skip everything else.
+    for ( unsigned int i = 0; i < formatContext->nb_streams; i++ )
+      formatContext->streams[ i ]->discard = ( static_cast<int>( i ) == streamIndex ) ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+
+    const AVStream* stream = formatContext->streams[ streamIndex ];
+    const AVCodecParameters* codecParams = stream->codecpar;
+    AVPacket* packet = av_packet_alloc();
+    if ( ( nullptr != packet ) && ( codecParams->sample_rate > 0 ) ) {
+      // Packet durations can only be used directly if the stream time base is a whole number of samples, otherwise they are subject to rounding.
+      const int64_t ticksPerSample = ( ( 1 == stream->time_base.num ) && ( 0 == stream->time_base.den % codecParams->sample_rate ) ) ? ( stream->time_base.den / codecParams->sample_rate ) : 0;
+
+      uint64_t totalSamples = 0;
+      int64_t pendingSkip = 0;
+      std::vector<SeekPoint> seekPoints;
+      bool valid = true;
+      while ( valid && ( av_read_frame( formatContext, packet ) >= 0 ) ) {
+        if ( streamIndex == packet->stream_index ) {
+          int64_t samples = ( ( ticksPerSample > 0 ) && ( packet->duration > 0 ) ) ? ( packet->duration / ticksPerSample ) : 0;
+          if ( samples <= 0 )
+            samples = av_get_audio_frame_duration2( const_cast<AVCodecParameters*>( codecParams ), packet->size );
+          if ( ( samples <= 0 ) && ( packet->duration > 0 ) )
+            samples = av_rescale_q( packet->duration, stream->time_base, AVRational{ 1, codecParams->sample_rate } );
+          valid = ( samples > 0 );
+
+          // Take account of any samples which will be trimmed by the decoder (encoder delay and padding).
+          // As in the decoder, the delay carries over into the following packets until it has all been skipped, whereas the padding only applies to this packet.
+          size_t sideDataSize = 0;
+          int64_t padding = 0;
+          if ( const uint8_t* skip = av_packet_get_side_data( packet, AV_PKT_DATA_SKIP_SAMPLES, &sideDataSize ); ( nullptr != skip ) && ( sideDataSize >= 10 ) ) {
+            pendingSkip = std::max<int64_t>( static_cast<int32_t>( AV_RL32( skip ) ), 0 );
+            padding = AV_RL32( skip + 4 );
+          }
+          const int64_t skipped = std::min( pendingSkip, std::max<int64_t>( samples, 0 ) );
+          pendingSkip -= skipped;
+          samples -= skipped;
+          if ( padding <= samples )
+            samples -= padding;
+          if ( 0 != ( packet->flags & AV_PKT_FLAG_DISCARD ) )
+            samples = 0;
+
+          // Add a seek point for each key frame at least one second after the previous seek point.
+          if ( ( 0 != ( packet->flags & AV_PKT_FLAG_KEY ) ) && ( AV_NOPTS_VALUE != packet->pts ) && ( seekPoints.empty() || ( totalSamples >= seekPoints.back().Position + codecParams->sample_rate ) ) )
+            seekPoints.push_back( { packet->pts, totalSamples } );
+
+          totalSamples += static_cast<uint64_t>( std::max<int64_t>( samples, 0 ) );
+        }
+        av_packet_unref( packet );
+      }
+      if ( valid && ( totalSamples > 0 ) )
+        index.emplace( filename, *identity, streamIndex, static_cast<uint32_t>( codecParams->sample_rate ), totalSamples, std::move( seekPoints ) );
+    }
+    av_packet_free( &packet );
+  }
+  avformat_close_input( &formatContext );
+  return index;
+}
+
+FFmpegIndex::FFmpegIndex( const std::string& filename, const FileIdentity& identity, const int32_t streamIndex, const uint32_t sampleRate, const uint64_t totalSamples, std::vector<SeekPoint> seekPoints ) :
+  m_Filename( filename ),
+  m_Identity( identity ),
+  m_StreamIndex( streamIndex ),
+  m_SampleRate( sampleRate ),
+  m_TotalSamples( totalSamples ),
+  m_SeekPoints( std::move( seekPoints ) )
+{
+}
+
+bool FFmpegIndex::Save() const
+{
+  const auto cacheFilename = GetIndexFilename( UTF8ToWideString( m_Filename ), m_StreamIndex );
+  if ( cacheFilename.empty() )
+    return false;
+
+  std::ofstream stream( cacheFilename, std::ios::binary | std::ios::trunc );
+  WriteValue( stream, kIndexMagic );
+  WriteValue( stream, kIndexVersion );
+  WriteValue( stream, static_cast<uint32_t>( m_Filename.size() ) );
+  stream.write( m_Filename.data(), m_Filename.size() );
+  WriteValue( stream, m_Identity.Size );
+  WriteValue( stream, m_Identity.LastWriteTime );
+  WriteValue( stream, m_StreamIndex );
+  WriteValue( stream, m_SampleRate );
+  WriteValue( stream, m_TotalSamples );
+  WriteValue( stream, static_cast<uint32_t>( m_SeekPoints.size() ) );
+  for ( const auto& seekPoint : m_SeekPoints ) {
+    WriteValue( stream, seekPoint.Timestamp );
+    WriteValue( stream, seekPoint.Position );
+  }
+  stream.close();
+  if ( stream.fail() )
+    return false;
+  RemoveOldCacheFiles( cacheFilename, kIndexExtension, kMaximumIndexCacheSize );
+  return true;
+}
+
+std::optional<FFmpegIndex::SeekPoint> FFmpegIndex::FindSeekPoint( const uint64_t position ) const
+{
+  const auto seekPoint = std::upper_bound( m_SeekPoints.begin(), m_SeekPoints.end(), position, [] ( const uint64_t position, const SeekPoint& seekPoint ) { return position < seekPoint.Position; } );
+  if ( m_SeekPoints.begin() == seekPoint )
+    return std::nullopt;
+  return *std::prev( seekPoint );
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "utils.h"
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Exact sample count and seek table for the audio stream of a file, built by demuxing the packets without decoding them.
+// The index is cached in the shared cache folder, so that the file only needs to be scanned once.
+class FFmpegIndex
+{
+public:
+  struct SeekPoint
+  {
+    int64_t Timestamp = 0;
+    uint64_t Position = 0;
+  };
+
+  // Returns the cached index for the stream of a file, or nullopt if there is no index (or it is out of date).
+  static std::optional<FFmpegIndex> Load( const std::string& filename, const int32_t streamIndex );
+
+  // Scans the audio packets of the stream to create a new index, returning nullopt if the sample count of any packet could not be determined.
+  static std::optional<FFmpegIndex> Scan( const std::string& filename, const int32_t streamIndex );
+
+  FFmpegIndex( const std::string& filename, const FileIdentity& identity, const int32_t streamIndex, const uint32_t sampleRate, const uint64_t totalSamples, std::vector<SeekPoint> seekPoints );
+
+  bool Save() const;
+
+  uint32_t GetSampleRate() const { return m_SampleRate; }
+  uint64_t GetTotalSamples() const { return m_TotalSamples; }
+  const std::vector<SeekPoint>& GetSeekPoints() const { return m_SeekPoints; }
+
+  // Returns the timestamp (in the stream time base) of the key frame packet from which decoding can start to reach the sample position, along with the position
+  // of that packet, or nullopt if decoding needs to start from the beginning of the stream.
+  std::optional<SeekPoint> FindSeekPoint( const uint64_t position ) const;
+
+private:
+  std::string m_Filename;
+  FileIdentity m_Identity;
+  int32_t m_StreamIndex = 0;
+  uint32_t m_SampleRate = 0;
+  uint64_t m_TotalSamples = 0;
+  std::vector<SeekPoint> m_SeekPoints;
+};
@@ -0,0 +1,127 @@
+#include "FFmpegMappedIO.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <cwctype>
+#include <map>
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+}
+
+// Size of the I/O context buffer, which is used for small reads while parsing (larger reads are copied from the mapping straight into the destination).
+constexpr int kBufferSize = 32768;
+
+// Limits on the data read, and the duration analysed, when probing a file quickly (the FFmpeg defaults are 5MB and 5 seconds).
+constexpr int64_t kFastProbeSize = 256 * 1024;
+constexpr int64_t kFastAnalyzeDuration = AV_TIME_BASE / 2;
+
+// Returns the demuxer which would normally be chosen for a file with the extension, or nullptr if the extension is not one of the common ones.
+static const AVInputFormat* GetFormatHint( const std::string& filename )
+{
+  static const std::map<std::wstring, std::string> kExtensionToFormat = {
+    { L".aac", "aac" },
+    { L".ac3", "ac3" },
+    { L".avi", "avi" },
+    { L".flac", "flac" },
+    { L".m2ts", "mpegts" },
+    { L".m4a", "mov" },
+    { L".mka", "matroska" },
+    { L".mkv", "matroska" },
+    { L".mov", "mov" },
+    { L".mp3", "mp3" },
+    { L".mp4", "mov" },
+    { L".mts", "mpegts" },
+    { L".ogg", "ogg" },
+    { L".ts", "mpegts" },
+    { L".webm", "matroska" },
+    { L".wma", "asf" },
+    { L".wmv", "asf" }
+  };
+  std::wstring extension = std::filesystem::path( UTF8ToWideString( filename ) ).extension().wstring();
+  std::transform( extension.begin(), extension.end(), extension.begin(), [] ( wchar_t c ) { return static_cast<wchar_t>( std::towlower( c ) ); } );
+  const auto format = kExtensionToFormat.find( extension );
+  return ( kExtensionToFormat.end() != format ) ? av_find_input_format( format->second.c_str() ) : nullptr;
+}
+
+int FFmpegMappedIO::OpenInput( AVFormatContext** formatContext, const std::string& filename, std::unique_ptr<FFmpegMappedIO>& io, const bool fastProbe )
+{
+  if ( nullptr == *formatContext )
+    *formatContext = avformat_alloc_context();
+  if ( nullptr == *formatContext )
+    return AVERROR( ENOMEM );
+
+  io = std::make_unique<FFmpegMappedIO>( filename );
+  if ( nullptr != io->GetContext() )
+    ( *formatContext )->pb = io->GetContext();
+  else
+    io.reset();
+
+  if ( !fastProbe )
+    return avformat_open_input( formatContext, filename.c_str(), nullptr, nullptr );
+
+  // The probing limits also apply to avformat_find_stream_info.
+  ( *formatContext )->probesize = kFastProbeSize;
+  ( *formatContext )->max_analyze_duration = kFastAnalyzeDuration;
+  const int result = avformat_open_input( formatContext, filename.c_str(), GetFormatHint( filename ), nullptr );
+
+  // If the extension is misleading, or there was not enough data to identify the format, fall back to full probing.
+  return ( result >= 0 ) ? result : OpenInput( formatContext, filename, io );
+}
+
+FFmpegMappedIO::FFmpegMappedIO( const std::string& filename ) :
+  m_File( UTF8ToWideString( filename ) )
+{
+  if ( m_File.IsOpen() ) {
+    if ( uint8_t* buffer = static_cast<uint8_t*>( av_malloc( kBufferSize ) ); nullptr != buffer ) {
+      m_Context = avio_alloc_context( buffer, kBufferSize, 0 /*writeFlag*/, this, Read, nullptr, Seek );
+      if ( nullptr == m_Context )
+        av_free( buffer );
+    }
+  }
+}
+
+FFmpegMappedIO::~FFmpegMappedIO()
+{
+  if ( nullptr != m_Context ) {
+    av_freep( &m_Context->buffer );
+    avio_context_free( &m_Context );
+  }
+}
+
+int FFmpegMappedIO::Read( void* opaque, uint8_t* buffer, int size )
+{
+  FFmpegMappedIO* io = static_cast<FFmpegMappedIO*>( opaque );
+  const size_t bytesRead = ( size > 0 ) ? io->m_File.Read( io->m_Position, buffer, static_cast<size_t>( size ) ) : 0;
+  if ( 0 == bytesRead )
+    return AVERROR_EOF;
+  io->m_Position += bytesRead;
+  return static_cast<int>( bytesRead );
+}
+
+int64_t FFmpegMappedIO::Seek( void* opaque, int64_t offset, int whence )
+{
+  FFmpegMappedIO* io = static_cast<FFmpegMappedIO*>( opaque );
+  const int64_t size = static_cast<int64_t>( io->m_File.GetSize() );
+  int64_t position = 0;
+  switch ( whence & ~AVSEEK_FORCE ) {
+    case AVSEEK_SIZE:
+      return size;
+    case SEEK_SET:
+      position = offset;
+      break;
+    case SEEK_CUR:
+      position = static_cast<int64_t>( io->m_Position ) + offset;
+      break;
+    case SEEK_END:
+      position = size + offset;
+      break;
+    default:
+      return AVERROR( EINVAL );
+  }
+  if ( position < 0 )
+    return AVERROR( EINVAL );
+  io->m_Position = static_cast<uint64_t>( position );
+  return position;
+}
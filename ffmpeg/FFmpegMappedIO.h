@@ -0,0 +1,34 @@
+#pragma once
+
+#include "mappedfile.h"
+
+#include <memory>
+#include <string>
+
+struct AVFormatContext;
+struct AVIOContext;
+
+// Custom I/O context which reads a file through a memory mapping, in place of FFmpeg's file protocol.
+class FFmpegMappedIO
+{
+public:
+  // Opens the format context for the (UTF-8) filename, reading through a memory mapping if possible, otherwise using FFmpeg's file protocol.
+  // The I/O object must outlive the format context, which is freed on failure (as with avformat_open_input).
+  // A fast probe uses a format hint from the extension and limits the probing (which also applies to finding the stream info), falling back to full probing if the file cannot be opened.
+  static int OpenInput( AVFormatContext** formatContext, const std::string& filename, std::unique_ptr<FFmpegMappedIO>& io, const bool fastProbe = false );
+
+  FFmpegMappedIO( const std::string& filename );
+
+  ~FFmpegMappedIO();
+
+  // Returns the I/O context, or nullptr if the file could not be mapped.
+  AVIOContext* GetContext() const { return m_Context; }
+
+private:
+  static int Read( void* opaque, uint8_t* buffer, int size );
+  static int64_t Seek( void* opaque, int64_t offset, int whence );
+
+  MappedFile m_File;
+  uint64_t m_Position = 0;
+  AVIOContext* m_Context = nullptr;
+};
@@ -0,0 +1,155 @@
+#include "FFmpegTrackCache.h"
+
+#include <algorithm>
+#include <vector>
+
+// Cache file identifier & version.
+constexpr uint32_t kTrackCacheMagic = 0x43544646; // 'FFTC'
+constexpr uint32_t kTrackCacheVersion = 1;
+
+constexpr char kTrackCacheExtension[] = ".ffpcm";
+
+// Maximum total size of the track caches in the cache folder (4Gb).
+constexpr uint64_t kMaximumCacheSize = 4ull << 30;
+
+template<typename T>
+static void WriteValue( std::ofstream& stream, const T& value )
+{
+  stream.write( reinterpret_cast<const char*>( &value ), sizeof( T ) );
+}
+
+template<typename T>
+static T ReadValue( std::ifstream& stream )
+{
+  T value = {};
+  stream.read( reinterpret_cast<char*>( &value ), sizeof( T ) );
+  return value;
+}
+
+std::filesystem::path FFmpegTrackCache::GetFilename( const std::string& filename, const int32_t streamIndex )
+{
+  return GetCacheFilename( UTF8ToWideString( filename ), "." + std::to_string( streamIndex ) + kTrackCacheExtension );
+}
+
+std::unique_ptr<FFmpegTrackCache> FFmpegTrackCache::Open( const std::string& filename, const int32_t streamIndex, const uint32_t sampleRate, const uint32_t channels, const uint32_t bitsPerSample )
+{
+  const auto identity = GetFileIdentity( UTF8ToWideString( filename ) );
+  const auto cacheFilename = GetFilename( filename, streamIndex );
+  if ( !identity || cacheFilename.empty() )
+    return nullptr;
+
+  std::ifstream stream( cacheFilename, std::ios::binary );
+  if ( !stream.is_open() || ( kTrackCacheMagic != ReadValue<uint32_t>( stream ) ) || ( kTrackCacheVersion != ReadValue<uint32_t>( stream ) ) )
+    return nullptr;
+
+  const uint32_t filenameLength = ReadValue<uint32_t>( stream );
+  if ( filenameLength != filename.size() )
+    return nullptr;
+  std::string cachedFilename( filenameLength, 0 );
+  stream.read( cachedFilename.data(), cachedFilename.size() );
+  FileIdentity cachedIdentity;
+  cachedIdentity.Size = ReadValue<uint64_t>( stream );
+  cachedIdentity.LastWriteTime = ReadValue<int64_t>( stream );
+  if ( !stream.good() || ( cachedFilename != filename ) || ( cachedIdentity != *identity ) )
+    return nullptr;
+
+  const int32_t cachedStream = ReadValue<int32_t>( stream );
+  const uint32_t cachedSampleRate = ReadValue<uint32_t>( stream );
+  const uint32_t cachedChannels = ReadValue<uint32_t>( stream );
+  const uint32_t cachedBitsPerSample = ReadValue<uint32_t>( stream );
+  const uint64_t totalSamples = ReadValue<uint64_t>( stream );
+  if ( !stream.good() || ( cachedStream != streamIndex ) || ( cachedSampleRate != sampleRate ) || ( cachedChannels != channels ) || ( cachedBitsPerSample != bitsPerSample ) )
+    return nullptr;
+
+  // Check that all the samples are present.
+  const std::streamoff headerSize = stream.tellg();
+  std::error_code ec;
+  const auto fileSize = std::filesystem::file_size( cacheFilename, ec );
+  if ( ec || ( fileSize != static_cast<uint64_t>( headerSize ) + totalSamples * channels * bitsPerSample / 8 ) )
+    return nullptr;
+
+  TouchCacheFile( cacheFilename );
+
+  std::unique_ptr<FFmpegTrackCache> cache( new FFmpegTrackCache( sampleRate, channels, bitsPerSample ) );
+  cache->m_TotalSamples = totalSamples;
+  cache->m_Input = std::move( stream );
+  return cache;
+}
+
+std::unique_ptr<FFmpegTrackCache> FFmpegTrackCache::Create( const std::string& filename, const int32_t streamIndex, const uint32_t sampleRate, const uint32_t channels, const uint32_t bitsPerSample )
+{
+  const auto identity = GetFileIdentity( UTF8ToWideString( filename ) );
+  const auto cacheFilename = GetFilename( filename, streamIndex );
+  if ( !identity || cacheFilename.empty() )
+    return nullptr;
+
+  std::unique_ptr<FFmpegTrackCache> cache( new FFmpegTrackCache( sampleRate, channels, bitsPerSample ) );
+  cache->m_CacheFilename = cacheFilename;
+  cache->m_TempFilename = cacheFilename;
+  cache->m_TempFilename += ".tmp";
+  cache->m_Output.open( cache->m_TempFilename, std::ios::binary | std::ios::trunc );
+  if ( !cache->m_Output.is_open() )
+    return nullptr;
+
+  std::ofstream& stream = cache->m_Output;
+  WriteValue( stream, kTrackCacheMagic );
+  WriteValue( stream, kTrackCacheVersion );
+  WriteValue( stream, static_cast<uint32_t>( filename.size() ) );
+  stream.write( filename.data(), filename.size() );
+  WriteValue( stream, identity->Size );
+  WriteValue( stream, identity->LastWriteTime );
+  WriteValue( stream, streamIndex );
+  WriteValue( stream, sampleRate );
+  WriteValue( stream, channels );
+  WriteValue( stream, bitsPerSample );
+  cache->m_TotalSamplesOffset = stream.tellp();
+  WriteValue( stream, uint64_t( 0 ) );
+  return stream.good() ? std::move( cache ) : nullptr;
+}
+
+FFmpegTrackCache::FFmpegTrackCache( const uint32_t sampleRate, const uint32_t channels, const uint32_t bitsPerSample ) :
+  m_SampleRate( sampleRate ),
+  m_Channels( channels ),
+  m_BitsPerSample( bitsPerSample )
+{
+}
+
+FFmpegTrackCache::~FFmpegTrackCache()
+{
+  if ( m_Output.is_open() ) {
+    m_Output.close();
+    std::error_code ec;
+    std::filesystem::remove( m_TempFilename, ec );
+  }
+}
+
+bool FFmpegTrackCache::Write( const uint8_t* data, const size_t size )
+{
+  m_Output.write( reinterpret_cast<const char*>( data ), size );
+  m_BytesWritten += size;
+  return m_Output.good();
+}
+
+bool FFmpegTrackCache::Finish()
+{
+  m_TotalSamples = m_BytesWritten / ( m_Channels * m_BitsPerSample / 8 );
+  m_Output.seekp( m_TotalSamplesOffset );
+  WriteValue( m_Output, m_TotalSamples );
+  m_Output.close();
+
+  std::error_code ec;
+  if ( !m_Output.fail() )
+    std::filesystem::rename( m_TempFilename, m_CacheFilename, ec );
+  if ( m_Output.fail() || ec ) {
+    std::filesystem::remove( m_TempFilename, ec );
+    return false;
+  }
+  RemoveOldCacheFiles( m_CacheFilename, kTrackCacheExtension, kMaximumCacheSize );
+  return true;
+}
+
+size_t FFmpegTrackCache::Read( uint8_t* data, const size_t size )
+{
+  m_Input.read( reinterpret_cast<char*>( data ), size );
+  return static_cast<size_t>( m_Input.gcount() );
+}
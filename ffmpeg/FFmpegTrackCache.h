@@ -0,0 +1,57 @@
+#pragma once
+
+#include "utils.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
+
+// Decoded samples for one audio stream of a file, held in the shared cache folder so that the stream can be imported again without decoding.
+class FFmpegTrackCache
+{
+public:
+  // Opens the cached samples for the stream of a file, returning nullptr if there is no complete cache in the given format (or it is out of date).
+  static std::unique_ptr<FFmpegTrackCache> Open( const std::string& filename, const int32_t streamIndex, const uint32_t sampleRate, const uint32_t channels, const uint32_t bitsPerSample );
+
+  // Creates a new cache to be written, which only replaces any existing cache for the stream once it has been finished. Returns nullptr if there is no cache folder.
+  static std::unique_ptr<FFmpegTrackCache> Create( const std::string& filename, const int32_t streamIndex, const uint32_t sampleRate, const uint32_t channels, const uint32_t bitsPerSample );
+
+  // Removes the cache file if it was created but not finished.
+  ~FFmpegTrackCache();
+
+  // Appends interleaved samples to a new cache.
+  bool Write( const uint8_t* data, const size_t size );
+
+  // Records the total sample count of a new cache and moves it into place.
+  bool Finish();
+
+  // Reads interleaved samples from a cache which has been opened, returning the number of bytes read.
+  size_t Read( uint8_t* data, const size_t size );
+
+  uint32_t GetSampleRate() const { return m_SampleRate; }
+  uint32_t GetChannels() const { return m_Channels; }
+  uint32_t GetBitsPerSample() const { return m_BitsPerSample; }
+  uint64_t GetTotalSamples() const { return m_TotalSamples; }
+
+private:
+  FFmpegTrackCache( const uint32_t sampleRate, const uint32_t channels, const uint32_t bitsPerSample );
+
+  // Returns the name of the cache file for the stream of a file.
+  static std::filesystem::path GetFilename( const std::string& filename, const int32_t streamIndex );
+
+  uint32_t m_SampleRate = 0;
+  uint32_t m_Channels = 0;
+  uint32_t m_BitsPerSample = 0;
+  uint64_t m_TotalSamples = 0;
+
+  std::ifstream m_Input;
+  std::ofstream m_Output;
+
+  // Temporary file being written, its final name, and the offset of the total sample count in the header.
+  std::filesystem::path m_TempFilename;
+  std::filesystem::path m_CacheFilename;
+  std::streamoff m_TotalSamplesOffset = 0;
+  uint64_t m_BytesWritten = 0;
+};
@@ -1,6 +1,20 @@
 //{{NO_DEPENDENCIES}}
 // Microsoft Visual C++ generated include file.
 // Used by ffmpeg.rc
+//
+#define IDD_CONFIG                      101
+#define IDC_THREADCOUNT                 200
+#define IDC_EXACTLENGTH                 201
+#define IDC_RANGE                       202
+#define IDC_RANGESTART                  203
+#define IDC_RANGEEND                    204
+#define IDC_SAMPLERATE                  205
+#define IDC_RESAMPLEQUALITY             206
+#define IDC_AUDIOTRACK                  207
+#define IDC_CACHETRACKS                 208
+#define IDC_CODEC                       209
+#define IDC_BITRATE                     210
+#define IDC_FASTPROBE                   211
 
 // Next default values for new objects
 // 
@@ -3,8 +3,9 @@
 #include <stdexcept>
 #include <algorithm>
 #include <map>
+#include <cstdio>
 
-FlacEncoder::FlacEncoder( const std::string& filename, const uint32_t sampleRate, const uint32_t bitsPerSample, const uint32_t channels, const uint32_t totalSamples, const uint32_t compressionLevel ) : 
+FlacEncoder::FlacEncoder( const std::string& filename, const uint32_t sampleRate, const uint32_t bitsPerSample, const uint32_t channels, const uint32_t totalSamples, const uint32_t compressionLevel, const bool replayGainTags ) : 
   FLAC::Encoder::File(),
   m_Filename( filename )
 {
@@ -23,11 +24,54 @@ FlacEncoder::FlacEncoder( const std::string& filename, const uint32_t sampleRate
 			m_Metadata.push_back( m_SeekTable.get() );
 		}
 	}
+
+  if ( replayGainTags )
+    m_Loudness = std::make_unique<LoudnessMeter>( sampleRate, channels );
 }
 
 FlacEncoder::~FlacEncoder()
 {
-  finish();
+  if ( finish() && m_Loudness && !m_FirstPass )
+    WriteReplayGainTags();
+}
+
+void FlacEncoder::WriteReplayGainTags()
+{
+  const auto loudness = m_Loudness->GetIntegratedLoudness();
+  if ( !loudness )
+    return;
+
+  // ReplayGain 2.0 uses a reference level of -18 LUFS.
+  char gain[ 32 ] = {};
+  char peak[ 32 ] = {};
+  std::snprintf( gain, sizeof( gain ), "%+.2f dB", -18.0 - *loudness );
+  std::snprintf( peak, sizeof( peak ), "%.6f", m_Loudness->GetTruePeak() );
+
+  // The padding block written with the file leaves room for the tags, so that the file does not need to be rewritten.
+  FLAC::Metadata::Chain chain;
+  if ( !chain.read( m_Filename.c_str() ) )
+    return;
+  FLAC::Metadata::Iterator iterator;
+  iterator.init( chain );
+  std::unique_ptr<FLAC::Metadata::Prototype> block;
+  do {
+    if ( FLAC__METADATA_TYPE_VORBIS_COMMENT == iterator.get_block_type() ) {
+      block.reset( iterator.get_block() );
+      break;
+    }
+  } while ( iterator.next() );
+  if ( !block ) {
+    if ( !iterator.insert_block_after( new FLAC::Metadata::VorbisComment() ) )
+      return;
+    block.reset( iterator.get_block() );
+  }
+
+  if ( auto vorbisComment = dynamic_cast<FLAC::Metadata::VorbisComment*>( block.get() ); nullptr != vorbisComment ) {
+    vorbisComment->replace_comment( FLAC::Metadata::VorbisComment::Entry( "REPLAYGAIN_TRACK_GAIN", gain ), true /*all*/ );
+    vorbisComment->replace_comment( FLAC::Metadata::VorbisComment::Entry( "REPLAYGAIN_TRACK_PEAK", peak ), true /*all*/ );
+    chain.sort_padding();
+    chain.write( true /*usePadding*/, false /*preserveFileStats*/ );
+  }
 }
 
 uint32_t FlacEncoder::Write( unsigned char* srcBuffer, const long byteCount )
@@ -79,6 +123,8 @@ uint32_t FlacEncoder::Write( unsigned char* srcBuffer, const long byteCount )
       break;
     }
   }
+  if ( m_Loudness )
+    m_Loudness->Process( flacBuffer.data(), sampleCount, 1.f / ( 1 << ( get_bits_per_sample() - 1 ) ) );
 	if ( process_interleaved( flacBuffer.data(), sampleCount ) )
 	  return static_cast<uint32_t>( byteCount );
   return 0;
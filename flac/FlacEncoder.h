@@ -1,6 +1,7 @@
 #pragma once
 
 #include "FLAC++/all.h"
+#include "loudness.h"
 
 #include <memory>
 #include <optional>
@@ -15,13 +16,16 @@ constexpr uint32_t kMaximumCompressionLevel = 8;
 class FlacEncoder : public FLAC::Encoder::File
 {
 public:
-	FlacEncoder( const std::string& filename, const uint32_t sampleRate, const uint32_t bitsPerSample, const uint32_t channels, const uint32_t totalSamples, const uint32_t compressionLevel );
+	FlacEncoder( const std::string& filename, const uint32_t sampleRate, const uint32_t bitsPerSample, const uint32_t channels, const uint32_t totalSamples, const uint32_t compressionLevel, const bool replayGainTags );
   virtual ~FlacEncoder();
 
 	uint32_t Write( unsigned char* buffer, const long byteCount );
   void AddTag( const std::string& name, const std::string& value );
 
 private:
+  // Adds the measured loudness to the Vorbis comments of the completed file.
+  void WriteReplayGainTags();
+
   const std::string m_Filename;
   bool m_FirstPass = true;
 	std::vector<FLAC::Metadata::Prototype*> m_Metadata;
@@ -29,4 +33,7 @@ private:
 	std::unique_ptr<FLAC::Metadata::SeekTable> m_SeekTable;
 	std::unique_ptr<FLAC::Metadata::Padding> m_Padding;
 	std::unique_ptr<FLAC::Metadata::VorbisComment> m_VorbisComment;
+
+  // Measures the audio as it is written, so that ReplayGain tags can be added once the file is complete.
+  std::unique_ptr<LoudnessMeter> m_Loudness;
 };
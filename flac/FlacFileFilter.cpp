@@ -4,11 +4,13 @@
 #include "utils.h"
 #include "resource.h"
 #include "CommCtrl.h"
+#include "windowsx.h"
 
 #include <algorithm>
 
 constexpr long kChunkSize = 65536;
 constexpr char kCompressionLevelSetting[] = "flacCompressionLevel";
+constexpr char kReplayGainTagsSetting[] = "flacReplayGainTags";
 
 static const std::map<std::string /*type*/, std::string /*tag*/> kTypeToTag = {
 	{ "IART", "ARTIST" },
@@ -172,7 +174,8 @@ HANDLE __stdcall OpenFilterOutput( LPSTR filename, LONG sampleRate, WORD bitsPer
   }
   utf8Filename += ".flac";
   const uint32_t compressionLevel = static_cast<uint32_t>( std::clamp( ReadSetting( kCompressionLevelSetting ).value_or( kDefaultCompressionLevel ), 0, static_cast<int32_t>( kMaximumCompressionLevel ) ) );
-  FlacEncoder* encoder = new FlacEncoder( utf8Filename, static_cast<uint32_t>( sampleRate ), static_cast<uint32_t>( bitsPerSample ), static_cast<uint32_t>( channels ), static_cast<uint32_t>( size / channels / ( bitsPerSample / 8 ) ), compressionLevel );
+  const bool replayGainTags = ( 0 != ReadSetting( kReplayGainTagsSetting ).value_or( 0 ) );
+  FlacEncoder* encoder = new FlacEncoder( utf8Filename, static_cast<uint32_t>( sampleRate ), static_cast<uint32_t>( bitsPerSample ), static_cast<uint32_t>( channels ), static_cast<uint32_t>( size / channels / ( bitsPerSample / 8 ) ), compressionLevel, replayGainTags );
   *chunkSize = kChunkSize;
   return encoder;
 }
@@ -203,12 +206,14 @@ INT_PTR CALLBACK DialogProc( HWND hwnd, UINT message, WPARAM wParam, LPARAM lPar
 
       const uint32_t compressionLevel = std::clamp( ReadSetting( kCompressionLevelSetting ).value_or( kDefaultCompressionLevel ), 0, static_cast<int32_t>( kMaximumCompressionLevel ) );
       SendDlgItemMessage( hwnd, IDC_QUALITYSLIDER, TBM_SETPOS, 1, compressionLevel );
+      Button_SetCheck( GetDlgItem( hwnd, IDC_REPLAYGAIN ), ReadSetting( kReplayGainTagsSetting ).value_or( 0 ) );
       return TRUE;
 		}
     case WM_COMMAND : {
 			switch ( LOWORD( wParam ) ) { 
 				case IDOK :
           WriteSetting( kCompressionLevelSetting, SendDlgItemMessage( hwnd, IDC_QUALITYSLIDER, TBM_GETPOS, 0, 0 ) );
+          WriteSetting( kReplayGainTagsSetting, Button_GetCheck( GetDlgItem( hwnd, IDC_REPLAYGAIN ) ) );
 				  EndDialog( hwnd, 1 );
           return TRUE;
 				case IDCANCEL :
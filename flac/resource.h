@@ -5,6 +5,7 @@
 #define IDD_CONFIG                    101
 #define IDC_QUALITYSLIDER             200
 #define IDC_QUALITY                   201
+#define IDC_REPLAYGAIN                202
 
 // Next default values for new objects
 // 
@@ -0,0 +1,230 @@
+#include "loudness.h"
+
+#include <cmath>
+#include <numbers>
+
+#if defined( _M_X64 ) || ( defined( _M_IX86_FP ) && ( _M_IX86_FP >= 2 ) ) || defined( __SSE2__ )
+#define LOUDNESS_SSE2
+#include <emmintrin.h>
+#endif
+
+// 4x oversampling interpolation filter for true peak measurement (ITU-R BS.1770-4, Annex 2), one row of taps per phase.
+static constexpr float kTruePeakFilter[ 4 ][ 12 ] = {
+  { 0.0017089843750f, 0.0109863281250f, -0.0196533203125f, 0.0332031250000f, -0.0594482421875f, 0.1373291015625f, 0.9721679687500f, -0.1022949218750f, 0.0476074218750f, -0.0266113281250f, 0.0148925781250f, -0.0083007812500f },
+  { -0.0291748046875f, 0.0292968750000f, -0.0517578125000f, 0.0891113281250f, -0.1665039062500f, 0.4650878906250f, 0.7797851562500f, -0.2003173828125f, 0.1015625000000f, -0.0582275390625f, 0.0330810546875f, -0.0189208984375f },
+  { -0.0189208984375f, 0.0330810546875f, -0.0582275390625f, 0.1015625000000f, -0.2003173828125f, 0.7797851562500f, 0.4650878906250f, -0.1665039062500f, 0.0891113281250f, -0.0517578125000f, 0.0292968750000f, -0.0291748046875f },
+  { -0.0083007812500f, 0.0148925781250f, -0.0266113281250f, 0.0476074218750f, -0.1022949218750f, 0.9721679687500f, 0.1373291015625f, -0.0594482421875f, 0.0332031250000f, -0.0196533203125f, 0.0109863281250f, 0.0017089843750f }
+};
+
+LoudnessMeter::LoudnessMeter( const uint32_t sampleRate, const uint32_t channels ) :
+  m_Channels( std::max( 1u, channels ) ),
+  m_SubBlockFrames( std::max( 1u, ( sampleRate + 5 ) / 10 ) ),
+  m_Block( m_Channels, std::vector<float>( kHistory + kBlockFrames ) ),
+  m_Weighted( m_Channels, std::vector<double>( kBlockFrames ) ),
+  m_FilterState( m_Channels )
+{
+  // K-weighting filter coefficients for the sample rate (a high shelf modelling the head, followed by a high pass filter).
+  const double rate = std::max( 1u, sampleRate );
+  {
+    const double gain = 3.999843853973347;
+    const double q = 0.7071752369554196;
+    const double k = std::tan( std::numbers::pi * 1681.974450955533 / rate );
+    const double vh = std::pow( 10.0, gain / 20 );
+    const double vb = std::pow( vh, 0.4996667741545416 );
+    const double a0 = 1 + k / q + k * k;
+    m_Shelf = { ( vh + vb * k / q + k * k ) / a0, 2 * ( k * k - vh ) / a0, ( vh - vb * k / q + k * k ) / a0, 2 * ( k * k - 1 ) / a0, ( 1 - k / q + k * k ) / a0 };
+  }
+  {
+    const double q = 0.5003270373238773;
+    const double k = std::tan( std::numbers::pi * 38.13547087602444 / rate );
+    const double a0 = 1 + k / q + k * k;
+    m_HighPass = { 1, -2, 1, 2 * ( k * k - 1 ) / a0, ( 1 - k / q + k * k ) / a0 };
+  }
+}
+
+// Returns the sum of the values.
+static double Sum( const double* values, const uint32_t count )
+{
+  double sum = 0;
+  uint32_t i = 0;
+#ifdef LOUDNESS_SSE2
+  __m128d a = _mm_setzero_pd();
+  __m128d b = _mm_setzero_pd();
+  for ( ; i + 4 <= count; i += 4 ) {
+    a = _mm_add_pd( a, _mm_loadu_pd( values + i ) );
+    b = _mm_add_pd( b, _mm_loadu_pd( values + i + 2 ) );
+  }
+  a = _mm_add_pd( a, b );
+  sum = _mm_cvtsd_f64( _mm_add_sd( a, _mm_unpackhi_pd( a, a ) ) );
+#endif
+  for ( ; i < count; i++ )
+    sum += values[ i ];
+  return sum;
+}
+
+float LoudnessMeter::GetTruePeak( const float* block, const uint32_t frames )
+{
+  float peak = 0;
+  uint32_t i = 0;
+#ifdef LOUDNESS_SSE2
+  // One interpolation phase in each lane, so that all four interpolated values are produced together.
+  __m128 taps[ kTaps ];
+  for ( uint32_t tap = 0; tap < kTaps; tap++ )
+    taps[ tap ] = _mm_setr_ps( kTruePeakFilter[ 0 ][ tap ], kTruePeakFilter[ 1 ][ tap ], kTruePeakFilter[ 2 ][ tap ], kTruePeakFilter[ 3 ][ tap ] );
+  const __m128 absMask = _mm_castsi128_ps( _mm_set1_epi32( 0x7fffffff ) );
+  __m128 peaks = _mm_setzero_ps();
+  for ( uint32_t j = 0; j < frames; j++ ) {
+    const float* history = block + j;
+    __m128 value = _mm_setzero_ps();
+    for ( uint32_t tap = 0; tap < kTaps; tap++ )
+      value = _mm_add_ps( value, _mm_mul_ps( taps[ tap ], _mm_set1_ps( history[ kHistory - tap ] ) ) );
+    peaks = _mm_max_ps( peaks, _mm_and_ps( value, absMask ) );
+  }
+  for ( ; i + 4 <= frames; i += 4 )
+    peaks = _mm_max_ps( peaks, _mm_and_ps( _mm_loadu_ps( block + kHistory + i ), absMask ) );
+  peaks = _mm_max_ps( peaks, _mm_shuffle_ps( peaks, peaks, _MM_SHUFFLE( 1, 0, 3, 2 ) ) );
+  peaks = _mm_max_ps( peaks, _mm_shuffle_ps( peaks, peaks, _MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+  peak = _mm_cvtss_f32( peaks );
+  for ( ; i < frames; i++ )
+    peak = std::max( peak, std::fabs( block[ kHistory + i ] ) );
+#else
+  for ( ; i < frames; i++ ) {
+    const float* history = block + i;
+    peak = std::max( peak, std::fabs( history[ kHistory ] ) );
+    for ( uint32_t phase = 0; phase < 4; phase++ ) {
+      float value = 0;
+      for ( uint32_t tap = 0; tap < kTaps; tap++ )
+        value += kTruePeakFilter[ phase ][ tap ] * history[ kHistory - tap ];
+      peak = std::max( peak, std::fabs( value ) );
+    }
+  }
+#endif
+  return peak;
+}
+
+void LoudnessMeter::ApplyKWeighting( const uint32_t channel, const uint32_t frames )
+{
+  // Transposed direct form II biquads.
+  auto& [ z1, z2, z3, z4 ] = m_FilterState[ channel ];
+  const float* block = m_Block[ channel ].data() + kHistory;
+  double* weighted = m_Weighted[ channel ].data();
+  for ( uint32_t i = 0; i < frames; i++ ) {
+    const double x = block[ i ];
+    const double shelf = m_Shelf.b0 * x + z1;
+    z1 = m_Shelf.b1 * x - m_Shelf.a1 * shelf + z2;
+    z2 = m_Shelf.b2 * x - m_Shelf.a2 * shelf;
+    const double y = m_HighPass.b0 * shelf + z3;
+    z3 = m_HighPass.b1 * shelf - m_HighPass.a1 * y + z4;
+    z4 = m_HighPass.b2 * shelf - m_HighPass.a2 * y;
+    weighted[ i ] = y * y;
+  }
+}
+
+bool LoudnessMeter::ApplyKWeightingPair( const uint32_t channel, const uint32_t frames )
+{
+#ifdef LOUDNESS_SSE2
+  // The filters are recursive, so the lanes hold the same filter for two channels (the arithmetic matches the scalar version exactly).
+  const __m128d sb0 = _mm_set1_pd( m_Shelf.b0 ), sb1 = _mm_set1_pd( m_Shelf.b1 ), sb2 = _mm_set1_pd( m_Shelf.b2 ), sa1 = _mm_set1_pd( m_Shelf.a1 ), sa2 = _mm_set1_pd( m_Shelf.a2 );
+  const __m128d hb0 = _mm_set1_pd( m_HighPass.b0 ), hb1 = _mm_set1_pd( m_HighPass.b1 ), hb2 = _mm_set1_pd( m_HighPass.b2 ), ha1 = _mm_set1_pd( m_HighPass.a1 ), ha2 = _mm_set1_pd( m_HighPass.a2 );
+  auto& first = m_FilterState[ channel ];
+  auto& second = m_FilterState[ channel + 1 ];
+  __m128d z1 = _mm_setr_pd( first[ 0 ], second[ 0 ] );
+  __m128d z2 = _mm_setr_pd( first[ 1 ], second[ 1 ] );
+  __m128d z3 = _mm_setr_pd( first[ 2 ], second[ 2 ] );
+  __m128d z4 = _mm_setr_pd( first[ 3 ], second[ 3 ] );
+  const float* firstBlock = m_Block[ channel ].data() + kHistory;
+  const float* secondBlock = m_Block[ channel + 1 ].data() + kHistory;
+  double* firstWeighted = m_Weighted[ channel ].data();
+  double* secondWeighted = m_Weighted[ channel + 1 ].data();
+  for ( uint32_t i = 0; i < frames; i++ ) {
+    const __m128d x = _mm_setr_pd( firstBlock[ i ], secondBlock[ i ] );
+    const __m128d shelf = _mm_add_pd( _mm_mul_pd( sb0, x ), z1 );
+    z1 = _mm_add_pd( _mm_sub_pd( _mm_mul_pd( sb1, x ), _mm_mul_pd( sa1, shelf ) ), z2 );
+    z2 = _mm_sub_pd( _mm_mul_pd( sb2, x ), _mm_mul_pd( sa2, shelf ) );
+    const __m128d y = _mm_add_pd( _mm_mul_pd( hb0, shelf ), z3 );
+    z3 = _mm_add_pd( _mm_sub_pd( _mm_mul_pd( hb1, shelf ), _mm_mul_pd( ha1, y ) ), z4 );
+    z4 = _mm_sub_pd( _mm_mul_pd( hb2, shelf ), _mm_mul_pd( ha2, y ) );
+    const __m128d squared = _mm_mul_pd( y, y );
+    _mm_storel_pd( firstWeighted + i, squared );
+    _mm_storeh_pd( secondWeighted + i, squared );
+  }
+  _mm_storel_pd( &first[ 0 ], z1 );
+  _mm_storeh_pd( &second[ 0 ], z1 );
+  _mm_storel_pd( &first[ 1 ], z2 );
+  _mm_storeh_pd( &second[ 1 ], z2 );
+  _mm_storel_pd( &first[ 2 ], z3 );
+  _mm_storeh_pd( &second[ 2 ], z3 );
+  _mm_storel_pd( &first[ 3 ], z4 );
+  _mm_storeh_pd( &second[ 3 ], z4 );
+  return true;
+#else
+  return false;
+#endif
+}
+
+void LoudnessMeter::ProcessBlock( const uint32_t frames )
+{
+  for ( uint32_t channel = 0; channel < m_Channels; channel++ )
+    m_TruePeak = std::max( m_TruePeak, static_cast<double>( GetTruePeak( m_Block[ channel ].data(), frames ) ) );
+
+  for ( uint32_t channel = 0; channel < m_Channels; ) {
+    if ( ( channel + 1 < m_Channels ) && ApplyKWeightingPair( channel, frames ) ) {
+      channel += 2;
+    } else {
+      ApplyKWeighting( channel, frames );
+      ++channel;
+    }
+  }
+
+  for ( auto& block : m_Block )
+    std::copy( block.begin() + frames, block.begin() + frames + kHistory, block.begin() );
+
+  // Accumulate the 100ms sub-blocks, from which the overlapping 400ms gating blocks are formed (all channels have unit weighting for mono and stereo).
+  for ( uint32_t i = 0; i < frames; ) {
+    const uint32_t count = std::min( frames - i, m_SubBlockFrames - m_SubBlockPosition );
+    for ( uint32_t channel = 0; channel < m_Channels; channel++ )
+      m_SubBlockSum += Sum( m_Weighted[ channel ].data() + i, count );
+    m_SubBlockPosition += count;
+    i += count;
+
+    if ( m_SubBlockFrames == m_SubBlockPosition ) {
+      const double energy = m_SubBlockSum / m_SubBlockFrames;
+      if ( m_SubBlockCount >= m_RecentSubBlocks.size() )
+        m_GatingBlocks.push_back( ( energy + m_RecentSubBlocks[ 0 ] + m_RecentSubBlocks[ 1 ] + m_RecentSubBlocks[ 2 ] ) / 4 );
+      m_RecentSubBlocks = { m_RecentSubBlocks[ 1 ], m_RecentSubBlocks[ 2 ], energy };
+      ++m_SubBlockCount;
+      m_SubBlockSum = 0;
+      m_SubBlockPosition = 0;
+    }
+  }
+}
+
+std::optional<double> LoudnessMeter::GetIntegratedLoudness() const
+{
+  const auto loudness = [] ( const double energy ) { return -0.691 + 10 * std::log10( energy ); };
+
+  // Gated average of the block energies, using the absolute gate (-70 LUFS) and then the relative gate (10 LU below the absolute gated loudness).
+  const auto gatedEnergy = [ this, &loudness ] ( const double gate ) -> std::optional<double> {
+    double sum = 0;
+    size_t count = 0;
+    for ( const double energy : m_GatingBlocks ) {
+      if ( ( energy > 0 ) && ( loudness( energy ) > gate ) ) {
+        sum += energy;
+        ++count;
+      }
+    }
+    if ( 0 == count )
+      return std::nullopt;
+    return sum / count;
+  };
+
+  constexpr double kAbsoluteGate = -70;
+  constexpr double kRelativeGate = -10;
+  const auto absoluteEnergy = gatedEnergy( kAbsoluteGate );
+  if ( !absoluteEnergy )
+    return std::nullopt;
+  const auto relativeEnergy = gatedEnergy( std::max( kAbsoluteGate, loudness( *absoluteEnergy ) + kRelativeGate ) );
+  if ( !relativeEnergy )
+    return std::nullopt;
+  return loudness( *relativeEnergy );
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+// EBU R128 loudness meter (ITU-R BS.1770-4 K-weighting and gating), with true peak detection by 4x oversampling.
+class LoudnessMeter
+{
+public:
+  LoudnessMeter( const uint32_t sampleRate, const uint32_t channels );
+
+  // Adds interleaved samples, which are multiplied by the scale to give a nominal range of +/-1.
+  template<typename T>
+  void Process( const T* samples, const uint32_t frames, const float scale )
+  {
+    for ( uint32_t offset = 0; offset < frames; ) {
+      const uint32_t blockFrames = std::min( frames - offset, kBlockFrames );
+      for ( uint32_t channel = 0; channel < m_Channels; channel++ ) {
+        float* block = m_Block[ channel ].data() + kHistory;
+        const T* source = samples + offset * m_Channels + channel;
+        for ( uint32_t i = 0; i < blockFrames; i++, source += m_Channels )
+          block[ i ] = static_cast<float>( *source ) * scale;
+      }
+      ProcessBlock( blockFrames );
+      offset += blockFrames;
+    }
+  }
+
+  // Returns the integrated loudness in LUFS, or nullopt if there was not enough (non-silent) audio to measure.
+  std::optional<double> GetIntegratedLoudness() const;
+
+  // Returns the maximum true peak, as a linear value.
+  double GetTruePeak() const { return m_TruePeak; }
+
+private:
+  static constexpr uint32_t kBlockFrames = 4096;
+  static constexpr uint32_t kTaps = 12;
+  static constexpr uint32_t kHistory = kTaps - 1;
+
+  struct Biquad
+  {
+    double b0 = 0, b1 = 0, b2 = 0, a1 = 0, a2 = 0;
+  };
+
+  // Processes the deinterleaved block of samples, following the history of the previous block.
+  void ProcessBlock( const uint32_t frames );
+
+  // Returns the absolute peak of a channel's block, including the samples interpolated between them.
+  static float GetTruePeak( const float* block, const uint32_t frames );
+
+  // Applies the K-weighting filters to a channel's block, storing the squared output.
+  void ApplyKWeighting( const uint32_t channel, const uint32_t frames );
+
+  // Applies the K-weighting filters to a pair of channels at once, returning false if SIMD is not available.
+  bool ApplyKWeightingPair( const uint32_t channel, const uint32_t frames );
+
+  const uint32_t m_Channels;
+  const uint32_t m_SubBlockFrames;
+
+  Biquad m_Shelf;
+  Biquad m_HighPass;
+
+  // Per channel sample blocks (preceded by the end of the previous block, for oversampling), K-weighted squared samples, and filter states.
+  std::vector<std::vector<float>> m_Block;
+  std::vector<std::vector<double>> m_Weighted;
+  std::vector<std::array<double, 4>> m_FilterState;
+
+  // Sum of squares for the current 100ms sub-block, and the energies of the most recent sub-blocks.
+  double m_SubBlockSum = 0;
+  uint32_t m_SubBlockPosition = 0;
+  std::array<double, 3> m_RecentSubBlocks = {};
+  uint32_t m_SubBlockCount = 0;
+
+  // Mean square energies of the 400ms gating blocks (with 75% overlap).
+  std::vector<double> m_GatingBlocks;
+
+  double m_TruePeak = 0;
+};
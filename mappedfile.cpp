@@ -0,0 +1,113 @@
+#include "mappedfile.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <Windows.h>
+
+// Size of each mapped view, which is kept fairly small for 32-bit processes.
+constexpr uint64_t kViewSize = 64 * 1024 * 1024;
+
+// Copies from the mapped view, returning false if the copy failed (e.g. because a network file became unavailable).
+static bool CopyFromView( void* dest, const void* source, const size_t size )
+{
+#ifdef _MSC_VER
+  __try {
+    memcpy( dest, source, size );
+  } __except ( ( EXCEPTION_IN_PAGE_ERROR == GetExceptionCode() ) ? EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH ) {
+    return false;
+  }
+#else
+  memcpy( dest, source, size );
+#endif
+  return true;
+}
+
+MappedFile::MappedFile( const std::filesystem::path& filename )
+{
+  HANDLE file = CreateFileW( filename.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr );
+  if ( INVALID_HANDLE_VALUE == file )
+    return;
+  m_File = file;
+
+  // Empty files cannot be mapped.
+  if ( LARGE_INTEGER size = {}; GetFileSizeEx( file, &size ) && ( size.QuadPart > 0 ) ) {
+    m_Size = static_cast<uint64_t>( size.QuadPart );
+    m_Mapping = CreateFileMappingW( file, nullptr, PAGE_READONLY, 0, 0, nullptr );
+  }
+}
+
+MappedFile::~MappedFile()
+{
+  if ( nullptr != m_View )
+    UnmapViewOfFile( m_View );
+  if ( nullptr != m_Mapping )
+    CloseHandle( m_Mapping );
+  if ( nullptr != m_File )
+    CloseHandle( m_File );
+}
+
+bool MappedFile::MapView( const uint64_t offset )
+{
+  if ( ( nullptr != m_View ) && ( offset >= m_ViewOffset ) && ( offset < m_ViewOffset + m_ViewSize ) )
+    return true;
+
+  if ( nullptr != m_View ) {
+    UnmapViewOfFile( m_View );
+    m_View = nullptr;
+    m_ViewSize = 0;
+  }
+
+  // Views must start on a multiple of the allocation granularity.
+  SYSTEM_INFO systemInfo = {};
+  GetSystemInfo( &systemInfo );
+  const uint64_t granularity = std::max<uint64_t>( 1, systemInfo.dwAllocationGranularity );
+  m_ViewOffset = offset - ( offset % granularity );
+  m_ViewSize = static_cast<size_t>( std::min( kViewSize, m_Size - m_ViewOffset ) );
+  m_View = static_cast<const uint8_t*>( MapViewOfFile( m_Mapping, FILE_MAP_READ, static_cast<DWORD>( m_ViewOffset >> 32 ), static_cast<DWORD>( m_ViewOffset & 0xffffffff ), m_ViewSize ) );
+  if ( nullptr == m_View )
+    m_ViewSize = 0;
+  return nullptr != m_View;
+}
+
+const uint8_t* MappedFile::GetData( const uint64_t offset, size_t& available )
+{
+  available = 0;
+  if ( !IsOpen() || ( offset >= m_Size ) || !MapView( offset ) )
+    return nullptr;
+  available = static_cast<size_t>( m_ViewOffset + m_ViewSize - offset );
+  return m_View + ( offset - m_ViewOffset );
+}
+
+const uint8_t* MappedFile::GetContents()
+{
+  if ( !IsOpen() || ( m_Size > SIZE_MAX ) )
+    return nullptr;
+  if ( ( nullptr != m_View ) && ( 0 == m_ViewOffset ) && ( m_ViewSize == m_Size ) )
+    return m_View;
+
+  if ( nullptr != m_View )
+    UnmapViewOfFile( m_View );
+  m_ViewOffset = 0;
+  m_ViewSize = static_cast<size_t>( m_Size );
+  m_View = static_cast<const uint8_t*>( MapViewOfFile( m_Mapping, FILE_MAP_READ, 0, 0, m_ViewSize ) );
+  if ( nullptr == m_View )
+    m_ViewSize = 0;
+  return m_View;
+}
+
+size_t MappedFile::Read( const uint64_t offset, uint8_t* buffer, const size_t size )
+{
+  size_t bytesRead = 0;
+  while ( bytesRead < size ) {
+    size_t available = 0;
+    const uint8_t* data = GetData( offset + bytesRead, available );
+    if ( nullptr == data )
+      break;
+    const size_t count = std::min( available, size - bytesRead );
+    if ( !CopyFromView( buffer + bytesRead, data, count ) )
+      break;
+    bytesRead += count;
+  }
+  return bytesRead;
+}
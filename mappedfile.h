@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+
+// Read-only memory mapping of a file.
+// The file is mapped through a sliding view, so that files larger than the (32-bit) address space can be read.
+class MappedFile
+{
+public:
+  MappedFile( const std::filesystem::path& filename );
+
+  ~MappedFile();
+
+  MappedFile( const MappedFile& ) = delete;
+  MappedFile& operator=( const MappedFile& ) = delete;
+
+  bool IsOpen() const { return nullptr != m_Mapping; }
+
+  uint64_t GetSize() const { return m_Size; }
+
+  // Returns a pointer to the data at the offset, along with the number of bytes which can be read from the pointer (nullptr if the offset is out of range).
+  // The pointer remains valid until the next call to GetData or Read.
+  const uint8_t* GetData( const uint64_t offset, size_t& available );
+
+  // Copies data at the offset into the buffer, returning the number of bytes read (which is less than the requested size at the end of the file, or on a read error).
+  size_t Read( const uint64_t offset, uint8_t* buffer, const size_t size );
+
+  // Maps the whole file in a single view, returning a pointer to its contents (nullptr if the file cannot be mapped in one view, e.g. because it is too large for the address space).
+  // The pointer remains valid until the next call to GetData or Read.
+  const uint8_t* GetContents();
+
+private:
+  // Maps the view containing the offset.
+  bool MapView( const uint64_t offset );
+
+  void* m_File = nullptr;
+  void* m_Mapping = nullptr;
+  uint64_t m_Size = 0;
+
+  const uint8_t* m_View = nullptr;
+  uint64_t m_ViewOffset = 0;
+  size_t m_ViewSize = 0;
+};
@@ -3,6 +3,140 @@
 
 #include <algorithm>
 #include <array>
+#include <cmath>
+
+// Number of samples rendered past the end of each span, to check the start of the next span against.
+constexpr uint64_t kOverlapSamples = 4096;
+
+// Number of samples at the start of each span which are taken from the previous span (since voices can be ramped in after seeking), followed by the number which are compared and crossfaded.
+constexpr uint64_t kSettleSamples = 1024;
+constexpr uint64_t kCompareSamples = 2048;
+
+// Largest error in the start position of a span (e.g. from rounding the order start time) which is allowed for.
+constexpr int64_t kMaximumLag = 16;
+
+// Largest difference between the overlapping samples of two spans (in the nominal range of +/-1) for the spans to be considered to match.
+constexpr float kMatchTolerance = 1.f / 4096;
+
+// Memory allowed for the span renderers (which must fit in the address space of a 32-bit process), and the estimated size of a loaded module instance relative to the file size (as samples can be stored compressed).
+constexpr uint64_t kRendererMemoryBudget = 512ull << 20;
+constexpr uint64_t kModuleSizeFactor = 4;
+
+// Renders stereo samples from the module, appending them to the buffer, until the count is reached (or the end of the song, if there is no count).
+static void Render( openmpt::module& module, const int32_t sampleRate, std::optional<uint64_t> count, std::vector<float>& samples, const std::atomic<bool>& cancelled )
+{
+  constexpr uint64_t kRenderSamples = 4096;
+  if ( count )
+    samples.reserve( samples.size() + 2 * static_cast<size_t>( *count ) );
+  while ( !cancelled && ( !count || ( *count > 0 ) ) ) {
+    const size_t size = samples.size();
+    const size_t request = static_cast<size_t>( count ? std::min( kRenderSamples, *count ) : kRenderSamples );
+    samples.resize( size + 2 * request );
+    const size_t rendered = module.read_interleaved_stereo( sampleRate, request, samples.data() + size );
+    samples.resize( size + 2 * rendered );
+    if ( 0 == rendered )
+      break;
+    if ( count )
+      *count -= rendered;
+  }
+}
+
+struct OpenMPTDecoder::SpanRenderer
+{
+  SpanRenderer( const OpenMPTDecoder& decoder, const SpanRange& range ) :
+    m_Start( range.Start ),
+    m_Length( range.End ? std::optional<uint64_t>( *range.End - range.Start + kOverlapSamples ) : std::nullopt ),
+    m_SampleRate( static_cast<int32_t>( decoder.m_SampleRate ) )
+  {
+    m_Thread = std::thread( &SpanRenderer::Run, this, std::cref( decoder ), range.Order );
+  }
+
+  ~SpanRenderer()
+  {
+    m_Cancelled = true;
+    Wait();
+  }
+
+  void Wait()
+  {
+    if ( m_Thread.joinable() )
+      m_Thread.join();
+  }
+
+  uint64_t GetStart() const { return m_Start; }
+  uint64_t GetSampleCount() const { return m_Samples.size() / 2; }
+  const float* GetSamples() const { return m_Samples.data(); }
+
+  // Joins this span on to the end of the previous span, returning the position in the previous span at which to switch to this one.
+  // If this span does not match the overlap rendered by the previous span, it is rendered again by continuing with the module instance of the previous span.
+  uint64_t Stitch( SpanRenderer& previous )
+  {
+    Wait();
+    const uint64_t boundary = m_Start - previous.m_Start;
+    for ( int64_t i = 0; i <= 2 * kMaximumLag; i++ ) {
+      const int64_t lag = ( 0 != ( i % 2 ) ) ? ( ( i + 1 ) / 2 ) : -( i / 2 );
+      const int64_t position = static_cast<int64_t>( boundary ) + lag;
+      if ( ( position >= 0 ) && Matches( previous, static_cast<uint64_t>( position ) ) ) {
+        const float* previousSamples = previous.GetSamples() + 2 * position;
+        for ( uint64_t n = 0; n < 2 * ( kSettleSamples + kCompareSamples ); n++ ) {
+          const float weight = ( n < 2 * kSettleSamples ) ? 0.f : static_cast<float>( n / 2 - kSettleSamples + 1 ) / ( kCompareSamples + 1 );
+          m_Samples[ n ] = previousSamples[ n ] + weight * ( m_Samples[ n ] - previousSamples[ n ] );
+        }
+        m_Start = previous.m_Start + static_cast<uint64_t>( position );
+        // The previous module instance is no longer needed to continue rendering from.
+        previous.m_Module.reset();
+        return static_cast<uint64_t>( position );
+      }
+    }
+
+    if ( previous.m_Module ) {
+      m_Samples.assign( previous.m_Samples.begin() + 2 * std::min( boundary, previous.GetSampleCount() ), previous.m_Samples.end() );
+      m_Module = std::move( previous.m_Module );
+      Render( *m_Module, m_SampleRate, m_Length ? std::optional<uint64_t>( *m_Length - std::min( *m_Length, GetSampleCount() ) ) : std::nullopt, m_Samples, m_Cancelled );
+    }
+    return boundary;
+  }
+
+private:
+  void Run( const OpenMPTDecoder& decoder, const int32_t order )
+  {
+    try {
+      m_Module = std::make_unique<openmpt::module>( decoder.m_FileData, decoder.m_FileSize );
+      SetRenderParams( *m_Module, decoder.m_Options );
+      if ( order > 0 )
+        m_Module->set_position_order_row( order, 0 );
+      Render( *m_Module, m_SampleRate, m_Length, m_Samples, m_Cancelled );
+      // Nothing continues on from the last span.
+      if ( !m_Length )
+        m_Module.reset();
+    } catch ( const std::exception& ) {
+      m_Module.reset();
+      m_Samples.clear();
+    }
+  }
+
+  // Whether the samples of this span match those of the previous span from the position, once the voices have settled.
+  bool Matches( const SpanRenderer& previous, const uint64_t position ) const
+  {
+    constexpr uint64_t kEnd = kSettleSamples + kCompareSamples;
+    if ( ( GetSampleCount() < kEnd ) || ( previous.GetSampleCount() < position + kEnd ) )
+      return false;
+    const float* previousSamples = previous.GetSamples() + 2 * position;
+    for ( uint64_t n = 2 * kSettleSamples; n < 2 * kEnd; n++ ) {
+      if ( std::fabs( m_Samples[ n ] - previousSamples[ n ] ) > kMatchTolerance )
+        return false;
+    }
+    return true;
+  }
+
+  std::unique_ptr<openmpt::module> m_Module;
+  std::vector<float> m_Samples;
+  uint64_t m_Start = 0;
+  const std::optional<uint64_t> m_Length;
+  const int32_t m_SampleRate;
+  std::atomic<bool> m_Cancelled = false;
+  std::thread m_Thread;
+};
 
 std::string OpenMPTDecoder::GetVersion()
 {
@@ -14,25 +148,46 @@ std::string OpenMPTDecoder::GetVersion()
 	return result;
 }
 
+bool OpenMPTDecoder::IsSupported( const std::wstring& filename )
+{
+  MappedFile file( filename );
+  if ( !file.IsOpen() )
+    return false;
+  std::vector<std::byte> header( static_cast<size_t>( std::min<uint64_t>( openmpt::probe_file_header_get_recommended_size(), file.GetSize() ) ) );
+  header.resize( file.Read( 0, reinterpret_cast<uint8_t*>( header.data() ), header.size() ) );
+
+  // Treat an undetermined result as supported, and leave the final decision to the full load when the file is opened.
+  const int result = openmpt::probe_file_header( openmpt::probe_file_header_flags_default2, header.data(), header.size(), file.GetSize() );
+  return openmpt::probe_file_header_result_failure != result;
+}
+
 OpenMPTDecoder::OpenMPTDecoder( const std::wstring& filename, const Options& options ) :
-  m_stream( filename, std::ios::binary ),
-  m_module( m_stream ),
+  m_Options( options ),
+  m_File( filename ),
+  m_FileData( MapFile( m_File ) ),
+  m_FileSize( static_cast<size_t>( m_File.GetSize() ) ),
+  m_module( LoadModule( UsesSpans( options ) ) ),
   m_SampleRate( options.SampleRate ),
   m_Channels( 2 ),
   m_BitsPerSample( 32 )
 {
-  m_module.set_render_param( openmpt::module::RENDER_STEREOSEPARATION_PERCENT, options.StereoSeparation );
-  m_module.set_render_param( openmpt::module::RENDER_INTERPOLATIONFILTER_LENGTH, options.Interpolation );
-  m_module.set_render_param( openmpt::module::RENDER_VOLUMERAMPING_STRENGTH, options.VolumeRamping );
-  m_module.set_repeat_count( options.RepeatCount );
+  SetRenderParams( *m_module, options );
 
-  // Multiply by the repeat count to give an upper bound on the number of samples - when reading we will stop at the actual end position.
-  m_TotalSamples = static_cast<uint64_t>( std::llround( m_module.get_duration_seconds() * m_SampleRate * ( 1 + options.RepeatCount ) ) );
+  // Repeats restart from the song's restart position rather than the beginning, so their length is found by counting the rendered samples.
+  m_TotalSamples = ( options.RepeatCount > 0 ) ? CountSamples() : static_cast<uint64_t>( std::llround( m_module->get_duration_seconds() * m_SampleRate ) );
   if ( m_TotalSamples > 0 ) {
-    std::string type = m_module.get_metadata( "type_long" );
+    std::string type = m_module->get_metadata( "type_long" );
     m_Description = type.empty() ? std::string( "libopenmpt" ) : type;
-    if ( const int32_t channels = m_module.get_num_channels() )
+    if ( const int32_t channels = m_module->get_num_channels() )
       m_Description += std::string( "\n" ) + std::to_string( channels ) + std::string( 1 == channels ? " channel" : " channels" );
+    if ( UsesSpans( options ) ) {
+      CreateSpans();
+      // The main instance was loaded without samples, so it needs to be reloaded to render the song itself.
+      if ( m_SpanRanges.empty() ) {
+        m_module = LoadModule( false );
+        SetRenderParams( *m_module, options );
+      }
+    }
   } else {
 		throw std::runtime_error( "OpenMPTDecoder failed to initialise" );
   }
@@ -40,13 +195,149 @@ OpenMPTDecoder::OpenMPTDecoder( const std::wstring& filename, const Options& opt
 
 OpenMPTDecoder::~OpenMPTDecoder()
 {
+  m_Renderers.clear();
+  m_CurrentSpan.reset();
+}
+
+const uint8_t* OpenMPTDecoder::MapFile( MappedFile& file )
+{
+  const uint8_t* data = file.GetContents();
+  if ( nullptr == data )
+    throw std::runtime_error( "OpenMPTDecoder failed to map file" );
+  return data;
+}
+
+bool OpenMPTDecoder::UsesSpans( const Options& options )
+{
+  // Spans are only rendered without repeats, since the song position is ambiguous once the song has looped.
+  return options.ParallelRender && ( 0 == options.RepeatCount ) && ( std::thread::hardware_concurrency() >= 2 );
+}
+
+std::unique_ptr<openmpt::module> OpenMPTDecoder::LoadModule( const bool skipSamples ) const
+{
+  return std::make_unique<openmpt::module>( m_FileData, m_FileSize, std::clog, skipSamples ? std::map<std::string, std::string>{ { "load.skip_samples", "1" } } : std::map<std::string, std::string>{} );
+}
+
+void OpenMPTDecoder::SetRenderParams( openmpt::module& module, const Options& options )
+{
+  module.set_render_param( openmpt::module::RENDER_STEREOSEPARATION_PERCENT, options.StereoSeparation );
+  module.set_render_param( openmpt::module::RENDER_INTERPOLATIONFILTER_LENGTH, options.Interpolation );
+  module.set_render_param( openmpt::module::RENDER_VOLUMERAMPING_STRENGTH, options.VolumeRamping );
+  module.set_repeat_count( options.RepeatCount );
+}
+
+uint64_t OpenMPTDecoder::CountSamples() const
+{
+  // Skipping the samples and interpolation makes the render cheap, without affecting the song timing.
+  constexpr size_t kCountSamples = 16384;
+  std::vector<float> buffer( kCountSamples );
+  uint64_t count = 0;
+  try {
+    openmpt::module counter( m_FileData, m_FileSize, std::clog, { { "load.skip_samples", "1" } } );
+    SetRenderParams( counter, m_Options );
+    counter.set_render_param( openmpt::module::RENDER_INTERPOLATIONFILTER_LENGTH, 1 );
+    while ( const size_t samplesRead = counter.read( static_cast<int32_t>( m_SampleRate ), buffer.size(), buffer.data() ) )
+      count += samplesRead;
+  } catch ( const std::exception& ) {
+    // Fall back to an upper bound on the number of samples - when reading we will stop at the actual end position.
+    count = static_cast<uint64_t>( std::llround( m_module->get_duration_seconds() * m_SampleRate * ( 1 + m_Options.RepeatCount ) ) );
+  }
+  return count;
+}
+
+void OpenMPTDecoder::CreateSpans()
+{
+  // Find the start time of each order using the main instance of the module, which is loaded without samples when spans are used.
+  const uint64_t spanLength = static_cast<uint64_t>( m_SampleRate ) * kSpanSeconds;
+  std::vector<SpanRange> spans( 1 );
+  try {
+    openmpt::module& probe = *m_module;
+    double previousSeconds = 0;
+    for ( int32_t order = 1; order < probe.get_num_orders(); order++ ) {
+      // Stop at the first order which is played before the previous one (e.g. because of a position jump), as the orders after it cannot be placed reliably.
+      const double seconds = probe.set_position_order_row( order, 0 );
+      if ( seconds < previousSeconds )
+        break;
+      previousSeconds = seconds;
+      const uint64_t start = static_cast<uint64_t>( std::llround( seconds * m_SampleRate ) );
+      if ( ( start >= spans.back().Start + spanLength ) && ( start + spanLength <= m_TotalSamples ) ) {
+        spans.back().End = start;
+        spans.push_back( { order, start, std::nullopt } );
+      }
+    }
+  } catch ( const std::exception& ) {
+    return;
+  }
+  if ( spans.size() < 2 )
+    return;
+
+  // Each renderer holds a module instance and the samples for its span until the span is read, so limit the number rendered at once (allowing for the span being read).
+  uint64_t longestSpan = m_TotalSamples - std::min( m_TotalSamples, spans.back().Start );
+  for ( const auto& span : spans ) {
+    if ( span.End )
+      longestSpan = std::max( longestSpan, *span.End - span.Start + kOverlapSamples );
+  }
+  const uint64_t rendererSize = kModuleSizeFactor * m_FileSize + longestSpan * m_Channels * sizeof( float );
+  const uint64_t renderers = kRendererMemoryBudget / rendererSize;
+  if ( renderers < 3 )
+    return;
+
+  m_SpanRanges = std::move( spans );
+  m_MaximumRenderers = static_cast<size_t>( std::min<uint64_t>( { renderers - 1, std::thread::hardware_concurrency(), 8 } ) );
+}
+
+void OpenMPTDecoder::StartRenderers()
+{
+  while ( ( m_Renderers.size() < m_MaximumRenderers ) && ( m_NextSpan < m_SpanRanges.size() ) )
+    m_Renderers.push_back( std::make_unique<SpanRenderer>( *this, m_SpanRanges[ m_NextSpan++ ] ) );
+}
+
+bool OpenMPTDecoder::NextSpan()
+{
+  StartRenderers();
+  if ( m_Renderers.empty() )
+    return false;
+
+  m_CurrentSpan = std::move( m_Renderers.front() );
+  m_Renderers.pop_front();
+  m_CurrentSpan->Wait();
+  m_SpanPosition = 0;
+  StartRenderers();
+
+  // Read up to the earliest position at which the next span could start, at which point the spans are stitched together.
+  m_SpanStitched = m_Renderers.empty();
+  m_SpanEnd = m_CurrentSpan->GetSampleCount();
+  if ( !m_SpanStitched )
+    m_SpanEnd = std::min( m_SpanEnd, m_Renderers.front()->GetStart() - m_CurrentSpan->GetStart() - kMaximumLag );
+  return true;
+}
+
+uint32_t OpenMPTDecoder::ReadSpans( float* buffer, const uint32_t sampleCount )
+{
+  uint32_t samplesRead = 0;
+  while ( samplesRead < sampleCount ) {
+    if ( !m_CurrentSpan || ( m_SpanPosition >= m_SpanEnd ) ) {
+      if ( m_CurrentSpan && !m_SpanStitched ) {
+        m_SpanEnd = std::clamp( m_Renderers.front()->Stitch( *m_CurrentSpan ), m_SpanPosition, m_CurrentSpan->GetSampleCount() );
+        m_SpanStitched = true;
+      } else if ( !NextSpan() ) {
+        break;
+      }
+      continue;
+    }
+    const uint32_t count = static_cast<uint32_t>( std::min<uint64_t>( sampleCount - samplesRead, m_SpanEnd - m_SpanPosition ) );
+    std::copy_n( m_CurrentSpan->GetSamples() + 2 * m_SpanPosition, 2 * count, buffer + 2 * samplesRead );
+    m_SpanPosition += count;
+    samplesRead += count;
+  }
+  return samplesRead;
 }
 
 uint32_t OpenMPTDecoder::Read( unsigned char* destBuffer, const long byteCount )
 {
   float* buffer = reinterpret_cast<float*>( destBuffer );
   const uint32_t sampleCount = byteCount / m_Channels / ( m_BitsPerSample / 8 );
-  const uint32_t samplesRead = m_module.read_interleaved_stereo( static_cast<int32_t>( m_SampleRate ), sampleCount, buffer );
+  const uint32_t samplesRead = m_SpanRanges.empty() ? static_cast<uint32_t>( m_module->read_interleaved_stereo( static_cast<int32_t>( m_SampleRate ), sampleCount, buffer ) ) : ReadSpans( buffer, sampleCount );
   // Floating point audio needs to be rescaled for Cool Edit.
   std::for_each( buffer, buffer + samplesRead * m_Channels, [] ( float& f ) { f *= 32768.f; } );
 	return samplesRead * m_Channels * m_BitsPerSample / 8;
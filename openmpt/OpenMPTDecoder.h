@@ -1,16 +1,20 @@
 #pragma once
 
-#include <fstream>
 #include <vector>
 #include <string>
 #include <optional>
 #include <map>
 #include <set>
 #include <algorithm>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <thread>
 
 #include "libopenmpt.hpp"
 
 #include "utils.h"
+#include "mappedfile.h"
 
 class OpenMPTDecoder
 {
@@ -27,12 +31,13 @@ public:
       Read();
     }
 
-    Options( const int32_t sampleRate, const int32_t stereoSeparation, const int32_t interpolation, const int32_t volumeRamping, const int32_t repeatCount ) :
+    Options( const int32_t sampleRate, const int32_t stereoSeparation, const int32_t interpolation, const int32_t volumeRamping, const int32_t repeatCount, const bool parallelRender ) :
       SampleRate( sampleRate ),
       StereoSeparation( stereoSeparation ),
       Interpolation( interpolation ),
       VolumeRamping( volumeRamping ),
-      RepeatCount( repeatCount )
+      RepeatCount( repeatCount ),
+      ParallelRender( parallelRender )
     {
       Write();
     }
@@ -81,6 +86,10 @@ public:
     int32_t Interpolation = kDefaultInterpolation;
     int32_t VolumeRamping = kDefaultVolumeRamping;
     int32_t RepeatCount = 0;
+
+    // Whether to render spans of the song (starting at order boundaries) in parallel, each with its own instance of the module.
+    // Only used without repeats, and any span which does not match the end of the previous span is rendered serially instead.
+    bool ParallelRender = false;
   
   private:
     static constexpr char kSettingSampleRate[] = "openmptSampleRate";
@@ -88,6 +97,7 @@ public:
     static constexpr char kSettingInterpolation[] = "openmptInterpolation";
     static constexpr char kSettingVolumeRamping[] = "openmptVolumeRamping";
     static constexpr char kSettingRepeatCount[] = "openmptRepeatCount";
+    static constexpr char kSettingParallelRender[] = "openmptParallelRender";
 
     void Validate()
     {
@@ -108,6 +118,7 @@ public:
       Interpolation = ReadSetting( kSettingInterpolation ).value_or( kDefaultInterpolation );
       VolumeRamping = ReadSetting( kSettingVolumeRamping ).value_or( kDefaultVolumeRamping );
       RepeatCount = ReadSetting( kSettingRepeatCount ).value_or( 0 );
+      ParallelRender = ( 0 != ReadSetting( kSettingParallelRender ).value_or( 0 ) );
       Validate();
     }
 
@@ -119,6 +130,7 @@ public:
       WriteSetting( kSettingInterpolation, Interpolation );
       WriteSetting( kSettingVolumeRamping, VolumeRamping );
       WriteSetting( kSettingRepeatCount, RepeatCount );
+      WriteSetting( kSettingParallelRender, ParallelRender ? 1 : 0 );
     }
   };
 
@@ -134,11 +146,69 @@ public:
   const std::string& GetDescription() const { return m_Description; }
   static std::string GetVersion();
 
+  // Returns whether the file header looks like a format supported by libopenmpt, without loading the module.
+  static bool IsSupported( const std::wstring& filename );
+
 	uint32_t Read( unsigned char* buffer, const long byteCount );
 
 private:
-  std::ifstream m_stream;
-  openmpt::module m_module;
+  // Minimum length of each span, when rendering in parallel.
+  static constexpr uint32_t kSpanSeconds = 20;
+
+  // Span of the song to render, starting at the first row of an order (with the start and end positions in samples).
+  struct SpanRange
+  {
+    int32_t Order = 0;
+    uint64_t Start = 0;
+    std::optional<uint64_t> End;
+  };
+
+  // Renders one span of the song on a worker thread, using a separate instance of the module.
+  struct SpanRenderer;
+
+  // Maps the whole of the file, throwing an exception on failure.
+  static const uint8_t* MapFile( MappedFile& file );
+
+  // Returns whether the song may be rendered in spans, with the options given.
+  static bool UsesSpans( const Options& options );
+
+  // Loads an instance of the module from the mapped file, optionally without its samples (for finding song positions).
+  std::unique_ptr<openmpt::module> LoadModule( const bool skipSamples ) const;
+
+  // Applies the render settings from the options to a module instance.
+  static void SetRenderParams( openmpt::module& module, const Options& options );
+
+  // Returns the exact number of samples rendered for the song, including repeats, by playing through a silent instance of the module.
+  uint64_t CountSamples() const;
+
+  // Divides the song into spans at order boundaries, if the order positions can be found.
+  void CreateSpans();
+
+  // Starts rendering spans, up to the maximum number held at once.
+  void StartRenderers();
+
+  // Moves on to the next span, setting the position in the current span at which to move on again.
+  bool NextSpan();
+
+  // Fills the buffer from the span renderers, returning the number of samples.
+  uint32_t ReadSpans( float* buffer, const uint32_t sampleCount );
+
+  const Options m_Options;
+  // Read-only mapping of the file, which is shared by every module instance.
+  MappedFile m_File;
+  const uint8_t* const m_FileData;
+  const size_t m_FileSize;
+  std::unique_ptr<openmpt::module> m_module;
+
+  // Spans for parallel rendering, along with the spans currently being rendered (in song order), the span being read, and the read position within that span.
+  std::vector<SpanRange> m_SpanRanges;
+  size_t m_NextSpan = 0;
+  size_t m_MaximumRenderers = 0;
+  std::deque<std::unique_ptr<SpanRenderer>> m_Renderers;
+  std::unique_ptr<SpanRenderer> m_CurrentSpan;
+  uint64_t m_SpanPosition = 0;
+  uint64_t m_SpanEnd = 0;
+  bool m_SpanStitched = false;
   
   std::vector<uint8_t> m_Buffer;
 	uint32_t m_BufferPos = 0;
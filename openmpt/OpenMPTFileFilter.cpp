@@ -29,8 +29,7 @@ int __stdcall QueryCoolFilter( COOLQUERY* cq )
 BOOL __stdcall FilterUnderstandsFormat( LPSTR filename )
 {
   try {
-    OpenMPTDecoder decoder( AnsiCodePageToWideString( filename ) );
-    return TRUE;
+    return OpenMPTDecoder::IsSupported( AnsiCodePageToWideString( filename ) ) ? TRUE : FALSE;
   } catch ( const std::exception& ) {
     return FALSE;
   }
@@ -131,6 +130,7 @@ INT_PTR CALLBACK DialogProc( HWND hwnd, UINT message, WPARAM wParam, LPARAM lPar
       }
 
       Button_SetCheck( GetDlgItem( hwnd, IDC_REPEAT ), options.RepeatCount );
+      Button_SetCheck( GetDlgItem( hwnd, IDC_PARALLEL ), options.ParallelRender ? BST_CHECKED : BST_UNCHECKED );
       return TRUE;
 		}
     case WM_COMMAND : {
@@ -150,7 +150,8 @@ INT_PTR CALLBACK DialogProc( HWND hwnd, UINT message, WPARAM wParam, LPARAM lPar
             SendDlgItemMessage( hwnd, IDC_SEPARATIONSLIDER, TBM_GETPOS, 0, 0 ),
             ComboBox_GetItemData( GetDlgItem( hwnd, IDC_INTERPOLATION ), ComboBox_GetCurSel( GetDlgItem( hwnd, IDC_INTERPOLATION ) ) ),
             ComboBox_GetItemData( GetDlgItem( hwnd, IDC_RAMPING ), ComboBox_GetCurSel( GetDlgItem( hwnd, IDC_RAMPING ) ) ),
-            Button_GetCheck( GetDlgItem( hwnd, IDC_REPEAT ) ) );
+            Button_GetCheck( GetDlgItem( hwnd, IDC_REPEAT ) ),
+            BST_CHECKED == Button_GetCheck( GetDlgItem( hwnd, IDC_PARALLEL ) ) );
 
           // Cancel input if the sample rate has changed, so that the file can be re-opened with Cool Edit being aware of the correct setting.
           const int32_t previousSampleRate = static_cast<int32_t>( GetWindowLongPtr( hwnd, GWLP_USERDATA ) );
@@ -11,6 +11,7 @@
 #define IDC_REPEAT                      205
 #define IDC_LABEL_SAMPLERATE            206
 #define IDC_WARNING_SAMPLERATE          207
+#define IDC_PARALLEL                    208
 
 // Next default values for new objects
 // 
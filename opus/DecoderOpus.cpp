@@ -1,21 +1,403 @@
 #include "DecoderOpus.h"
 
 #include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
 #include <limits>
+#include <mutex>
+#include <thread>
 
-DecoderOpus::DecoderOpus( const std::string& filename )
+// Number of samples decoded ahead of a segment start, for the decoder to converge (as recommended by RFC 7845).
+constexpr int64_t kOpusPreRoll = 3840;
+
+// Minimum length of each segment when a single link is decoded in segments (one minute).
+constexpr uint64_t kMinimumSegmentSamples = 60 * 48000;
+
+struct DecoderOpus::Stream
+{
+  // The stream can be limited to a byte range of the file, in which case positions are relative to the start of the range.
+  Stream( const std::string& filename, const uint64_t start = 0, const std::optional<uint64_t> size = std::nullopt ) :
+    m_Start( start ),
+    m_Size( size )
+  {
+    m_File = op_fopen( &m_FileCallbacks, filename.c_str(), "rb" );
+    if ( ( nullptr != m_File ) && ( start > 0 ) && ( 0 != m_FileCallbacks.seek( m_File, static_cast<opus_int64>( start ), SEEK_SET ) ) ) {
+      m_FileCallbacks.close( m_File );
+      m_File = nullptr;
+    }
+    ogg_sync_init( &m_Sync );
+  }
+
+  ~Stream()
+  {
+    ogg_sync_clear( &m_Sync );
+    if ( ( nullptr != m_File ) && ( nullptr != m_FileCallbacks.close ) )
+      m_FileCallbacks.close( m_File );
+  }
+
+  // Starts (or stops, if the index is null) scanning pages into the index from the current position.
+  void SetIndex( OpusIndex* index )
+  {
+    m_Index = index;
+    ResetSync();
+  }
+
+  static int Read( void* stream, unsigned char* ptr, int nbytes )
+  {
+    Stream* s = static_cast<Stream*>( stream );
+    const int bytesToRead = s->m_Size ? static_cast<int>( std::clamp<int64_t>( static_cast<int64_t>( *s->m_Size ) - s->m_Position, 0, std::max( nbytes, 0 ) ) ) : nbytes;
+    const int bytesRead = ( bytesToRead > 0 ) ? s->m_FileCallbacks.read( s->m_File, ptr, bytesToRead ) : 0;
+    if ( bytesRead > 0 ) {
+      s->m_Position += bytesRead;
+      if ( nullptr != s->m_Index )
+        s->ScanPages( ptr, bytesRead );
+    }
+    return bytesRead;
+  }
+
+  static int Seek( void* stream, opus_int64 offset, int whence )
+  {
+    Stream* s = static_cast<Stream*>( stream );
+    if ( s->m_Size && ( SEEK_END == whence ) ) {
+      offset += static_cast<opus_int64>( *s->m_Size );
+      whence = SEEK_SET;
+    }
+    if ( SEEK_SET == whence )
+      offset += static_cast<opus_int64>( s->m_Start );
+    const int result = s->m_FileCallbacks.seek( s->m_File, offset, whence );
+    if ( 0 == result ) {
+      s->m_Position = s->m_FileCallbacks.tell( s->m_File ) - static_cast<int64_t>( s->m_Start );
+      s->ResetSync();
+    }
+    return result;
+  }
+
+  static opus_int64 Tell( void* stream )
+  {
+    return static_cast<Stream*>( stream )->m_Position;
+  }
+
+  void* m_File = nullptr;
+
+private:
+  void ResetSync()
+  {
+    ogg_sync_reset( &m_Sync );
+    m_SyncOffset = m_Position;
+    m_PendingGranule.reset();
+  }
+
+  void ScanPages( const unsigned char* data, const int size )
+  {
+    if ( char* buffer = ogg_sync_buffer( &m_Sync, size ); nullptr != buffer ) {
+      std::memcpy( buffer, data, size );
+      ogg_sync_wrote( &m_Sync, size );
+    }
+    ogg_page page = {};
+    long result = 0;
+    while ( 0 != ( result = ogg_sync_pageseek( &m_Sync, &page ) ) ) {
+      if ( result < 0 ) {
+        m_SyncOffset -= result;
+        continue;
+      }
+      const int64_t pageOffset = m_SyncOffset;
+      m_SyncOffset += result;
+
+      // Decoding from this page yields samples from the previous page's granule position, as long as the first packet is not continued from the previous page.
+      const int serial = ogg_page_serialno( &page );
+      if ( m_PendingGranule && ( m_PendingSerial == serial ) && !ogg_page_continued( &page ) )
+        m_Index->AddPage( static_cast<uint64_t>( pageOffset ), *m_PendingGranule );
+
+      if ( const int64_t granule = ogg_page_granulepos( &page ); granule >= 0 ) {
+        m_PendingGranule = granule;
+        m_PendingSerial = serial;
+      } else {
+        m_PendingGranule.reset();
+      }
+    }
+  }
+
+  OpusFileCallbacks m_FileCallbacks = {};
+  const uint64_t m_Start;
+  const std::optional<uint64_t> m_Size;
+  int64_t m_Position = 0;
+
+  OpusIndex* m_Index = nullptr;
+  ogg_sync_state m_Sync = {};
+  int64_t m_SyncOffset = 0;
+  std::optional<int64_t> m_PendingGranule;
+  int m_PendingSerial = 0;
+};
+
+// Decodes the next chunk of audio into the buffer, in the sample format used by Cool Edit, returning the number of samples (or a negative error code).
+static int DecodeChunk( OggOpusFile* opusFile, std::vector<uint8_t>& buffer, const uint32_t channels, const uint32_t bitsPerSample )
+{
+  int samples = 0;
+  switch ( bitsPerSample ) {
+    case 16: {
+      short* pcmBuffer = reinterpret_cast<short*>( buffer.data() );
+      const int pcmSize = buffer.size() / ( bitsPerSample / 8 );
+      samples = ( 1 == channels ) ? op_read( opusFile, pcmBuffer, pcmSize, nullptr ) : op_read_stereo( opusFile, pcmBuffer, pcmSize );
+      break;
+    }
+    case 32: {
+      float* pcmBuffer = reinterpret_cast<float*>( buffer.data() );
+      const int pcmSize = buffer.size() / ( bitsPerSample / 8 );
+      samples = ( 1 == channels ) ? op_read_float( opusFile, pcmBuffer, pcmSize, nullptr ) : op_read_float_stereo( opusFile, pcmBuffer, pcmSize );
+      for ( int i = 0; i < samples * static_cast<int>( channels ); i++ )
+        pcmBuffer[ i ] *= 32768.f;
+      break;
+    }
+  }
+  return samples;
+}
+
+struct DecoderOpus::LinkDecoder
+{
+  LinkDecoder( const std::string& filename, const OpusIndex::Link& link, const Segment& segment, const uint32_t channels, const uint32_t bitsPerSample ) :
+    m_Filename( filename ),
+    m_Offset( link.Offset ),
+    m_Size( link.Size ),
+    m_Segment( segment ),
+    m_Channels( channels ),
+    m_BitsPerSample( bitsPerSample ),
+    m_Thread( &LinkDecoder::Run, this )
+  {
+  }
+
+  ~LinkDecoder()
+  {
+    {
+      std::lock_guard<std::mutex> lock( m_Mutex );
+      m_Cancelled = true;
+    }
+    m_Condition.notify_all();
+    m_Thread.join();
+
+    m_SpillInput.close();
+    m_SpillOutput.close();
+    if ( !m_SpillFilename.empty() ) {
+      std::error_code ec;
+      std::filesystem::remove( m_SpillFilename, ec );
+    }
+  }
+
+  // Returns the next decoded chunk, or an empty chunk once the whole segment has been returned.
+  std::vector<uint8_t> Pop()
+  {
+    std::unique_lock<std::mutex> lock( m_Mutex );
+    m_Condition.wait( lock, [ this ] { return !m_Chunks.empty() || ( m_SpillRead < m_SpillWritten ) || m_Finished; } );
+    std::vector<uint8_t> chunk;
+    if ( !m_Chunks.empty() ) {
+      chunk = std::move( m_Chunks.front() );
+      m_Chunks.pop_front();
+      m_BufferedBytes -= chunk.size();
+    } else if ( m_SpillRead < m_SpillWritten ) {
+      // Chunks are only spilled once the memory queue is full, so the spill file continues where the queue left off.
+      chunk.resize( static_cast<size_t>( std::min<uint64_t>( kOpusChunkSize, m_SpillWritten - m_SpillRead ) ) );
+      lock.unlock();
+      if ( !m_SpillInput.is_open() )
+        m_SpillInput.open( m_SpillFilename, std::ios::binary );
+      m_SpillInput.read( reinterpret_cast<char*>( chunk.data() ), chunk.size() );
+      chunk.resize( m_SpillInput.good() ? chunk.size() : 0 );
+      lock.lock();
+      m_SpillRead += chunk.size();
+    }
+    lock.unlock();
+    m_Condition.notify_all();
+    return chunk;
+  }
+
+  // Returns whether the segment could not be decoded in full (only valid once Pop has returned an empty chunk).
+  bool Failed()
+  {
+    std::lock_guard<std::mutex> lock( m_Mutex );
+    return m_Failed;
+  }
+
+private:
+  // Limit on decoded audio held in memory for each link, beyond which it is spilled to a temporary file.
+  static constexpr size_t kMaximumBufferedBytes = 4 * 1024 * 1024;
+
+  void Run()
+  {
+    // The link is opened as a seekable stream limited to the byte range of the link, so opusfile only needs to find the end of the link rather than bisecting the file.
+    Stream stream( m_Filename, m_Offset, m_Size );
+    const OpusFileCallbacks callbacks = { Stream::Read, Stream::Seek, Stream::Tell, nullptr };
+    OggOpusFile* opusFile = ( nullptr != stream.m_File ) ? op_open_callbacks( &stream, &callbacks, nullptr, 0, nullptr ) : nullptr;
+    if ( ( nullptr != opusFile ) && !SeekToStart( opusFile ) ) {
+      op_free( opusFile );
+      opusFile = nullptr;
+    }
+
+    uint64_t position = m_Segment.Start;
+    if ( nullptr != opusFile ) {
+      const uint32_t frameSize = m_Channels * m_BitsPerSample / 8;
+      std::vector<uint8_t> chunk;
+      while ( position < m_Segment.End ) {
+        chunk.resize( static_cast<size_t>( std::min<uint64_t>( kOpusChunkSize, ( m_Segment.End - position ) * frameSize ) ) );
+        const int samples = DecodeChunk( opusFile, chunk, m_Channels, m_BitsPerSample );
+        if ( samples <= 0 )
+          break;
+        position += samples;
+        chunk.resize( samples * frameSize );
+        std::unique_lock<std::mutex> lock( m_Mutex );
+        if ( !m_Spilling && ( m_BufferedBytes >= kMaximumBufferedBytes ) && !m_SpillFailed )
+          StartSpilling();
+        if ( m_Spilling ) {
+          lock.unlock();
+          m_SpillOutput.write( reinterpret_cast<const char*>( chunk.data() ), chunk.size() );
+          m_SpillOutput.flush();
+          lock.lock();
+          if ( !m_SpillOutput.good() )
+            break;
+          m_SpillWritten += chunk.size();
+        } else {
+          m_Condition.wait( lock, [ this ] { return m_Cancelled || ( m_BufferedBytes < kMaximumBufferedBytes ); } );
+          m_BufferedBytes += chunk.size();
+          m_Chunks.push_back( std::move( chunk ) );
+        }
+        if ( m_Cancelled )
+          break;
+        lock.unlock();
+        m_Condition.notify_all();
+        chunk = {};
+      }
+      op_free( opusFile );
+    }
+
+    {
+      std::lock_guard<std::mutex> lock( m_Mutex );
+      m_Finished = true;
+      m_Failed = ( position < m_Segment.End );
+    }
+    m_Condition.notify_all();
+  }
+
+  // Moves to the start of the segment, by seeking to the indexed page and then decoding (and discarding) the pre-roll up to the start.
+  bool SeekToStart( OggOpusFile* opusFile )
+  {
+    const ogg_int64_t start = static_cast<ogg_int64_t>( m_Segment.Start );
+    if ( 0 == start )
+      return true;
+
+    // Fall back to opusfile's own seek (which bisects the link) if the indexed page does not leave enough pre-roll.
+    if ( ( op_raw_seek( opusFile, static_cast<opus_int64>( m_Segment.SeekOffset ) ) < 0 ) || ( op_pcm_tell( opusFile ) < 0 ) || ( op_pcm_tell( opusFile ) + kOpusPreRoll > start ) ) {
+      if ( op_pcm_seek( opusFile, start ) < 0 )
+        return false;
+    }
+    std::vector<float> discard( kOpusChunkSize / sizeof( float ) );
+    ogg_int64_t position = 0;
+    while ( ( position = op_pcm_tell( opusFile ) ) < start ) {
+      const int size = 2 * static_cast<int>( std::min<ogg_int64_t>( discard.size() / 2, start - position ) );
+      if ( op_read_float_stereo( opusFile, discard.data(), size ) <= 0 )
+        return false;
+    }
+    return position == start;
+  }
+
+  // Opens the spill file, so that decoding can continue without waiting for the earlier links to be read.
+  void StartSpilling()
+  {
+    const auto id = std::chrono::steady_clock::now().time_since_epoch().count();
+    std::error_code ec;
+    m_SpillFilename = std::filesystem::temp_directory_path( ec ) / ( "CoolEditOpus" + std::to_string( reinterpret_cast<uintptr_t>( this ) ) + "_" + std::to_string( id ) + ".pcm" );
+    m_SpillOutput.open( m_SpillFilename, std::ios::binary | std::ios::trunc );
+    m_Spilling = m_SpillOutput.is_open();
+    m_SpillFailed = !m_Spilling;
+  }
+
+  const std::string m_Filename;
+  const uint64_t m_Offset;
+  const uint64_t m_Size;
+  const Segment m_Segment;
+  const uint32_t m_Channels;
+  const uint32_t m_BitsPerSample;
+
+  std::mutex m_Mutex;
+  std::condition_variable m_Condition;
+  std::deque<std::vector<uint8_t>> m_Chunks;
+  size_t m_BufferedBytes = 0;
+  bool m_Finished = false;
+  bool m_Failed = false;
+  bool m_Cancelled = false;
+
+  std::filesystem::path m_SpillFilename;
+  std::ofstream m_SpillOutput;
+  std::ifstream m_SpillInput;
+  bool m_Spilling = false;
+  bool m_SpillFailed = false;
+  uint64_t m_SpillWritten = 0;
+  uint64_t m_SpillRead = 0;
+
+  std::thread m_Thread;
+};
+
+DecoderOpus::DecoderOpus( const std::string& filename, const Mode mode ) :
+  m_Index( ( Mode::Regenerate != mode ) ? OpusIndex::Load( filename ) : std::nullopt ),
+  // A cached index already provides the link layout of a chained file, so only the first link is exposed to opusfile, to prevent it bisecting the file on open.
+  m_Stream( ( m_Index && ( m_Index->GetLinks().size() > 1 ) ) ? std::make_unique<Stream>( filename, m_Index->GetLinks().front().Offset, m_Index->GetLinks().front().Size ) : std::make_unique<Stream>( filename ) )
 {
 	int error = 0;
-	m_OpusFile = op_open_file( filename.c_str(), &error );
+  if ( nullptr != m_Stream->m_File ) {
+    const OpusFileCallbacks callbacks = { Stream::Read, Stream::Seek, Stream::Tell, nullptr };
+    m_OpusFile = op_open_callbacks( m_Stream.get(), &callbacks, nullptr, 0, &error );
+  }
 	if ( nullptr != m_OpusFile ) {
 		if ( const OpusHead* head = op_head( m_OpusFile, -1 ); nullptr != head ) {
       m_SampleRate = 48000;
       m_Channels = std::min( 2u, static_cast<uint32_t>( head->channel_count ) );
-      m_Bitrate = static_cast<uint32_t>( op_bitrate( m_OpusFile, -1 ) );
-      m_TotalSamples = static_cast<uint64_t>( op_pcm_total( m_OpusFile, -1 ) );
+      if ( m_Index ) {
+        m_TotalSamples = m_Index->GetTotalSamples();
+        if ( m_TotalSamples > 0 )
+          m_Bitrate = static_cast<uint32_t>( m_Index->GetIdentity().Size * 8 * m_SampleRate / m_TotalSamples );
+      } else {
+        m_Bitrate = static_cast<uint32_t>( op_bitrate( m_OpusFile, -1 ) );
+        m_TotalSamples = static_cast<uint64_t>( op_pcm_total( m_OpusFile, -1 ) );
+        if ( Mode::Regenerate != mode )
+          CreateIndex( filename );
+      }
+
+      // Chained links can have different channel counts, so use the maximum (mono links are then upmixed).
+      if ( m_Index ) {
+        for ( const auto& link : m_Index->GetLinks() ) {
+          m_LinkSamples.push_back( link.TotalSamples );
+          m_Channels = std::max( m_Channels, std::min( 2u, link.Channels ) );
+        }
+      }
 
       // Use 32-bit samples if this will fit within Cool Edit's 2Gb limit.
       m_BitsPerSample = ( ( m_TotalSamples * m_Channels * 32 / 8 ) <= std::numeric_limits<int>().max() ) ? 32u : 16u;
+
+      // Packets can only be passed through to a saved file for single link mono or stereo files, which are not downmixed when decoded.
+      const size_t linkCount = m_Index ? m_Index->GetLinks().size() : static_cast<size_t>( std::max( 0, op_link_count( m_OpusFile ) ) );
+      if ( const auto identity = GetFileIdentity( UTF8ToWideString( filename ) ); identity && ( 1 == linkCount ) && ( 0 == head->mapping_family ) && ( Mode::Regenerate != mode ) )
+        m_Reference = std::make_shared<OpusReference>( filename, *identity, m_Channels, m_BitsPerSample );
+
+      // Each link of a chained file is decoded separately, so the index can be saved now (the page offsets are only needed for single link files).
+      if ( ( m_LinkSamples.size() > 1 ) && m_Indexing ) {
+        m_Indexing = false;
+        m_Stream->SetIndex( nullptr );
+        m_Index->Save();
+      }
+
+      // Chained files are decoded in one segment per link. A long single link is only split into segments when requested, and if its index was cached (rather than being built by this decode), as each segment can then start from an indexed page.
+      if ( m_LinkSamples.size() > 1 ) {
+        for ( uint32_t link = 0; link < m_LinkSamples.size(); link++ )
+          m_Segments.push_back( { link, 0, m_LinkSamples[ link ], 0 } );
+      } else if ( m_Index && !m_Indexing && ( Mode::Segmented == mode ) ) {
+        CreateSegments();
+        // The passthrough reference must match a sequential decode of the source file.
+        if ( !m_Segments.empty() )
+          m_Reference.reset();
+      }
+      if ( !m_Segments.empty() )
+        m_Filename = filename;
 		}
 
     if ( const OpusTags* tags = op_tags( m_OpusFile, -1 ); nullptr != tags ) {
@@ -39,6 +421,8 @@ DecoderOpus::DecoderOpus( const std::string& filename )
     if ( m_Bitrate > 0 )
       m_Description += std::string( "\n" ) + std::to_string( m_Bitrate / 1000 ) + " kbps, ";
     m_Description += std::to_string( m_Channels ) + std::string( 1 == m_Channels ? " channel" : " channels" );
+    if ( m_LinkSamples.size() > 1 )
+      m_Description += ", " + std::to_string( m_LinkSamples.size() ) + " links";
 	} else {
 		throw std::runtime_error( "OpusDecoder could not load file" );
 	}
@@ -47,10 +431,67 @@ DecoderOpus::DecoderOpus( const std::string& filename )
 
 DecoderOpus::~DecoderOpus()
 {
+  m_LinkDecoders.clear();
 	if ( nullptr != m_OpusFile )
 		op_free( m_OpusFile );
 }
 
+void DecoderOpus::CreateIndex( const std::string& filename )
+{
+  const auto identity = GetFileIdentity( UTF8ToWideString( filename ) );
+  if ( !identity || !op_seekable( m_OpusFile ) )
+    return;
+
+  std::vector<OpusIndex::Link> links( static_cast<size_t>( std::max( 0, op_link_count( m_OpusFile ) ) ) );
+  uint64_t offset = 0;
+  for ( int li = 0; li < static_cast<int>( links.size() ); li++ ) {
+    auto& link = links[ li ];
+    link.Serial = op_serialno( m_OpusFile, li );
+    link.Offset = offset;
+    link.Size = static_cast<uint64_t>( std::max<opus_int64>( 0, op_raw_total( m_OpusFile, li ) ) );
+    link.TotalSamples = static_cast<uint64_t>( std::max<ogg_int64_t>( 0, op_pcm_total( m_OpusFile, li ) ) );
+    if ( const OpusHead* head = op_head( m_OpusFile, li ); nullptr != head ) {
+      link.PreSkip = head->pre_skip;
+      link.Channels = static_cast<uint32_t>( head->channel_count );
+    }
+    offset += link.Size;
+  }
+  if ( links.empty() )
+    return;
+
+  m_Index.emplace( filename, *identity, std::move( links ) );
+  m_Stream->SetIndex( &*m_Index );
+  m_Indexing = true;
+}
+
+void DecoderOpus::CreateSegments()
+{
+  const OpusIndex::Link& link = m_Index->GetLinks().front();
+  const uint64_t count = std::min<uint64_t>( std::max( 1u, std::thread::hardware_concurrency() ), link.TotalSamples / kMinimumSegmentSamples );
+  if ( count < 2 )
+    return;
+
+  for ( uint64_t i = 0; i < count; i++ ) {
+    Segment segment = { 0, link.TotalSamples * i / count, link.TotalSamples * ( i + 1 ) / count, 0 };
+    if ( const auto page = ( segment.Start > 0 ) ? m_Index->FindPage( 0, static_cast<int64_t>( segment.Start + link.PreSkip ) - kOpusPreRoll ) : std::nullopt; page && ( page->second >= link.Offset ) )
+      segment.SeekOffset = page->second - link.Offset;
+    m_Segments.push_back( segment );
+  }
+}
+
+void DecoderOpus::UpdateReference( const uint8_t* data, const int samples )
+{
+  if ( samples > 0 ) {
+    m_Reference->AddChunk( data, static_cast<uint32_t>( samples ) );
+  } else if ( 0 == samples ) {
+    // The whole file has been decoded, so this is now the reference for the passthrough encoder.
+    m_Reference->Finalise();
+    OpusReference::SetLast( std::move( m_Reference ) );
+  } else {
+    m_Reference.reset();
+  }
+}
+
 uint32_t DecoderOpus::Read( unsigned char* destBuffer, const long byteCount )
 {
   const uint32_t sampleCount = static_cast<uint32_t>( byteCount ) / m_Channels / ( m_BitsPerSample / 8 );
@@ -62,33 +503,53 @@ uint32_t DecoderOpus::Read( unsigned char* destBuffer, const long byteCount )
       m_OpusBufferPos += bytesToCopy;
       destBuffer += bytesToCopy;
       samplesRead += bytesToCopy / m_Channels / ( m_BitsPerSample / 8 );
+    } else if ( !m_Segments.empty() ) {
+      m_OpusBuffer = ReadSegment();
+      m_OpusBufferPos = 0;
+      m_OpusBufferSize = static_cast<uint32_t>( m_OpusBuffer.size() );
+      if ( m_Reference )
+        UpdateReference( m_OpusBuffer.data(), ( m_OpusBufferSize > 0 ) ? static_cast<int>( m_OpusBufferSize / ( m_Channels * m_BitsPerSample / 8 ) ) : ( m_SegmentFailed ? -1 : 0 ) );
+      if ( 0 == m_OpusBufferSize )
+        break;
     } else {
-      int samples = 0;
-      switch ( m_BitsPerSample ) {
-        case 16: {
-          short* pcmBuffer = reinterpret_cast<short*>( m_OpusBuffer.data() );
-          const int pcmSize = m_OpusBuffer.size() / ( m_BitsPerSample / 8 );
-          samples = ( 1 == m_Channels ) ? op_read( m_OpusFile, pcmBuffer, pcmSize, nullptr ) : op_read_stereo( m_OpusFile, pcmBuffer, pcmSize );
-          break;
-        }
-        case 32: {
-          float* pcmBuffer = reinterpret_cast<float*>( m_OpusBuffer.data() );
-          const int pcmSize = m_OpusBuffer.size() / ( m_BitsPerSample / 8 );
-          samples = ( 1 == m_Channels ) ? op_read_float( m_OpusFile, pcmBuffer, pcmSize, nullptr ) : op_read_float_stereo( m_OpusFile, pcmBuffer, pcmSize );
-          for ( int i = 0; i < samples * static_cast<int>( m_Channels ); i++ )
-            pcmBuffer[ i ] *= 32768.f;
-          break;
-        }
-      }
+      m_OpusBuffer.resize( kOpusChunkSize );
+      const int samples = DecodeChunk( m_OpusFile, m_OpusBuffer, m_Channels, m_BitsPerSample );
       m_OpusBufferPos = 0;
       m_OpusBufferSize = std::max( samples, 0 ) * m_Channels * m_BitsPerSample / 8;
-      if ( 0 == m_OpusBufferSize )
+      if ( m_Reference )
+        UpdateReference( m_OpusBuffer.data(), samples );
+      if ( 0 == m_OpusBufferSize ) {
+        if ( m_Indexing && ( 0 == samples ) ) {
+          // The whole file has been decoded, so the index is complete.
+          m_Indexing = false;
+          m_Stream->SetIndex( nullptr );
+          m_Index->Save();
+        }
         break;
+      }
     }
 	}
 	return samplesRead * m_Channels * m_BitsPerSample / 8;
 }
 
+std::vector<uint8_t> DecoderOpus::ReadSegment()
+{
+  // Keep up to one link decoder per processor running ahead of the current segment.
+  const size_t maximumDecoders = std::max( 1u, std::thread::hardware_concurrency() );
+  const auto& links = m_Index->GetLinks();
+  while ( m_CurrentSegment < m_Segments.size() ) {
+    for ( size_t segment = m_CurrentSegment; ( segment < m_Segments.size() ) && ( segment < m_CurrentSegment + maximumDecoders ); segment++ ) {
+      if ( segment >= m_LinkDecoders.size() )
+        m_LinkDecoders.push_back( std::make_unique<LinkDecoder>( m_Filename, links[ m_Segments[ segment ].Link ], m_Segments[ segment ], m_Channels, m_BitsPerSample ) );
+    }
+    if ( auto chunk = m_LinkDecoders[ m_CurrentSegment ]->Pop(); !chunk.empty() )
+      return chunk;
+    m_SegmentFailed = m_SegmentFailed || m_LinkDecoders[ m_CurrentSegment ]->Failed();
+    m_LinkDecoders[ m_CurrentSegment++ ].reset();
+  }
+  return {};
+}
+
 std::optional<std::string> DecoderOpus::GetTagValue( const std::string& name ) const
 {
   std::string tagName( name );
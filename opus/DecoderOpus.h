@@ -1,6 +1,9 @@
 #pragma once
 #include "Opusfile.h"
+#include "OpusIndex.h"
+#include "OpusReference.h"
 
+#include <memory>
 #include <vector>
 #include <string>
 #include <optional>
@@ -12,8 +15,13 @@ constexpr uint32_t kOpusChunkSize = 65536u;
 class DecoderOpus
 {
 public:
+  // How a single link file is decoded, either sequentially, or in segments decoded concurrently (once the file has been indexed).
+  // Segmented decoding is approximate, as the decoder output differs slightly from a sequential decode near the start of each segment.
+  // Regenerating decodes sequentially without using or updating the cached index, or replacing the passthrough reference.
+  enum class Mode { Sequential, Segmented, Regenerate };
+
 	// Throws std::runtime_error if the file could not be loaded.
-	DecoderOpus( const std::string& filename );
+	DecoderOpus( const std::string& filename, const Mode mode = Mode::Sequential );
 
 	virtual ~DecoderOpus();
 
@@ -24,10 +32,55 @@ public:
   std::optional<std::string> GetTagValue( const std::string& name ) const;
   const std::string& GetDescription() const { return m_Description; }
 
+  // Returns the number of samples in each link of a chained file (or an empty vector if the link layout is unknown).
+  const std::vector<uint64_t>& GetLinkSamples() const { return m_LinkSamples; }
+
 	uint32_t Read( unsigned char* buffer, const long byteCount );
 
 private:
-	OggOpusFile* m_OpusFile;
+  // Source stream for opusfile, which also scans the pages that are read into the index.
+  struct Stream;
+
+  // Part of a link, in samples from the start of the link, along with the offset (from the start of the link) of the indexed page from which to start decoding.
+  struct Segment
+  {
+    uint32_t Link = 0;
+    uint64_t Start = 0;
+    uint64_t End = 0;
+    uint64_t SeekOffset = 0;
+  };
+
+  // Decodes one segment of a link on a worker thread, using a separate file handle.
+  struct LinkDecoder;
+
+  // Creates a new index for the file, to be filled in as the file is decoded.
+  void CreateIndex( const std::string& filename );
+
+  // Splits a long single link file into segments, using the cached index to place the start of each segment.
+  void CreateSegments();
+
+  // Adds decoded samples to the passthrough reference (or completes it, if there are no more samples, or abandons it, if decoding failed).
+  void UpdateReference( const uint8_t* data, const int samples );
+
+  // Returns the next chunk of decoded audio from the link decoders, or an empty chunk at the end of the file.
+  std::vector<uint8_t> ReadSegment();
+
+  std::optional<OpusIndex> m_Index;
+  std::unique_ptr<Stream> m_Stream;
+  bool m_Indexing = false;
+
+  // Hashes of the decoded audio, which become the passthrough reference once the whole file has been decoded.
+  std::shared_ptr<OpusReference> m_Reference;
+
+  // Segments are decoded by one link decoder each, with several segments decoded concurrently.
+  std::string m_Filename;
+  std::vector<uint64_t> m_LinkSamples;
+  std::vector<Segment> m_Segments;
+  std::vector<std::unique_ptr<LinkDecoder>> m_LinkDecoders;
+  size_t m_CurrentSegment = 0;
+  bool m_SegmentFailed = false;
+
+	OggOpusFile* m_OpusFile = nullptr;
   std::vector<uint8_t> m_OpusBuffer;
 	uint32_t m_OpusBufferPos = 0;
   uint32_t m_OpusBufferSize = 0;
@@ -1,32 +1,291 @@
 #include "EncoderOpus.h"
 
+#include "ogg/ogg.h"
+
 #include <stdexcept>
 #include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 #include <map>
 
+constexpr char kTrackGainTag[] = "R128_TRACK_GAIN";
+
+// Adds a comment to the header of a completed Ogg Opus file, by using some of the padding in the comment header packet.
+// This keeps the packet (and so the page) the same size, so only the page checksum needs to be updated.
+static bool AddHeaderComment( const std::string& filename, const std::string& comment )
+{
+  std::fstream stream( std::filesystem::path( UTF8ToWideString( filename ) ), std::ios::binary | std::ios::in | std::ios::out );
+  if ( !stream.is_open() )
+    return false;
+
+  // Reads a page header at the offset, returning the header and body sizes.
+  std::vector<uint8_t> header( 27 + 255 );
+  const auto readHeader = [ &stream, &header ] ( const uint64_t offset ) -> std::optional<std::pair<size_t, size_t>> {
+    stream.seekg( offset );
+    stream.read( reinterpret_cast<char*>( header.data() ), 27 );
+    if ( !stream.good() || ( 0 != std::memcmp( header.data(), "OggS", 4 ) ) )
+      return std::nullopt;
+    const uint8_t segments = header[ 26 ];
+    stream.read( reinterpret_cast<char*>( header.data() + 27 ), segments );
+    if ( !stream.good() )
+      return std::nullopt;
+    size_t bodySize = 0;
+    for ( uint8_t i = 0; i < segments; i++ )
+      bodySize += header[ 27 + i ];
+    return std::make_pair( static_cast<size_t>( 27 + segments ), bodySize );
+  };
+
+  // The comment header packet must be the only packet on the second page.
+  const auto first = readHeader( 0 );
+  const uint64_t offset = first ? ( first->first + first->second ) : 0;
+  const auto second = first ? readHeader( offset ) : std::nullopt;
+  if ( !second || ( 0 != ( header[ 5 ] & 0x01 ) ) )
+    return false;
+  const auto [ headerSize, bodySize ] = *second;
+  const auto lastSegment = header.begin() + headerSize - 1;
+  if ( ( 255 == *lastSegment ) || std::any_of( header.begin() + 27, lastSegment, [] ( const uint8_t lacing ) { return 255 != lacing; } ) )
+    return false;
+  std::vector<uint8_t> body( bodySize );
+  stream.read( reinterpret_cast<char*>( body.data() ), body.size() );
+  if ( !stream.good() || ( bodySize < 16 ) || ( 0 != std::memcmp( body.data(), "OpusTags", 8 ) ) )
+    return false;
+
+  const auto readLength = [ &body ] ( const size_t position ) -> uint32_t {
+    return ( position + 4 <= body.size() ) ? ( body[ position ] | ( body[ position + 1 ] << 8 ) | ( body[ position + 2 ] << 16 ) | ( body[ position + 3 ] << 24 ) ) : UINT32_MAX;
+  };
+  size_t position = 8;
+  const uint32_t vendorLength = readLength( position );
+  if ( vendorLength > body.size() - 12 )
+    return false;
+  const size_t countPosition = position + 4 + vendorLength;
+  const uint32_t count = readLength( countPosition );
+  position = countPosition + 4;
+  for ( uint32_t i = 0; ( i < count ) && ( position <= body.size() ); i++ ) {
+    const uint32_t length = readLength( position );
+    if ( length > body.size() )
+      return false;
+    position += 4 + length;
+  }
+
+  // The remaining bytes are padding (which must start with a zero bit), and need to be able to hold the new comment.
+  if ( ( position > body.size() ) || ( body.size() - position < 4 + comment.size() ) || ( 0 != ( body[ position ] & 0x01 ) ) )
+    return false;
+  for ( int shift = 0; shift < 32; shift += 8 ) {
+    body[ countPosition + shift / 8 ] = static_cast<uint8_t>( ( count + 1 ) >> shift );
+    body[ position + shift / 8 ] = static_cast<uint8_t>( comment.size() >> shift );
+  }
+  std::copy( comment.begin(), comment.end(), body.begin() + position + 4 );
+
+  ogg_page page = {};
+  page.header = header.data();
+  page.header_len = static_cast<long>( headerSize );
+  page.body = body.data();
+  page.body_len = static_cast<long>( body.size() );
+  ogg_page_checksum_set( &page );
+
+  stream.seekp( offset );
+  stream.write( reinterpret_cast<const char*>( header.data() ), headerSize );
+  stream.write( reinterpret_cast<const char*>( body.data() ), body.size() );
+  return stream.good();
+}
+
+// Preset encoder settings (presets without settings keep the libopus defaults).
+struct PresetSettings
+{
+  int Complexity;
+  int FrameDuration;
+  bool ConstrainedVBR;
+};
+
+static const std::map<OpusPreset, PresetSettings> kPresetSettings = {
+  { OpusPreset::Draft, { 3, OPUS_FRAMESIZE_40_MS, true } },
+  { OpusPreset::Balanced, { 8, OPUS_FRAMESIZE_20_MS, false } },
+  { OpusPreset::Archive, { 10, OPUS_FRAMESIZE_20_MS, false } }
+};
+
+// Applies the bitrate and preset settings (apart from the frame duration) to an Ogg Opus encoder, or to a raw Opus encoder.
+template<typename Encoder>
+static void ApplySettings( Encoder* encoder, int ( *encoderCtl )( Encoder*, int, ... ), const uint32_t bitrate, const OpusPreset preset )
+{
+  encoderCtl( encoder, OPUS_SET_BITRATE( static_cast<int>( 1000 * bitrate ) ) );
+  if ( const auto settings = kPresetSettings.find( preset ); kPresetSettings.end() != settings ) {
+    const PresetSettings& presetSettings = settings->second;
+    encoderCtl( encoder, OPUS_SET_COMPLEXITY( presetSettings.Complexity ) );
+    encoderCtl( encoder, OPUS_SET_VBR( 1 ) );
+    encoderCtl( encoder, OPUS_SET_VBR_CONSTRAINT( presetSettings.ConstrainedVBR ? 1 : 0 ) );
+  }
+}
+
+// Applies the bitrate and preset settings to an Ogg Opus encoder.
+static void ApplySettings( OggOpusEnc* encoder, const uint32_t bitrate, const OpusPreset preset )
+{
+  ApplySettings( encoder, ope_encoder_ctl, bitrate, preset );
+  if ( const auto settings = kPresetSettings.find( preset ); kPresetSettings.end() != settings )
+    ope_encoder_ctl( encoder, OPUS_SET_EXPERT_FRAME_DURATION( settings->second.FrameDuration ) );
+}
+
+// Returns the frame size (at 48kHz) used by the preset, which is 20ms for the libopus defaults.
+static int GetFrameSize( const OpusPreset preset )
+{
+  const auto settings = kPresetSettings.find( preset );
+  return ( ( kPresetSettings.end() != settings ) && ( OPUS_FRAMESIZE_40_MS == settings->second.FrameDuration ) ) ? 1920 : 960;
+}
+
 std::string EncoderOpus::GetVersion()
 {
   return opus_get_version_string();
 }
 
-EncoderOpus::EncoderOpus( const std::string& filename, const uint32_t sampleRate, const uint32_t bitsPerSample, const uint32_t channels, const uint32_t totalSamples, const uint32_t bitrate ) :
+std::map<int32_t, std::wstring> EncoderOpus::GetPresetOptions()
+{
+  return {
+    { static_cast<int32_t>( OpusPreset::Draft ), L"Draft" },
+    { static_cast<int32_t>( OpusPreset::Balanced ), L"Balanced" },
+    { static_cast<int32_t>( OpusPreset::Archive ), L"Archive" },
+    { static_cast<int32_t>( OpusPreset::Default ), L"Default" }
+  };
+}
+
+double EncoderOpus::Benchmark( const OpusPreset preset, const uint32_t bitrate )
+{
+  // Twenty seconds of a stereo test signal (a tone sweep over noise), encoded to a null sink.
+  constexpr uint32_t kSampleRate = 48000;
+  constexpr uint32_t kChannels = 2;
+  constexpr uint32_t kSeconds = 20;
+  std::vector<float> signal( kSampleRate * kSeconds * kChannels );
+  uint32_t noise = 1;
+  double phase = 0;
+  for ( size_t i = 0; i < signal.size(); i += kChannels ) {
+    phase += 2 * 3.14159265358979 * ( 100 + 8000.0 * i / signal.size() ) / kSampleRate;
+    for ( uint32_t channel = 0; channel < kChannels; channel++ ) {
+      noise = noise * 1664525 + 1013904223;
+      signal[ i + channel ] = 0.25f * static_cast<float>( std::sin( phase + channel ) ) + 0.05f * ( static_cast<int32_t>( noise ) / 2147483648.f );
+    }
+  }
+
+  const OpusEncCallbacks callbacks = { [] ( void*, const unsigned char*, opus_int32 ) { return 0; }, [] ( void* ) { return 0; } };
+  OggOpusComments* opusComments = ope_comments_create();
+  if ( nullptr == opusComments )
+    return 0;
+  OggOpusEnc* encoder = ope_encoder_create_callbacks( &callbacks, nullptr, opusComments, kSampleRate, kChannels, 0, nullptr );
+  ope_comments_destroy( opusComments );
+  if ( nullptr == encoder )
+    return 0;
+
+  ApplySettings( encoder, bitrate, preset );
+  const auto start = std::chrono::steady_clock::now();
+  const bool encoded = ( OPE_OK == ope_encoder_write_float( encoder, signal.data(), kSampleRate * kSeconds ) ) && ( OPE_OK == ope_encoder_drain( encoder ) );
+  const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  ope_encoder_destroy( encoder );
+  return ( encoded && ( elapsed.count() > 0 ) ) ? ( kSeconds / elapsed.count() ) : 0;
+}
+
+EncoderOpus::EncoderOpus( const std::string& filename, const uint32_t sampleRate, const uint32_t bitsPerSample, const uint32_t channels, const uint32_t totalSamples, const uint32_t bitrate, const OpusPreset preset, const bool loudnessTags ) :
   m_Filename( filename ),
+  m_OutputFilename( filename ),
   m_SampleRate( sampleRate ),
   m_BitsPerSample( bitsPerSample ),
   m_Channels( channels ),
-  m_Bitrate( bitrate )
+  m_Bitrate( bitrate ),
+  m_Preset( preset )
 {
+  if ( loudnessTags )
+    m_Loudness = std::make_unique<LoudnessMeter>( sampleRate, channels );
+
+  if ( const auto reference = OpusReference::GetLast(); reference && reference->IsCompatible( sampleRate, channels, bitsPerSample ) ) {
+    const auto configure = [ bitrate, preset ] ( OpusEncoder* encoder ) { ApplySettings( encoder, opus_encoder_ctl, bitrate, preset ); };
+    m_Passthrough = std::make_unique<OpusPassthrough>( reference, configure, GetFrameSize( preset ) );
+
+    // The source file is still needed once the output has been started, so write to a temporary file when overwriting the source.
+    std::error_code ec;
+    if ( std::filesystem::equivalent( UTF8ToWideString( filename ), UTF8ToWideString( reference->GetFilename() ), ec ) )
+      m_OutputFilename = filename + ".tmp";
+  }
 }
 
 EncoderOpus::~EncoderOpus()
 {
+  // The track gain is relative to the EBU R128 reference level of -23 LUFS, in Q7.8 format (RFC 7845).
+  std::optional<std::string> trackGain;
+  if ( m_Loudness ) {
+    if ( const auto loudness = m_Loudness->GetIntegratedLoudness(); loudness )
+      trackGain = std::to_string( std::clamp( std::lround( ( -23.0 - *loudness ) * 256 ), -32768l, 32767l ) );
+  }
+
+  // The tag can still be included in the headers, unless the encoder has already been created.
+  const bool encoderCreated = !m_FirstPass;
+  if ( trackGain )
+    m_Tags[ kTrackGainTag ] = *trackGain;
+
+  // Copy the original packets for the audio which matched the source file (re-encoding the rest), otherwise encode it all as normal.
+  bool passedThrough = false;
+  if ( m_Passthrough ) {
+    passedThrough = m_Passthrough->Finish( m_OutputFilename, m_Tags );
+    if ( !passedThrough && !EncodeRegenerated() )
+      m_Failed = true;
+  }
+  m_Passthrough.reset();
+
   if ( nullptr != m_OpusEncoder ) {
-		ope_encoder_drain( m_OpusEncoder );
+		if ( OPE_OK != ope_encoder_drain( m_OpusEncoder ) )
+      m_Failed = true;
 		ope_encoder_destroy( m_OpusEncoder );
+    if ( !m_Failed && encoderCreated && trackGain )
+      AddHeaderComment( m_OutputFilename, kTrackGainTag + std::string( "=" ) + *trackGain );
+  } else if ( !passedThrough ) {
+    m_Failed = true;
+  }
+
+  // A temporary output file only replaces the source file once it has been completely written.
+  if ( m_OutputFilename != m_Filename ) {
+    std::error_code ec;
+    if ( m_Failed )
+      std::filesystem::remove( UTF8ToWideString( m_OutputFilename ), ec );
+    else
+      std::filesystem::rename( UTF8ToWideString( m_OutputFilename ), UTF8ToWideString( m_Filename ), ec );
   }
 }
 
 uint32_t EncoderOpus::Write( unsigned char* srcBuffer, const long byteCount )
+{
+  const int frameSize = m_Channels * ( m_BitsPerSample / 8 );
+  int sampleCount = byteCount / frameSize;
+  if ( m_Loudness ) {
+    if ( 16 == m_BitsPerSample )
+      m_Loudness->Process( reinterpret_cast<const short*>( srcBuffer ), static_cast<uint32_t>( sampleCount ), 1 / 32768.f );
+    else if ( 32 == m_BitsPerSample )
+      m_Loudness->Process( reinterpret_cast<const float*>( srcBuffer ), static_cast<uint32_t>( sampleCount ), 1 / 32768.f );
+  }
+  if ( m_Passthrough ) {
+    const uint32_t consumed = m_Passthrough->Write( srcBuffer, static_cast<uint32_t>( sampleCount ) );
+    if ( consumed == static_cast<uint32_t>( sampleCount ) )
+      return byteCount;
+
+    // None of the audio matches the source file, so encode everything written so far, followed by the rest of this block.
+    if ( !EncodeRegenerated() ) {
+      m_Failed = true;
+      return 0;
+    }
+    srcBuffer += consumed * frameSize;
+    sampleCount -= consumed;
+  }
+  if ( !Encode( srcBuffer, sampleCount ) ) {
+    m_Failed = true;
+    return 0;
+  }
+  return byteCount;
+}
+
+bool EncoderOpus::EncodeRegenerated()
+{
+  const auto passthrough = std::move( m_Passthrough );
+  return passthrough->Regenerate( [ this ] ( uint8_t* buffer, const uint32_t sampleCount ) { return Encode( buffer, static_cast<int>( sampleCount ) ); } );
+}
+
+bool EncoderOpus::Encode( unsigned char* srcBuffer, const int sampleCount )
 {
   if ( m_FirstPass ) {
     m_FirstPass = false;
@@ -35,30 +294,27 @@ uint32_t EncoderOpus::Write( unsigned char* srcBuffer, const long byteCount )
 	  if ( nullptr != opusComments ) {
       for ( const auto& [ name, value ] : m_Tags )
         ope_comments_add( opusComments, name.c_str(), value.c_str() );
-		  m_OpusEncoder = ope_encoder_create_file( m_Filename.c_str(), opusComments, m_SampleRate, m_Channels, 0, nullptr );
-		  if ( nullptr != m_OpusEncoder ) {
-			  const int bitrate = 1000 * m_Bitrate;
-			  ope_encoder_ctl( m_OpusEncoder, OPUS_SET_BITRATE( bitrate ) );
-		  }
+		  m_OpusEncoder = ope_encoder_create_file( m_OutputFilename.c_str(), opusComments, m_SampleRate, m_Channels, 0, nullptr );
+		  if ( nullptr != m_OpusEncoder )
+        ApplySettings( m_OpusEncoder, m_Bitrate, m_Preset );
 		  ope_comments_destroy( opusComments );
 	  }
-
-    if ( nullptr == m_OpusEncoder )
-      return 0;
   }
 
-  const int sampleCount = byteCount / m_Channels / ( m_BitsPerSample / 8 );
+  if ( nullptr == m_OpusEncoder )
+    return false;
+
   switch ( m_BitsPerSample ) {
     case 16:
-      return ( OPE_OK == ope_encoder_write( m_OpusEncoder, reinterpret_cast<const short*>( srcBuffer ), sampleCount ) ) ? byteCount : 0;
+      return OPE_OK == ope_encoder_write( m_OpusEncoder, reinterpret_cast<const short*>( srcBuffer ), sampleCount );
     case 32: {
       float* buffer = reinterpret_cast<float*>( srcBuffer );
       for ( int i = 0; i < sampleCount * m_Channels; i++ )
         buffer[ i ] /= 32768.f;
-      return ( OPE_OK == ope_encoder_write_float( m_OpusEncoder, buffer, sampleCount ) ) ? byteCount : 0;
+      return OPE_OK == ope_encoder_write_float( m_OpusEncoder, buffer, sampleCount );
     }
     default:
-      return 0;
+      return false;
   }
 }
 
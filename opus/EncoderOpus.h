@@ -1,5 +1,7 @@
 #pragma once
 #include "opusenc.h"
+#include "OpusPassthrough.h"
+#include "loudness.h"
 
 #include <memory>
 #include <optional>
@@ -11,23 +13,46 @@ constexpr uint32_t kOpusMinimumBitrate = 8;
 constexpr uint32_t kOpusMaximumBitrate = 256;
 constexpr uint32_t kOpusDefaultBitrate = 128;
 
+// Encoder presets, trading encoding speed against quality (the default preset leaves the libopus encoder defaults unchanged).
+enum class OpusPreset : int32_t { Draft = 0, Balanced = 1, Archive = 2, Default = 3 };
+constexpr OpusPreset kOpusDefaultPreset = OpusPreset::Default;
+
 class EncoderOpus
 {
 public:
-	EncoderOpus( const std::string& filename, const uint32_t sampleRate, const uint32_t bitsPerSample, const uint32_t channels, const uint32_t totalSamples, const uint32_t bitrate );
+	EncoderOpus( const std::string& filename, const uint32_t sampleRate, const uint32_t bitsPerSample, const uint32_t channels, const uint32_t totalSamples, const uint32_t bitrate, const OpusPreset preset, const bool loudnessTags );
   virtual ~EncoderOpus();
 
 	uint32_t Write( unsigned char* buffer, const long byteCount );
   void AddTag( const std::string& name, const std::string& value );
   static std::string GetVersion();
+  static std::map<int32_t, std::wstring> GetPresetOptions();
+
+  // Encodes a test signal using the preset, returning the encoding speed as a multiple of real time (or zero if encoding failed).
+  static double Benchmark( const OpusPreset preset, const uint32_t bitrate );
 
 private:
+  // Encodes sample frames, creating the encoder on the first call.
+  bool Encode( unsigned char* buffer, const int sampleCount );
+
+  // Stops the passthrough, and encodes the audio which was written while it was active.
+  bool EncodeRegenerated();
+
   const std::string m_Filename;
+  std::string m_OutputFilename;
   const int m_SampleRate;
   const int m_Channels;
   const int m_Bitrate;
+  const OpusPreset m_Preset;
   const uint32_t m_BitsPerSample;
 	bool m_FirstPass = true;
 	OggOpusEnc* m_OpusEncoder = nullptr;
+
+  // Whether any of the audio failed to be encoded, in which case a temporary output file does not replace the source file.
+  bool m_Failed = false;
   std::map<std::string /*name*/, std::string /*value*/> m_Tags;
+  std::unique_ptr<OpusPassthrough> m_Passthrough;
+
+  // Measures the audio as it is written, so that a track gain can be added once the file is complete.
+  std::unique_ptr<LoudnessMeter> m_Loudness;
 };
@@ -4,10 +4,60 @@
 #include "utils.h"
 #include "resource.h"
 #include "CommCtrl.h"
+#include "windowsx.h"
 
 #include <algorithm>
+#include <iomanip>
+#include <sstream>
+#include <thread>
 
 constexpr char kBitrateSetting[] = "opusBitrate";
+constexpr char kLoudnessTagsSetting[] = "opusLoudnessTags";
+constexpr char kPresetSetting[] = "opusPreset";
+constexpr char kSegmentedDecodeSetting[] = "opusSegmentedDecode";
+
+// Benchmark results are stored per preset, in tenths of real time.
+constexpr char kBenchmarkSettingPrefix[] = "opusBenchmark";
+
+// Posted to the options dialog when the benchmark thread has stored its results.
+constexpr UINT WM_BENCHMARKCOMPLETE = WM_APP + 1;
+
+// Runs the benchmark, so that the options dialog remains responsive.
+static std::thread s_BenchmarkThread;
+
+// Waits for any running benchmark to store its results.
+static void WaitForBenchmark()
+{
+  if ( s_BenchmarkThread.joinable() ) {
+    const HCURSOR cursor = SetCursor( LoadCursor( nullptr, IDC_WAIT ) );
+    s_BenchmarkThread.join();
+    SetCursor( cursor );
+  }
+}
+
+static OpusPreset GetPresetSetting()
+{
+  const int32_t preset = ReadSetting( kPresetSetting ).value_or( static_cast<int32_t>( kOpusDefaultPreset ) );
+  return EncoderOpus::GetPresetOptions().contains( preset ) ? static_cast<OpusPreset>( preset ) : kOpusDefaultPreset;
+}
+
+// Shows the stored benchmark results for each preset.
+static void UpdateBenchmarkText( HWND hwnd )
+{
+  std::wstring text;
+  for ( const auto& [ value, description ] : EncoderOpus::GetPresetOptions() ) {
+    if ( const auto speed = ReadSetting( kBenchmarkSettingPrefix + std::to_string( value ) ); speed && ( *speed > 0 ) ) {
+      std::wostringstream stream;
+      stream << std::fixed << std::setprecision( 1 ) << ( *speed / 10.0 );
+      text += ( text.empty() ? L"" : L", " ) + description + L" " + stream.str() + L"x";
+    }
+  }
+  if ( text.empty() )
+    text = L"Encoding speed not measured";
+  else
+    text = L"Speed (x real time): " + text;
+  SetDlgItemText( hwnd, IDC_PRESETSPEED, text.c_str() );
+}
 
 static const std::map<std::string /*type*/, std::string /*tag*/> kTypeToTag = {
 	{ "IART", "ARTIST" },
@@ -45,15 +95,37 @@ static const std::map<std::string /*tag*/, std::string /*type*/> kTagToType = {
 
 struct TagData
 {
-  using Tag = std::tuple<std::string /*listType*/, std::string /*type*/, std::string /*value*/>;
+  using Tag = std::tuple<std::string /*listType*/, std::string /*type*/, std::vector<char> /*data*/, uint32_t /*count*/>;
 
   TagData( DecoderOpus* decoder )
   {
     for ( const auto& it : kTagToType ) {
       const auto& [ name, type ] = it;
       if ( const auto tag = decoder->GetTagValue( name ); tag.has_value() && !tag->empty() ) {
-        m_Tags.push_back( std::make_tuple( "INFO", type, *tag ) );
+        std::vector<char> data( tag->begin(), tag->end() );
+        data.push_back( 0 );
+        m_Tags.push_back( std::make_tuple( "INFO", type, std::move( data ), 1 ) );
+      }
+    }
+
+    // Mark the start of each link in a chained file with a cue point.
+    if ( const auto& linkSamples = decoder->GetLinkSamples(); linkSamples.size() > 1 ) {
+      std::vector<char> cues;
+      std::vector<char> labels;
+      uint64_t position = 0;
+      for ( uint32_t link = 0; link < linkSamples.size(); link++ ) {
+        const uint32_t name = 1 + link;
+        const uint32_t offset = static_cast<uint32_t>( position );
+        AppendBytes( cues, &name, sizeof( name ) );
+        AppendBytes( cues, &offset, sizeof( offset ) );
+        const std::string label = "Link " + std::to_string( name );
+        AppendBytes( labels, &name, sizeof( name ) );
+        AppendBytes( labels, label.c_str(), 1 + label.size() );
+        position += linkSamples[ link ];
       }
+      const uint32_t count = static_cast<uint32_t>( linkSamples.size() );
+      m_Tags.push_back( std::make_tuple( "WAVE", "CUE ", std::move( cues ), count ) );
+      m_Tags.push_back( std::make_tuple( "adtl", "LABL", std::move( labels ), count ) );
     }
   }
 
@@ -65,6 +137,11 @@ struct TagData
   }
 
 private:
+  static void AppendBytes( std::vector<char>& data, const void* bytes, const size_t size )
+  {
+    data.insert( data.end(), static_cast<const char*>( bytes ), static_cast<const char*>( bytes ) + size );
+  }
+
   std::vector<Tag> m_Tags;
   uint32_t m_CurrentData = 0;
 };
@@ -110,7 +187,8 @@ BOOL __stdcall FilterUnderstandsFormat( LPSTR filename )
 HANDLE __stdcall OpenFilterInput( LPSTR filename, LONG* sampleRate, WORD* bitsPerSample, WORD* channels, HWND, LONG* chunkSize )
 {
   try {
-    auto decoder = std::make_unique<DecoderOpus>( AnsiCodePageToUTF8( filename ) );
+    const DecoderOpus::Mode mode = ( 0 != ReadSetting( kSegmentedDecodeSetting ).value_or( 0 ) ) ? DecoderOpus::Mode::Segmented : DecoderOpus::Mode::Sequential;
+    auto decoder = std::make_unique<DecoderOpus>( AnsiCodePageToUTF8( filename ), mode );
     if ( nullptr != sampleRate )
       *sampleRate = static_cast<LONG>( decoder->GetSampleRate() );
     if ( nullptr != bitsPerSample )
@@ -169,7 +247,8 @@ HANDLE __stdcall OpenFilterOutput( LPSTR filename, LONG sampleRate, WORD bitsPer
   }
   utf8Filename += ".opus";
   const uint32_t bitrate = static_cast<uint32_t>( std::clamp( ReadSetting( kBitrateSetting ).value_or( kOpusDefaultBitrate ), static_cast<int32_t>( kOpusMinimumBitrate ), static_cast<int32_t>( kOpusMaximumBitrate ) ) );
-  EncoderOpus* encoder = new EncoderOpus( utf8Filename, static_cast<uint32_t>( sampleRate ), static_cast<uint32_t>( bitsPerSample ), static_cast<uint32_t>( channels ), static_cast<uint32_t>( size / channels / ( bitsPerSample / 8 ) ), bitrate );
+  const bool loudnessTags = ( 0 != ReadSetting( kLoudnessTagsSetting ).value_or( 0 ) );
+  EncoderOpus* encoder = new EncoderOpus( utf8Filename, static_cast<uint32_t>( sampleRate ), static_cast<uint32_t>( bitsPerSample ), static_cast<uint32_t>( channels ), static_cast<uint32_t>( size / channels / ( bitsPerSample / 8 ) ), bitrate, GetPresetSetting(), loudnessTags );
   *chunkSize = static_cast<LONG>( kOpusChunkSize );
   return encoder;
 }
@@ -196,11 +275,45 @@ INT_PTR CALLBACK DialogProc( HWND hwnd, UINT message, WPARAM wParam, LPARAM lPar
       const int32_t bitrate = std::clamp( ReadSetting( kBitrateSetting ).value_or( kOpusDefaultBitrate ), static_cast<int32_t>( kOpusMinimumBitrate ), static_cast<int32_t>( kOpusMaximumBitrate ) );
       const auto str = std::to_wstring( bitrate );
       SetDlgItemText( hwnd, IDC_BITRATE, str.c_str() );
+      Button_SetCheck( GetDlgItem( hwnd, IDC_LOUDNESSTAGS ), ReadSetting( kLoudnessTagsSetting ).value_or( 0 ) );
+      Button_SetCheck( GetDlgItem( hwnd, IDC_SEGMENTEDDECODE ), ReadSetting( kSegmentedDecodeSetting ).value_or( 0 ) );
+
+      const int32_t preset = static_cast<int32_t>( GetPresetSetting() );
+      for ( const auto& [ value, description ] : EncoderOpus::GetPresetOptions() ) {
+        ComboBox_AddString( GetDlgItem( hwnd, IDC_PRESET ), description.c_str() );
+        ComboBox_SetItemData( GetDlgItem( hwnd, IDC_PRESET ), ComboBox_GetCount( GetDlgItem( hwnd, IDC_PRESET ) ) - 1, value );
+        if ( value == preset )
+          ComboBox_SetCurSel( GetDlgItem( hwnd, IDC_PRESET ), ComboBox_GetCount( GetDlgItem( hwnd, IDC_PRESET ) ) - 1 );
+      }
+      UpdateBenchmarkText( hwnd );
       return TRUE;
 		}
     case WM_COMMAND : {
 			switch ( LOWORD( wParam ) ) { 
+        case IDC_BENCHMARK : {
+          // Measure each preset at the bitrate currently entered.
+          uint32_t bitrate = kOpusDefaultBitrate;
+          try {
+            std::vector<wchar_t> buffer( 16 );
+            if ( GetDlgItemText( hwnd, IDC_BITRATE, buffer.data(), buffer.size() ) )
+              bitrate = std::clamp( static_cast<uint32_t>( std::stoul( buffer.data() ) ), kOpusMinimumBitrate, kOpusMaximumBitrate );
+          } catch ( const std::logic_error& ) { }
+
+          WaitForBenchmark();
+          Button_Enable( GetDlgItem( hwnd, IDC_BENCHMARK ), FALSE );
+          SetDlgItemText( hwnd, IDC_PRESETSPEED, L"Measuring encoding speed..." );
+          s_BenchmarkThread = std::thread( [ hwnd, bitrate ] () {
+            for ( const auto& [ value, description ] : EncoderOpus::GetPresetOptions() ) {
+              const double speed = EncoderOpus::Benchmark( static_cast<OpusPreset>( value ), bitrate );
+              WriteSetting( kBenchmarkSettingPrefix + std::to_string( value ), static_cast<int32_t>( std::min( speed * 10, 1e9 ) ) );
+            }
+            PostMessage( hwnd, WM_BENCHMARKCOMPLETE, 0, 0 );
+          } );
+          return TRUE;
+        }
 				case IDOK : {
+          // The settings file is rewritten as a whole, so the benchmark must not be writing to it at the same time.
+          WaitForBenchmark();
           uint32_t result = 0;
           try {
             std::vector<wchar_t> buffer( 16 );
@@ -208,6 +321,9 @@ INT_PTR CALLBACK DialogProc( HWND hwnd, UINT message, WPARAM wParam, LPARAM lPar
               result = std::clamp( static_cast<uint32_t>( std::stoul( buffer.data() ) ), kOpusMinimumBitrate, kOpusMaximumBitrate );
             WriteSetting( kBitrateSetting, result );
           } catch ( const std::logic_error& ) { }
+          WriteSetting( kLoudnessTagsSetting, Button_GetCheck( GetDlgItem( hwnd, IDC_LOUDNESSTAGS ) ) );
+          WriteSetting( kSegmentedDecodeSetting, Button_GetCheck( GetDlgItem( hwnd, IDC_SEGMENTEDDECODE ) ) );
+          WriteSetting( kPresetSetting, static_cast<int32_t>( ComboBox_GetItemData( GetDlgItem( hwnd, IDC_PRESET ), ComboBox_GetCurSel( GetDlgItem( hwnd, IDC_PRESET ) ) ) ) );
           EndDialog( hwnd, 1 );
           return TRUE;
         }
@@ -217,6 +333,17 @@ INT_PTR CALLBACK DialogProc( HWND hwnd, UINT message, WPARAM wParam, LPARAM lPar
 			}
 			break;
 		}
+    case WM_BENCHMARKCOMPLETE : {
+      WaitForBenchmark();
+      Button_Enable( GetDlgItem( hwnd, IDC_BENCHMARK ), TRUE );
+      UpdateBenchmarkText( hwnd );
+      return TRUE;
+    }
+    case WM_DESTROY : {
+      // Any benchmark still running must finish before the dialog (and the plug-in) can go away.
+      WaitForBenchmark();
+      return FALSE;
+    }
 	}
 	return FALSE;
 }
@@ -267,19 +394,19 @@ DWORD GetNextTag( SPECIALDATA* specialData, TagData* tagData )
   if ( !tag )
     return 0;
 
-  const auto& [ listType, type, value ] = *tag;
+  const auto& [ listType, type, data, count ] = *tag;
 
   // Following the Flt2KApi example, allocate some space on the heap for the tag data (it is not our responsibility to free this handle).
-  specialData->hData = GlobalAlloc( GMEM_MOVEABLE | GMEM_ZEROINIT, 2 + value.size() );
+  specialData->hData = GlobalAlloc( GMEM_MOVEABLE | GMEM_ZEROINIT, 1 + data.size() );
   if ( nullptr == specialData->hData )
     return 0;
 
   if ( char* str = static_cast<char*>( GlobalLock( specialData->hData ) ); nullptr != str ) {
-    strcpy_s( str, 1 + value.size(), value.c_str() );
+    std::copy( data.begin(), data.end(), str );
     GlobalUnlock( str );
   }
-  specialData->dwExtra = 1;
-  specialData->dwSize = 1 + value.size();
+  specialData->dwExtra = count;
+  specialData->dwSize = static_cast<DWORD>( data.size() );
   strcpy_s( specialData->szListType, 8, listType.c_str() );
   strcpy_s( specialData->szType, 8, type.c_str() );
 
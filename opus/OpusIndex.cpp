@@ -0,0 +1,144 @@
+#include "OpusIndex.h"
+
+#include <algorithm>
+#include <fstream>
+
+// Cache file identifier & version.
+constexpr uint32_t kIndexMagic = 0x5849504f; // 'OPIX'
+constexpr uint32_t kIndexVersion = 1;
+
+// Minimum granule spacing between indexed pages (one second at 48kHz), to keep the index compact.
+constexpr int64_t kIndexSpacing = 48000;
+
+constexpr char kIndexExtension[] = ".opusidx";
+
+// Maximum total size of the Opus indexes in the cache folder (64Mb).
+constexpr uint64_t kMaximumIndexCacheSize = 64ull << 20;
+
+template<typename T>
+static void WriteValue( std::ofstream& stream, const T& value )
+{
+  stream.write( reinterpret_cast<const char*>( &value ), sizeof( T ) );
+}
+
+template<typename T>
+static T ReadValue( std::ifstream& stream )
+{
+  T value = {};
+  stream.read( reinterpret_cast<char*>( &value ), sizeof( T ) );
+  return value;
+}
+
+std::optional<OpusIndex> OpusIndex::Load( const std::string& filename )
+{
+  const std::filesystem::path source( UTF8ToWideString( filename ) );
+  const auto identity = GetFileIdentity( source );
+  const auto cacheFilename = GetCacheFilename( source, kIndexExtension );
+  if ( !identity || cacheFilename.empty() )
+    return std::nullopt;
+
+  std::ifstream stream( cacheFilename, std::ios::binary );
+  if ( !stream.is_open() || ( kIndexMagic != ReadValue<uint32_t>( stream ) ) || ( kIndexVersion != ReadValue<uint32_t>( stream ) ) )
+    return std::nullopt;
+
+  const uint32_t filenameLength = ReadValue<uint32_t>( stream );
+  if ( filenameLength != filename.size() )
+    return std::nullopt;
+  std::string indexedFilename( filenameLength, 0 );
+  stream.read( indexedFilename.data(), indexedFilename.size() );
+  FileIdentity indexedIdentity;
+  indexedIdentity.Size = ReadValue<uint64_t>( stream );
+  indexedIdentity.LastWriteTime = ReadValue<int64_t>( stream );
+  if ( !stream.good() || ( indexedFilename != filename ) || ( indexedIdentity != *identity ) )
+    return std::nullopt;
+
+  constexpr uint32_t kMaximumLinks = 65536;
+  const uint32_t linkCount = ReadValue<uint32_t>( stream );
+  if ( ( 0 == linkCount ) || ( linkCount > kMaximumLinks ) )
+    return std::nullopt;
+  std::vector<Link> links( linkCount );
+  for ( auto& link : links ) {
+    link.Serial = ReadValue<uint32_t>( stream );
+    link.Offset = ReadValue<uint64_t>( stream );
+    link.Size = ReadValue<uint64_t>( stream );
+    link.TotalSamples = ReadValue<uint64_t>( stream );
+    link.PreSkip = ReadValue<uint32_t>( stream );
+    link.Channels = ReadValue<uint32_t>( stream );
+    const uint32_t pageCount = ReadValue<uint32_t>( stream );
+    if ( !stream.good() || ( pageCount > identity->Size ) )
+      return std::nullopt;
+    link.Pages.resize( pageCount );
+    stream.read( reinterpret_cast<char*>( link.Pages.data() ), link.Pages.size() * sizeof( link.Pages.front() ) );
+  }
+  if ( !stream.good() )
+    return std::nullopt;
+
+  TouchCacheFile( cacheFilename );
+  return OpusIndex( filename, *identity, std::move( links ) );
+}
+
+OpusIndex::OpusIndex( const std::string& filename, const FileIdentity& identity, std::vector<Link> links ) :
+  m_Filename( filename ),
+  m_Identity( identity ),
+  m_Links( std::move( links ) )
+{
+}
+
+bool OpusIndex::Save() const
+{
+  const auto cacheFilename = GetCacheFilename( UTF8ToWideString( m_Filename ), kIndexExtension );
+  if ( cacheFilename.empty() )
+    return false;
+
+  std::ofstream stream( cacheFilename, std::ios::binary | std::ios::trunc );
+  WriteValue( stream, kIndexMagic );
+  WriteValue( stream, kIndexVersion );
+  WriteValue( stream, static_cast<uint32_t>( m_Filename.size() ) );
+  stream.write( m_Filename.data(), m_Filename.size() );
+  WriteValue( stream, m_Identity.Size );
+  WriteValue( stream, m_Identity.LastWriteTime );
+  WriteValue( stream, static_cast<uint32_t>( m_Links.size() ) );
+  for ( const auto& link : m_Links ) {
+    WriteValue( stream, link.Serial );
+    WriteValue( stream, link.Offset );
+    WriteValue( stream, link.Size );
+    WriteValue( stream, link.TotalSamples );
+    WriteValue( stream, link.PreSkip );
+    WriteValue( stream, link.Channels );
+    WriteValue( stream, static_cast<uint32_t>( link.Pages.size() ) );
+    stream.write( reinterpret_cast<const char*>( link.Pages.data() ), link.Pages.size() * sizeof( link.Pages.front() ) );
+  }
+  stream.close();
+  if ( stream.fail() )
+    return false;
+  RemoveOldCacheFiles( cacheFilename, kIndexExtension, kMaximumIndexCacheSize );
+  return true;
+}
+
+uint64_t OpusIndex::GetTotalSamples() const
+{
+  uint64_t totalSamples = 0;
+  for ( const auto& link : m_Links )
+    totalSamples += link.TotalSamples;
+  return totalSamples;
+}
+
+void OpusIndex::AddPage( const uint64_t offset, const int64_t granule )
+{
+  const auto link = std::find_if( m_Links.begin(), m_Links.end(), [ offset ] ( const Link& link ) { return ( offset >= link.Offset ) && ( offset < link.Offset + link.Size ); } );
+  if ( ( m_Links.end() != link ) && ( link->Pages.empty() || ( granule >= link->Pages.back().first + kIndexSpacing ) ) )
+    link->Pages.push_back( { granule, offset } );
+}
+
+std::optional<std::pair<int64_t, uint64_t>> OpusIndex::FindPage( const uint32_t link, const int64_t granule ) const
+{
+  if ( link >= m_Links.size() )
+    return std::nullopt;
+
+  // Fall back to the start of the link if there is no indexed page at or before the granule position.
+  const auto& pages = m_Links[ link ].Pages;
+  const auto page = std::upper_bound( pages.begin(), pages.end(), granule, [] ( const int64_t granule, const auto& page ) { return granule < page.first; } );
+  if ( pages.begin() == page )
+    return std::make_pair( int64_t( 0 ), m_Links[ link ].Offset );
+  return *std::prev( page );
+}
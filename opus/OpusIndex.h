@@ -0,0 +1,49 @@
+#pragma once
+
+#include "utils.h"
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Maps page granule positions to byte offsets for each link of an Ogg Opus file.
+// The index is built while a file is decoded and cached in the shared cache folder, so that later opens do not need to bisect the file.
+class OpusIndex
+{
+public:
+  struct Link
+  {
+    uint32_t Serial = 0;
+    uint64_t Offset = 0;
+    uint64_t Size = 0;
+    uint64_t TotalSamples = 0;
+    uint32_t PreSkip = 0;
+    uint32_t Channels = 0;
+
+    // Granule positions, each paired with the offset of the page from which decoding yields samples starting at that granule position.
+    std::vector<std::pair<int64_t /*granule*/, uint64_t /*offset*/>> Pages;
+  };
+
+  // Returns the cached index for a file, or nullopt if there is no index (or it is out of date).
+  static std::optional<OpusIndex> Load( const std::string& filename );
+
+  OpusIndex( const std::string& filename, const FileIdentity& identity, std::vector<Link> links );
+
+  bool Save() const;
+
+  const std::vector<Link>& GetLinks() const { return m_Links; }
+  const FileIdentity& GetIdentity() const { return m_Identity; }
+  uint64_t GetTotalSamples() const;
+
+  // Adds a page, at the given byte offset, which starts decoding at the granule position.
+  void AddPage( const uint64_t offset, const int64_t granule );
+
+  // Returns the offset of the page from which decoding can start to reach the granule position in the given link, or nullopt if the link is not indexed.
+  std::optional<std::pair<int64_t /*granule*/, uint64_t /*offset*/>> FindPage( const uint32_t link, const int64_t granule ) const;
+
+private:
+  std::string m_Filename;
+  FileIdentity m_Identity;
+  std::vector<Link> m_Links;
+};
@@ -0,0 +1,917 @@
+#include "OpusPassthrough.h"
+#include "DecoderOpus.h"
+
+#include "ogg/ogg.h"
+#include "opus.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <fstream>
+
+// Maximum number of incoming frames to accept before giving up, if none of them match the reference (30 seconds).
+constexpr uint64_t kMaximumLeadingFrames = 30 * 48000;
+
+// Number of frames which have left the alignment window before they are moved to the spill file.
+constexpr uint64_t kSpillBatchFrames = 4096;
+
+// Number of frames compared with the decoded audio at a time.
+constexpr uint32_t kCompareFrames = 4096;
+
+// Number of samples decoded ahead of the span start, for the decoder to converge (as recommended by RFC 7845).
+constexpr int64_t kPreRoll = 3840;
+
+// Number of samples decoded ahead of a position for the decoder output to match a continuous decode of the file to within the tolerance (500ms).
+// Well beyond the pre-roll, which only leaves the decoder close enough to hide the transition.
+constexpr int64_t kDecoderPreRoll = 24000;
+
+// Maximum Opus packet duration (120ms).
+constexpr int kMaximumPacketFrames = 5760;
+
+// Maximum Opus packet size (RFC 6716).
+constexpr opus_int32 kMaximumPacketBytes = 1275 * 3 + 7;
+
+// All Opus frame durations are multiples of 2.5ms, so packet boundaries always fall on this grid.
+constexpr int64_t kPacketGranularity = 120;
+
+// Maximum difference between an incoming sample and the decoded audio for a partial chunk (roughly -60dB).
+constexpr float kTolerance = 32.f;
+
+// Reads the header and audio packets of a single link Ogg Opus file.
+class PacketReader
+{
+public:
+  struct Packet
+  {
+    std::vector<uint8_t> Data;
+    int64_t Granule = 0;
+    int64_t Duration = 0;
+  };
+
+  PacketReader( const std::string& filename ) :
+    m_File( std::filesystem::path( UTF8ToWideString( filename ) ), std::ios::binary ),
+    m_Index( OpusIndex::Load( filename ) )
+  {
+    ogg_sync_init( &m_Sync );
+  }
+
+  ~PacketReader()
+  {
+    ogg_sync_clear( &m_Sync );
+    if ( m_Serial )
+      ogg_stream_clear( &m_Stream );
+  }
+
+  // Reads the identification and comment headers, and determines the starting granule position of the audio.
+  bool ReadHeaders()
+  {
+    ogg_packet packet = {};
+    if ( !ReadHeader( packet ) || ( packet.bytes < 19 ) || ( 0 != std::memcmp( packet.packet, "OpusHead", 8 ) ) )
+      return false;
+    m_Head.assign( packet.packet, packet.packet + packet.bytes );
+    if ( !ReadHeader( packet ) || ( packet.bytes < 16 ) || ( 0 != std::memcmp( packet.packet, "OpusTags", 8 ) ) )
+      return false;
+    const uint32_t vendorLength = packet.packet[ 8 ] | ( packet.packet[ 9 ] << 8 ) | ( packet.packet[ 10 ] << 16 ) | ( packet.packet[ 11 ] << 24 );
+    if ( vendorLength > static_cast<uint32_t>( packet.bytes - 12 ) )
+      return false;
+    m_Vendor.assign( packet.packet + 12, packet.packet + 12 + vendorLength );
+
+    while ( !m_Granule ) {
+      if ( !ReadPackets() )
+        return false;
+    }
+    m_StartGranule = m_Queue.empty() ? *m_Granule : m_Queue.front().Granule;
+    return true;
+  }
+
+  const std::vector<uint8_t>& GetHead() const { return m_Head; }
+  const std::string& GetVendor() const { return m_Vendor; }
+  int GetSerial() const { return m_Serial.value_or( 0 ); }
+  uint32_t GetChannels() const { return m_Head[ 9 ]; }
+  int64_t GetPreSkip() const { return m_Head[ 10 ] | ( m_Head[ 11 ] << 8 ); }
+  int GetOutputGain() const { return static_cast<int16_t>( m_Head[ 16 ] | ( m_Head[ 17 ] << 8 ) ); }
+  uint32_t GetMappingFamily() const { return m_Head[ 18 ]; }
+  int64_t GetStartGranule() const { return m_StartGranule; }
+
+  // Reads the next audio packet.
+  bool Read( Packet& packet )
+  {
+    while ( m_Queue.empty() ) {
+      if ( !ReadPackets() )
+        return false;
+    }
+    packet = std::move( m_Queue.front() );
+    m_Queue.pop_front();
+    return true;
+  }
+
+  // Reads up to the audio packet containing the granule position, using the index (if there is one) to skip directly to a nearby page.
+  bool Find( const int64_t granule, Packet& packet )
+  {
+    if ( m_Index && ( 1 == m_Index->GetLinks().size() ) && m_Granule ) {
+      if ( const auto page = m_Index->FindPage( 0, granule ); page && ( page->first > *m_Granule ) ) {
+        m_File.clear();
+        m_File.seekg( page->second );
+        ogg_sync_reset( &m_Sync );
+        ogg_stream_reset( &m_Stream );
+        m_Queue.clear();
+        m_Granule = page->first;
+      }
+    }
+    while ( Read( packet ) ) {
+      if ( packet.Granule + packet.Duration > granule )
+        return true;
+    }
+    return false;
+  }
+
+private:
+  // Reads the next page belonging to the stream into the stream state.
+  bool ReadPage()
+  {
+    constexpr long kReadSize = 65536;
+    ogg_page page = {};
+    while ( true ) {
+      const int result = ogg_sync_pageout( &m_Sync, &page );
+      if ( result > 0 ) {
+        if ( !m_Serial ) {
+          m_Serial = ogg_page_serialno( &page );
+          ogg_stream_init( &m_Stream, *m_Serial );
+        }
+        if ( *m_Serial == ogg_page_serialno( &page ) ) {
+          m_PageGranule = ogg_page_granulepos( &page );
+          return 0 == ogg_stream_pagein( &m_Stream, &page );
+        }
+      } else if ( 0 == result ) {
+        char* buffer = ogg_sync_buffer( &m_Sync, kReadSize );
+        if ( nullptr == buffer )
+          return false;
+        m_File.read( buffer, kReadSize );
+        const long bytesRead = static_cast<long>( m_File.gcount() );
+        if ( bytesRead <= 0 )
+          return false;
+        ogg_sync_wrote( &m_Sync, bytesRead );
+      }
+    }
+  }
+
+  bool ReadHeader( ogg_packet& packet )
+  {
+    int result = 0;
+    while ( !m_Serial || ( 0 == ( result = ogg_stream_packetout( &m_Stream, &packet ) ) ) ) {
+      if ( !ReadPage() )
+        return false;
+    }
+    return result > 0;
+  }
+
+  // Reads the audio packets completed on the next page into the queue.
+  bool ReadPackets()
+  {
+    if ( !ReadPage() )
+      return false;
+    ogg_packet packet = {};
+    int result = 0;
+    while ( 0 != ( result = ogg_stream_packetout( &m_Stream, &packet ) ) ) {
+      const int duration = ( result > 0 ) ? opus_packet_get_nb_samples( packet.packet, packet.bytes, 48000 ) : 0;
+      if ( duration <= 0 )
+        return false;
+      Packet& queued = m_Queue.emplace_back();
+      queued.Data.assign( packet.packet, packet.packet + packet.bytes );
+      queued.Duration = duration;
+      if ( m_Granule ) {
+        queued.Granule = *m_Granule;
+        *m_Granule += duration;
+      }
+    }
+
+    // The granule position of the first page with a completed packet determines the starting granule position of the audio.
+    if ( !m_Granule && ( m_PageGranule >= 0 ) ) {
+      int64_t granule = m_PageGranule;
+      for ( const auto& queued : m_Queue )
+        granule -= queued.Duration;
+      m_Granule = granule;
+      for ( auto& queued : m_Queue ) {
+        queued.Granule = *m_Granule;
+        *m_Granule += queued.Duration;
+      }
+    }
+    return true;
+  }
+
+  std::ifstream m_File;
+  const std::optional<OpusIndex> m_Index;
+  ogg_sync_state m_Sync = {};
+  ogg_stream_state m_Stream = {};
+  std::optional<int> m_Serial;
+  int64_t m_PageGranule = -1;
+
+  std::vector<uint8_t> m_Head;
+  std::string m_Vendor;
+  int64_t m_StartGranule = 0;
+
+  // Granule position at the end of the queued packets, once known.
+  std::optional<int64_t> m_Granule;
+  std::deque<Packet> m_Queue;
+};
+
+// Writes the packets of a single link Ogg Opus file.
+class PacketWriter
+{
+public:
+  PacketWriter( const std::string& filename, const int serial ) :
+    m_File( std::filesystem::path( UTF8ToWideString( filename ) ), std::ios::binary | std::ios::trunc )
+  {
+    ogg_stream_init( &m_Stream, serial );
+  }
+
+  ~PacketWriter()
+  {
+    ogg_stream_clear( &m_Stream );
+  }
+
+  bool IsOpen() const { return m_File.is_open(); }
+  bool IsGood() const { return m_File.good(); }
+
+  // Writes a header packet, which is placed on a page of its own.
+  void WriteHeader( const std::vector<uint8_t>& data )
+  {
+    Write( data.data(), data.size(), 0, false );
+    WritePages( true );
+  }
+
+  // Writes an audio packet, with the granule position at the end of the packet (the last packet ends the stream).
+  void Write( const uint8_t* data, const size_t bytes, const int64_t granule, const bool last )
+  {
+    ogg_packet packet = {};
+    packet.packet = const_cast<uint8_t*>( data );
+    packet.bytes = static_cast<long>( bytes );
+    packet.b_o_s = ( 0 == m_PacketNo ) ? 1 : 0;
+    packet.e_o_s = last ? 1 : 0;
+    packet.granulepos = granule;
+    packet.packetno = m_PacketNo++;
+    ogg_stream_packetin( &m_Stream, &packet );
+    WritePages( last );
+  }
+
+private:
+  void WritePages( const bool flush )
+  {
+    ogg_page page = {};
+    while ( 0 != ( flush ? ogg_stream_flush( &m_Stream, &page ) : ogg_stream_pageout( &m_Stream, &page ) ) ) {
+      m_File.write( reinterpret_cast<const char*>( page.header ), page.header_len );
+      m_File.write( reinterpret_cast<const char*>( page.body ), page.body_len );
+    }
+  }
+
+  std::ofstream m_File;
+  ogg_stream_state m_Stream = {};
+  ogg_int64_t m_PacketNo = 0;
+};
+
+// Decodes the audio of the reference file from any position, applying the header gain and scaling as for the audio delivered to Cool Edit.
+class SourceDecoder
+{
+public:
+  SourceDecoder( const std::string& filename, const uint32_t channels ) :
+    m_Filename( filename ),
+    m_Channels( channels ),
+    m_PCM( kMaximumPacketFrames * channels )
+  {
+  }
+
+  ~SourceDecoder()
+  {
+    if ( nullptr != m_Decoder )
+      opus_decoder_destroy( m_Decoder );
+  }
+
+  // Decodes frames from the reference position, which is quickest when reading on from the previous position.
+  bool Read( const int64_t position, const uint32_t frames, float* output )
+  {
+    for ( uint32_t i = 0; i < frames; ) {
+      const int64_t current = position + i;
+      const int64_t decodedEnd = m_DecodedStart + m_DecodedFrames;
+      if ( !m_Reader || ( current < m_DecodedStart ) || ( current > decodedEnd + kDecoderPreRoll + kMaximumPacketFrames ) ) {
+        if ( !Start( current ) )
+          return false;
+      } else if ( current >= decodedEnd ) {
+        PacketReader::Packet packet;
+        if ( !m_Reader->Read( packet ) || !Decode( packet ) )
+          return false;
+      } else {
+        const uint32_t count = static_cast<uint32_t>( std::min<int64_t>( frames - i, decodedEnd - current ) );
+        std::copy_n( m_PCM.data() + ( current - m_DecodedStart ) * m_Channels, count * m_Channels, output + static_cast<size_t>( i ) * m_Channels );
+        i += count;
+      }
+    }
+    return true;
+  }
+
+private:
+  // Starts decoding from a packet far enough ahead of the position for the decoder output to match a continuous decode.
+  bool Start( const int64_t position )
+  {
+    m_Reader = std::make_unique<PacketReader>( m_Filename );
+    m_DecodedStart = m_DecodedFrames = 0;
+    if ( !m_Reader->ReadHeaders() || ( 0 != m_Reader->GetMappingFamily() ) || ( m_Reader->GetChannels() != m_Channels ) ) {
+      m_Reader.reset();
+      return false;
+    }
+    m_Origin = m_Reader->GetStartGranule() + m_Reader->GetPreSkip();
+    m_Gain = 32768.f * static_cast<float>( std::pow( 10.0, m_Reader->GetOutputGain() / ( 20.0 * 256 ) ) );
+
+    int error = 0;
+    if ( nullptr == m_Decoder )
+      m_Decoder = opus_decoder_create( 48000, static_cast<int>( m_Channels ), &error );
+    else
+      opus_decoder_ctl( m_Decoder, OPUS_RESET_STATE );
+    PacketReader::Packet packet;
+    if ( ( nullptr == m_Decoder ) || !m_Reader->Find( std::max( m_Reader->GetStartGranule(), m_Origin + position - kDecoderPreRoll ), packet ) || !Decode( packet ) ) {
+      m_Reader.reset();
+      return false;
+    }
+    return true;
+  }
+
+  bool Decode( const PacketReader::Packet& packet )
+  {
+    const int decoded = opus_decode_float( m_Decoder, packet.Data.data(), static_cast<opus_int32>( packet.Data.size() ), m_PCM.data(), kMaximumPacketFrames, 0 );
+    if ( decoded < 0 ) {
+      m_Reader.reset();
+      return false;
+    }
+    for ( size_t i = 0; i < static_cast<size_t>( decoded ) * m_Channels; i++ )
+      m_PCM[ i ] *= m_Gain;
+    m_DecodedStart = packet.Granule - m_Origin;
+    m_DecodedFrames = decoded;
+    return true;
+  }
+
+  const std::string m_Filename;
+  const uint32_t m_Channels;
+  std::unique_ptr<PacketReader> m_Reader;
+  OpusDecoder* m_Decoder = nullptr;
+  int64_t m_Origin = 0;
+  float m_Gain = 1.f;
+
+  // The audio decoded from the latest packet.
+  std::vector<float> m_PCM;
+  int64_t m_DecodedStart = 0;
+  int64_t m_DecodedFrames = 0;
+};
+
+// Converts samples written by Cool Edit to floating point.
+static void ToFloat( const uint8_t* data, const size_t samples, const uint32_t bitsPerSample, float* output )
+{
+  if ( 16 == bitsPerSample ) {
+    for ( size_t i = 0; i < samples; i++ ) {
+      int16_t value = 0;
+      std::memcpy( &value, data + i * sizeof( value ), sizeof( value ) );
+      output[ i ] = value;
+    }
+  } else {
+    std::memcpy( output, data, samples * sizeof( float ) );
+  }
+}
+
+OpusPassthrough::OpusPassthrough( std::shared_ptr<const OpusReference> reference, Configure configure, const int frameSize ) :
+  m_Reference( reference ),
+  m_Configure( std::move( configure ) ),
+  m_EncoderFrameSize( frameSize ),
+  m_FrameSize( reference->GetFrameSize() )
+{
+  for ( uint32_t i = 0; i < OpusReference::kAlignmentFrames; i++ )
+    m_RollingPower *= FrameHash::kBase;
+  for ( const auto& chunk : m_Reference->GetChunks() )
+    m_MaximumChunkFrames = std::max<uint64_t>( m_MaximumChunkFrames, chunk.Frames );
+}
+
+OpusPassthrough::~OpusPassthrough()
+{
+  if ( m_Spill.is_open() ) {
+    m_Spill.close();
+    std::error_code ec;
+    std::filesystem::remove( m_SpillFilename, ec );
+  }
+}
+
+uint32_t OpusPassthrough::Write( const uint8_t* data, const uint32_t frames )
+{
+  for ( uint32_t i = 0; i < frames; i++, data += m_FrameSize ) {
+    if ( !Consume( data ) ) {
+      m_State = State::Failed;
+      return 1 + i;
+    }
+  }
+  return frames;
+}
+
+bool OpusPassthrough::Consume( const uint8_t* frame )
+{
+  return ( State::Tracking == m_State ) ? Track( frame ) : Align( frame );
+}
+
+bool OpusPassthrough::Align( const uint8_t* frame )
+{
+  m_Window.insert( m_Window.end(), frame, frame + m_FrameSize );
+  const uint64_t frames = m_Window.size() / m_FrameSize;
+  m_RollingHash = FrameHash::Append( m_RollingHash, FrameHash::Value( frame, m_FrameSize ) );
+  if ( frames > OpusReference::kAlignmentFrames )
+    m_RollingHash -= FrameHash::Value( m_Window.data() + ( frames - 1 - OpusReference::kAlignmentFrames ) * m_FrameSize, m_FrameSize ) * m_RollingPower;
+
+  if ( frames >= OpusReference::kAlignmentFrames ) {
+    const uint64_t unmatched = frames - OpusReference::kAlignmentFrames;
+    if ( const auto chunk = m_Reference->FindChunk( m_RollingHash ); chunk ) {
+      // The latest frames match the start of a chunk, so track the reference from here on.
+      if ( !AddUnmatched( m_Window.data(), unmatched ) )
+        return false;
+      m_Pending.assign( m_Window.begin() + unmatched * m_FrameSize, m_Window.end() );
+      m_Chunk = *chunk;
+      m_ChunkHash = m_RollingHash;
+      m_Window.clear();
+      m_RollingHash = 0;
+      m_State = State::Tracking;
+      return CompleteChunk();
+    }
+
+    // Frames which have left the alignment window cannot be matched, so move them to the spill file.
+    if ( unmatched >= kSpillBatchFrames ) {
+      if ( !AddUnmatched( m_Window.data(), unmatched ) )
+        return false;
+      m_Window.erase( m_Window.begin(), m_Window.begin() + unmatched * m_FrameSize );
+    }
+  }
+
+  // Give up if nothing near the start of the audio matches the reference.
+  return m_Matched || ( m_Output + frames < kMaximumLeadingFrames );
+}
+
+bool OpusPassthrough::Track( const uint8_t* frame )
+{
+  // Any audio following the end of the reference needs to be aligned again.
+  if ( m_Chunk >= m_Reference->GetChunks().size() ) {
+    m_State = State::Aligning;
+    return Align( frame );
+  }
+  m_Pending.insert( m_Pending.end(), frame, frame + m_FrameSize );
+  m_ChunkHash = FrameHash::Append( m_ChunkHash, FrameHash::Value( frame, m_FrameSize ) );
+  return CompleteChunk();
+}
+
+bool OpusPassthrough::CompleteChunk()
+{
+  const auto& chunk = m_Reference->GetChunks()[ m_Chunk ];
+  if ( m_Pending.size() / m_FrameSize < chunk.Frames )
+    return true;
+
+  if ( m_ChunkHash == chunk.Hash ) {
+    AddMatched( chunk.Start, chunk.Frames );
+    ++m_Chunk;
+    m_ChunkHash = 0;
+    m_Pending.clear();
+    return true;
+  }
+
+  // The chunk has been modified, so its first frame is unmatched, and the following frames are aligned again.
+  std::vector<uint8_t> frames;
+  frames.swap( m_Pending );
+  m_ChunkHash = 0;
+  m_State = State::Aligning;
+  if ( !AddUnmatched( frames.data(), 1 ) )
+    return false;
+  for ( size_t offset = m_FrameSize; offset < frames.size(); offset += m_FrameSize ) {
+    if ( !Consume( frames.data() + offset ) )
+      return false;
+  }
+  return true;
+}
+
+void OpusPassthrough::AddMatched( const uint64_t position, const uint64_t frames )
+{
+  if ( !m_Spans.empty() && m_Spans.back().Matched && ( m_Spans.back().Position + m_Spans.back().Frames == position ) )
+    m_Spans.back().Frames += frames;
+  else
+    m_Spans.push_back( { m_Output, frames, true, position } );
+  m_Output += frames;
+  m_Matched = true;
+}
+
+bool OpusPassthrough::AddUnmatched( const uint8_t* data, const uint64_t frames )
+{
+  if ( 0 == frames )
+    return true;
+  if ( !m_Spill.is_open() ) {
+    const auto id = std::chrono::steady_clock::now().time_since_epoch().count();
+    std::error_code ec;
+    m_SpillFilename = std::filesystem::temp_directory_path( ec ) / ( "CoolEditOpusPassthrough" + std::to_string( reinterpret_cast<uintptr_t>( this ) ) + "_" + std::to_string( id ) + ".pcm" );
+    m_Spill.open( m_SpillFilename, std::ios::binary | std::ios::in | std::ios::out | std::ios::trunc );
+    if ( !m_Spill.is_open() )
+      return false;
+  }
+  m_Spill.clear();
+  m_Spill.seekp( static_cast<std::streamoff>( m_SpillFrames * m_FrameSize ) );
+  m_Spill.write( reinterpret_cast<const char*>( data ), static_cast<std::streamsize>( frames * m_FrameSize ) );
+  if ( !m_Spill.good() )
+    return false;
+
+  if ( !m_Spans.empty() && !m_Spans.back().Matched )
+    m_Spans.back().Frames += frames;
+  else
+    m_Spans.push_back( { m_Output, frames, false, m_SpillFrames } );
+  m_SpillFrames += frames;
+  m_Output += frames;
+  return true;
+}
+
+bool OpusPassthrough::FlushUnmatched()
+{
+  const bool flushed = AddUnmatched( m_Window.data(), m_Window.size() / m_FrameSize ) && AddUnmatched( m_Pending.data(), m_Pending.size() / m_FrameSize );
+  m_Window.clear();
+  m_Pending.clear();
+  m_RollingHash = 0;
+  m_ChunkHash = 0;
+  if ( State::Tracking == m_State )
+    m_State = State::Aligning;
+  return flushed;
+}
+
+bool OpusPassthrough::ReadSpill( const uint64_t position, const uint64_t frames, uint8_t* data )
+{
+  if ( position + frames > m_SpillFrames )
+    return false;
+  m_Spill.clear();
+  m_Spill.seekg( static_cast<std::streamoff>( position * m_FrameSize ) );
+  m_Spill.read( reinterpret_cast<char*>( data ), static_cast<std::streamsize>( frames * m_FrameSize ) );
+  return m_Spill.good();
+}
+
+uint64_t OpusPassthrough::MatchForward( SourceDecoder& decoder, const Span& span, const uint64_t position )
+{
+  const uint32_t channels = m_Reference->GetChannels();
+  const uint64_t available = ( position < m_Reference->GetTotalFrames() ) ? std::min( span.Frames, m_Reference->GetTotalFrames() - position ) : 0;
+  std::vector<uint8_t> data( kCompareFrames * m_FrameSize );
+  std::vector<float> incoming( kCompareFrames * channels );
+  std::vector<float> decoded( kCompareFrames * channels );
+  uint64_t matched = 0;
+  while ( matched < available ) {
+    const uint32_t count = static_cast<uint32_t>( std::min<uint64_t>( kCompareFrames, available - matched ) );
+    if ( !ReadSpill( span.Position + matched, count, data.data() ) || !decoder.Read( static_cast<int64_t>( position + matched ), count, decoded.data() ) )
+      break;
+    ToFloat( data.data(), count * channels, m_Reference->GetBitsPerSample(), incoming.data() );
+    for ( uint32_t i = 0; i < count * channels; i++ ) {
+      if ( std::fabs( incoming[ i ] - decoded[ i ] ) > kTolerance )
+        return matched + i / channels;
+    }
+    matched += count;
+  }
+  return matched;
+}
+
+uint64_t OpusPassthrough::MatchBackward( SourceDecoder& decoder, const Span& span, const uint64_t position )
+{
+  // Alignment happens at the start of a chunk, so only the preceding (partial) chunk needs to be compared.
+  const uint32_t channels = m_Reference->GetChannels();
+  const uint64_t count = std::min( { span.Frames, position, m_MaximumChunkFrames } );
+  std::vector<uint8_t> data( count * m_FrameSize );
+  std::vector<float> incoming( count * channels );
+  std::vector<float> decoded( count * channels );
+  if ( ( 0 == count ) || !ReadSpill( span.Position + span.Frames - count, count, data.data() ) || !decoder.Read( static_cast<int64_t>( position - count ), static_cast<uint32_t>( count ), decoded.data() ) )
+    return 0;
+  ToFloat( data.data(), count * channels, m_Reference->GetBitsPerSample(), incoming.data() );
+  for ( uint64_t matched = 0; matched < count; matched++ ) {
+    const uint64_t frame = count - 1 - matched;
+    for ( uint32_t channel = 0; channel < channels; channel++ ) {
+      if ( std::fabs( incoming[ frame * channels + channel ] - decoded[ frame * channels + channel ] ) > kTolerance )
+        return matched;
+    }
+  }
+  return count;
+}
+
+void OpusPassthrough::ExtendMatches( SourceDecoder& decoder )
+{
+  for ( size_t i = 0; i < m_Spans.size(); i++ ) {
+    Span& span = m_Spans[ i ];
+    if ( span.Matched )
+      continue;
+    if ( i > 0 ) {
+      Span& previous = m_Spans[ i - 1 ];
+      const uint64_t matched = MatchForward( decoder, span, previous.Position + previous.Frames );
+      previous.Frames += matched;
+      span.Start += matched;
+      span.Position += matched;
+      span.Frames -= matched;
+    }
+    if ( ( i + 1 < m_Spans.size() ) && ( span.Frames > 0 ) ) {
+      Span& next = m_Spans[ i + 1 ];
+      const uint64_t matched = MatchBackward( decoder, span, next.Position );
+      next.Start -= matched;
+      next.Position -= matched;
+      next.Frames += matched;
+      span.Frames -= matched;
+    }
+  }
+
+  // Remove any spans which are now empty, and join matched spans which are now contiguous.
+  std::vector<Span> spans;
+  for ( const Span& span : m_Spans ) {
+    if ( 0 == span.Frames )
+      continue;
+    if ( !spans.empty() && spans.back().Matched && span.Matched && ( spans.back().Position + spans.back().Frames == span.Position ) )
+      spans.back().Frames += span.Frames;
+    else
+      spans.push_back( span );
+  }
+  m_Spans = std::move( spans );
+}
+
+bool OpusPassthrough::Plan( const std::vector<int64_t>& boundaries, const int lookahead, std::vector<Region>& regions, int64_t& preSkip ) const
+{
+  // The nearest packet boundaries at or after (and at or before) a reference position.
+  const auto boundaryAfter = [ &boundaries ] ( const int64_t position ) {
+    const auto boundary = std::lower_bound( boundaries.begin(), boundaries.end(), position );
+    return ( boundaries.end() != boundary ) ? *boundary : boundaries.back();
+  };
+  const auto boundaryBefore = [ &boundaries ] ( const int64_t position ) {
+    const auto boundary = std::upper_bound( boundaries.begin(), boundaries.end(), position );
+    return ( boundaries.begin() != boundary ) ? *( boundary - 1 ) : boundaries.front();
+  };
+  const auto granularityModulo = [] ( const int64_t value ) { return ( ( value % kPacketGranularity ) + kPacketGranularity ) % kPacketGranularity; };
+  const auto offset = [] ( const Span& span ) { return static_cast<int64_t>( span.Start ) - static_cast<int64_t>( span.Position ); };
+  const int64_t total = static_cast<int64_t>( m_Output );
+
+  std::vector<Span> copies;
+  std::copy_if( m_Spans.begin(), m_Spans.end(), std::back_inserter( copies ), [] ( const Span& span ) { return span.Matched; } );
+  while ( !copies.empty() ) {
+    // Packets can only be copied if they fall on the packet grid of the output, which is placed to copy as much of the audio as possible.
+    // (Opus has no way to trim audio in the middle of a link, so matched spans which have moved by a fraction of the grid are re-encoded.)
+    std::map<int64_t /*phase*/, uint64_t /*frames*/> phases;
+    for ( const Span& span : copies )
+      phases[ granularityModulo( offset( span ) ) ] += span.Frames;
+    const int64_t phase = std::max_element( phases.begin(), phases.end(), [] ( const auto& a, const auto& b ) { return a.second < b.second; } )->first;
+    std::erase_if( copies, [ &offset, &granularityModulo, phase ] ( const Span& span ) { return 0 != granularityModulo( offset( span ) - phase ); } );
+
+    // Away from the ends of the output, leave enough of each span to re-encode the transition from (and to) the neighbouring audio.
+    regions.clear();
+    auto copy = copies.begin();
+    for ( ; copies.end() != copy; ++copy ) {
+      const int64_t spanOffset = offset( *copy );
+      const int64_t spanStart = static_cast<int64_t>( copy->Start );
+      const int64_t spanEnd = spanStart + static_cast<int64_t>( copy->Frames );
+      const int64_t start = ( 0 == spanStart ) ? 0 : ( boundaryAfter( spanStart + kPreRoll - spanOffset ) + spanOffset );
+      const int64_t end = ( total == spanEnd ) ? total : ( boundaryBefore( spanEnd - kPreRoll - spanOffset ) + spanOffset );
+      if ( end <= start )
+        break;
+      const int64_t previousEnd = regions.empty() ? 0 : regions.back().End;
+      if ( start > previousEnd )
+        regions.push_back( { previousEnd, start, false, 0 } );
+      regions.push_back( { start, end, true, spanOffset } );
+    }
+
+    // Spans which are too short to copy any packets are re-encoded, which can change the packet grid.
+    if ( copies.end() != copy ) {
+      copies.erase( copy );
+      continue;
+    }
+    if ( regions.back().End < total )
+      regions.push_back( { regions.back().End, total, false, 0 } );
+
+    if ( regions.front().Copied ) {
+      // Start from a packet far enough ahead of the span for the decoder output to match the original, and trim the audio ahead of the span using the pre-skip.
+      const int64_t position = -regions.front().Offset;
+      preSkip = position - boundaryBefore( std::max( boundaries.front(), position - kDecoderPreRoll ) );
+    } else {
+      // Pad the encoder's pre-skip, so that the first copied packet follows a whole number of encoder frames (which also places it on the packet grid).
+      const int64_t copyStart = std::find_if( regions.begin(), regions.end(), [] ( const Region& region ) { return region.Copied; } )->Start;
+      preSkip = lookahead + ( ( ( -( copyStart + lookahead ) ) % m_EncoderFrameSize ) + m_EncoderFrameSize ) % m_EncoderFrameSize;
+    }
+    return preSkip <= 65535;
+  }
+  return false;
+}
+
+bool OpusPassthrough::ReadOutput( SourceDecoder& decoder, const int64_t position, const uint32_t frames, float* output )
+{
+  const uint32_t channels = m_Reference->GetChannels();
+  std::fill_n( output, static_cast<size_t>( frames ) * channels, 0.f );
+  std::vector<uint8_t> data;
+  for ( uint32_t i = ( position < 0 ) ? static_cast<uint32_t>( std::min<int64_t>( frames, -position ) ) : 0; i < frames; ) {
+    const int64_t current = position + i;
+    if ( current >= static_cast<int64_t>( m_Output ) )
+      break;
+    const auto span = std::prev( std::upper_bound( m_Spans.begin(), m_Spans.end(), current, [] ( const int64_t value, const Span& span ) { return value < static_cast<int64_t>( span.Start ); } ) );
+    const uint32_t count = static_cast<uint32_t>( std::min<int64_t>( frames - i, static_cast<int64_t>( span->Start + span->Frames ) - current ) );
+    const uint64_t spanPosition = span->Position + static_cast<uint64_t>( current - static_cast<int64_t>( span->Start ) );
+    float* destination = output + static_cast<size_t>( i ) * channels;
+    if ( span->Matched ) {
+      if ( !decoder.Read( static_cast<int64_t>( spanPosition ), count, destination ) )
+        return false;
+    } else {
+      data.resize( count * m_FrameSize );
+      if ( !ReadSpill( spanPosition, count, data.data() ) )
+        return false;
+      ToFloat( data.data(), count * channels, m_Reference->GetBitsPerSample(), destination );
+    }
+    i += count;
+  }
+  return true;
+}
+
+bool OpusPassthrough::EncodeRegion( OpusEncoder* encoder, SourceDecoder& decoder, PacketWriter& writer, const Region& region, const int64_t preSkip, const int lookahead, const float gain )
+{
+  const bool atStart = ( 0 == region.Start );
+  const bool atEnd = ( static_cast<int64_t>( m_Output ) == region.End );
+  int64_t decodePosition = atStart ? 0 : ( region.Start + preSkip );
+  int64_t samples = region.End + preSkip - decodePosition;
+
+  // The whole region is encoded with one frame size, as the decoder does not join cleanly from a shorter frame to a copied packet.
+  // The end of the output is padded to whole frames (and trimmed by the final granule position), otherwise the largest frame size which fits the region is used.
+  int frameSize = m_EncoderFrameSize;
+  if ( atEnd )
+    samples = ( samples + frameSize - 1 ) / frameSize * frameSize;
+  else {
+    while ( 0 != ( samples % frameSize ) )
+      frameSize /= 2;
+  }
+
+  // Ahead of the region, the encoder is primed with the preceding audio (discarding the packets), so that it reaches the region in a similar state to the original encoder.
+  const int64_t priming = atStart ? 0 : ( ( kPreRoll + frameSize - 1 ) / frameSize * frameSize );
+
+  // The encoder output is delayed by the lookahead, so the input starts that far ahead of the audio for the region.
+  int64_t input = decodePosition - preSkip - priming + lookahead;
+  opus_encoder_ctl( encoder, OPUS_RESET_STATE );
+  const uint32_t channels = m_Reference->GetChannels();
+  std::vector<float> pcm( static_cast<size_t>( frameSize ) * channels );
+  std::vector<uint8_t> packet( kMaximumPacketBytes );
+  for ( int64_t encoded = -priming; encoded < samples; encoded += frameSize, input += frameSize ) {
+    if ( !ReadOutput( decoder, input, static_cast<uint32_t>( frameSize ), pcm.data() ) )
+      return false;
+    for ( float& sample : pcm )
+      sample /= gain;
+    const opus_int32 bytes = opus_encode_float( encoder, pcm.data(), frameSize, packet.data(), kMaximumPacketBytes );
+    if ( bytes <= 0 )
+      return false;
+    if ( encoded >= 0 ) {
+      decodePosition += frameSize;
+      const bool last = atEnd && ( encoded + frameSize >= samples );
+      writer.Write( packet.data(), static_cast<size_t>( bytes ), last ? ( region.End + preSkip ) : decodePosition, last );
+    }
+  }
+  return true;
+}
+
+bool OpusPassthrough::Finish( const std::string& filename, const std::map<std::string, std::string>& tags )
+{
+  if ( ( State::Failed == m_State ) || !FlushUnmatched() || !m_Matched )
+    return false;
+
+  // Spans extended by comparing with the decoded audio only match to within the tolerance, so keep the exact spans in case the audio has to be regenerated.
+  const std::vector<Span> spans = m_Spans;
+  if ( WriteOutput( filename, tags ) )
+    return true;
+  m_Spans = spans;
+  return false;
+}
+
+bool OpusPassthrough::WriteOutput( const std::string& filename, const std::map<std::string, std::string>& tags )
+{
+  PacketReader reader( m_Reference->GetFilename() );
+  if ( !reader.ReadHeaders() || ( reader.GetChannels() != m_Reference->GetChannels() ) )
+    return false;
+  const int64_t origin = reader.GetStartGranule() + reader.GetPreSkip();
+
+  // Packet boundaries of the reference, relative to the start of the audio (matched spans in later links of a chained file cannot be copied).
+  std::vector<int64_t> boundaries;
+  PacketReader::Packet packet;
+  while ( reader.Read( packet ) )
+    boundaries.push_back( packet.Granule - origin );
+  if ( boundaries.empty() )
+    return false;
+  boundaries.push_back( packet.Granule + packet.Duration - origin );
+  if ( std::any_of( m_Spans.begin(), m_Spans.end(), [ end = boundaries.back() ] ( const Span& span ) { return span.Matched && ( static_cast<int64_t>( span.Position + span.Frames ) > end ); } ) )
+    return false;
+
+  SourceDecoder decoder( m_Reference->GetFilename(), m_Reference->GetChannels() );
+  ExtendMatches( decoder );
+
+  int error = 0;
+  const std::unique_ptr<OpusEncoder, decltype( &opus_encoder_destroy )> encoder( opus_encoder_create( 48000, static_cast<int>( m_Reference->GetChannels() ), OPUS_APPLICATION_AUDIO, &error ), opus_encoder_destroy );
+  if ( !encoder )
+    return false;
+  m_Configure( encoder.get() );
+  opus_int32 lookahead = 0;
+  opus_encoder_ctl( encoder.get(), OPUS_GET_LOOKAHEAD( &lookahead ) );
+
+  // Re-encoded regions produce single stream packets, so they can only be combined with packets using the same channel mapping.
+  std::vector<Region> regions;
+  int64_t preSkip = 0;
+  if ( !Plan( boundaries, lookahead, regions, preSkip ) )
+    return false;
+  if ( ( 0 != reader.GetMappingFamily() ) && std::any_of( regions.begin(), regions.end(), [] ( const Region& region ) { return !region.Copied; } ) )
+    return false;
+
+  std::vector<uint8_t> head = reader.GetHead();
+  head[ 10 ] = static_cast<uint8_t>( preSkip & 0xff );
+  head[ 11 ] = static_cast<uint8_t>( preSkip >> 8 );
+
+  std::vector<uint8_t> comments = { 'O', 'p', 'u', 's', 'T', 'a', 'g', 's' };
+  const auto appendString = [ &comments ] ( const std::string& value ) {
+    const uint32_t length = static_cast<uint32_t>( value.size() );
+    for ( int shift = 0; shift < 32; shift += 8 )
+      comments.push_back( static_cast<uint8_t>( length >> shift ) );
+    comments.insert( comments.end(), value.begin(), value.end() );
+  };
+  appendString( reader.GetVendor() );
+  const uint32_t count = static_cast<uint32_t>( tags.size() );
+  for ( int shift = 0; shift < 32; shift += 8 )
+    comments.push_back( static_cast<uint8_t>( count >> shift ) );
+  for ( const auto& [ name, value ] : tags )
+    appendString( name + "=" + value );
+
+  PacketWriter writer( filename, reader.GetSerial() );
+  if ( !writer.IsOpen() )
+    return false;
+  writer.WriteHeader( head );
+  writer.WriteHeader( comments );
+
+  const float gain = 32768.f * static_cast<float>( std::pow( 10.0, reader.GetOutputGain() / ( 20.0 * 256 ) ) );
+  std::unique_ptr<PacketReader> source;
+  int64_t sourcePosition = 0;
+  for ( const Region& region : regions ) {
+    if ( !region.Copied ) {
+      if ( !EncodeRegion( encoder.get(), decoder, writer, region, preSkip, lookahead, gain ) )
+        return false;
+      continue;
+    }
+
+    // Copy the packets for the region (which start and end on packet boundaries, apart from at the ends of the output).
+    const int64_t first = region.Start - region.Offset - ( ( 0 == region.Start ) ? preSkip : 0 );
+    const int64_t last = region.End - region.Offset;
+    if ( !source || ( first < sourcePosition ) ) {
+      source = std::make_unique<PacketReader>( m_Reference->GetFilename() );
+      if ( !source->ReadHeaders() )
+        return false;
+    }
+    if ( !source->Find( first + origin, packet ) || ( packet.Granule - origin != first ) )
+      return false;
+    bool complete = false;
+    do {
+      const int64_t packetEnd = packet.Granule + packet.Duration - origin;
+      complete = ( packetEnd >= last );
+      const bool end = complete && ( static_cast<int64_t>( m_Output ) == region.End );
+      writer.Write( packet.Data.data(), packet.Data.size(), end ? ( region.End + preSkip ) : ( packetEnd + region.Offset + preSkip ), end );
+    } while ( !complete && source->Read( packet ) );
+    if ( !complete )
+      return false;
+    sourcePosition = last;
+  }
+  return writer.IsGood();
+}
+
+bool OpusPassthrough::Regenerate( const std::function<bool( uint8_t* data, const uint32_t frames )>& write )
+{
+  if ( !FlushUnmatched() )
+    return false;
+
+  std::vector<uint8_t> buffer( kOpusChunkSize / m_FrameSize * m_FrameSize );
+  const uint64_t bufferFrames = buffer.size() / m_FrameSize;
+  std::unique_ptr<DecoderOpus> decoder;
+  uint64_t decoderPosition = 0;
+  try {
+    for ( const Span& span : m_Spans ) {
+      for ( uint64_t done = 0; done < span.Frames; ) {
+        const uint32_t frames = static_cast<uint32_t>( std::min( bufferFrames, span.Frames - done ) );
+        if ( span.Matched ) {
+          // Matched spans are regenerated by decoding the source file sequentially again, which yields exactly the same audio as when it was opened (as the reference is only built from a sequential decode).
+          const uint64_t position = span.Position + done;
+          if ( !decoder || ( decoderPosition > position ) ) {
+            decoder = std::make_unique<DecoderOpus>( m_Reference->GetFilename(), DecoderOpus::Mode::Regenerate );
+            decoderPosition = 0;
+            if ( ( decoder->GetChannels() != m_Reference->GetChannels() ) || ( decoder->GetBitsPerSample() != m_Reference->GetBitsPerSample() ) )
+              return false;
+          }
+          while ( decoderPosition < position ) {
+            const uint64_t skip = decoder->Read( buffer.data(), static_cast<long>( std::min( bufferFrames, position - decoderPosition ) * m_FrameSize ) ) / m_FrameSize;
+            if ( 0 == skip )
+              return false;
+            decoderPosition += skip;
+          }
+          if ( decoder->Read( buffer.data(), static_cast<long>( frames * m_FrameSize ) ) != frames * m_FrameSize )
+            return false;
+          decoderPosition += frames;
+        } else if ( !ReadSpill( span.Position + done, frames, buffer.data() ) ) {
+          return false;
+        }
+        if ( !write( buffer.data(), frames ) )
+          return false;
+        done += frames;
+      }
+    }
+  } catch ( const std::runtime_error& ) {
+    return false;
+  }
+  return true;
+}
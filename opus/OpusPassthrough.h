@@ -0,0 +1,127 @@
+#pragma once
+#include "OpusReference.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct OpusEncoder;
+class PacketWriter;
+class SourceDecoder;
+
+// Recognises spans of the audio written to the encoder which are unmodified from the last decoded Opus file, so that the output file can be created by
+// copying the original packets for those spans, and only re-encoding the modified regions (rather than adding another generation of lossy coding throughout).
+class OpusPassthrough
+{
+public:
+  // Applies the encoder settings to an encoder used for the modified regions.
+  using Configure = std::function<void( OpusEncoder* encoder )>;
+
+  OpusPassthrough( std::shared_ptr<const OpusReference> reference, Configure configure, const int frameSize );
+  ~OpusPassthrough();
+
+  // Compares the incoming sample frames with the reference, returning the number of frames consumed.
+  // If fewer than the total number of frames are consumed, none of the audio near the start matched the reference and the passthrough can no longer be used,
+  // so the frames consumed so far should be obtained from Regenerate, followed by the remaining frames.
+  uint32_t Write( const uint8_t* data, const uint32_t frames );
+
+  // Creates the output file from the original packets and the re-encoded regions, returning false if the audio written could not be passed through.
+  bool Finish( const std::string& filename, const std::map<std::string, std::string>& tags );
+
+  // Regenerates the sample frames consumed so far, passing them to the callback in blocks.
+  bool Regenerate( const std::function<bool( uint8_t* data, const uint32_t frames )>& write );
+
+  const std::string& GetSourceFilename() const { return m_Reference->GetFilename(); }
+
+private:
+  enum class State { Aligning, Tracking, Failed };
+
+  // A span of the incoming audio, which either matches the reference (from the reference position), or is held in the spill file (from the spill position).
+  struct Span
+  {
+    uint64_t Start = 0;
+    uint64_t Frames = 0;
+    bool Matched = false;
+    uint64_t Position = 0;
+  };
+
+  // A region of the output file, either copied from the reference packets (with the given offset from the reference position), or re-encoded.
+  struct Region
+  {
+    int64_t Start = 0;
+    int64_t End = 0;
+    bool Copied = false;
+    int64_t Offset = 0;
+  };
+
+  // Consumes one frame, returning false if the passthrough can no longer be used.
+  bool Consume( const uint8_t* frame );
+
+  // Adds a frame while looking for a chunk to align with, or while tracking the current chunk.
+  bool Align( const uint8_t* frame );
+  bool Track( const uint8_t* frame );
+
+  // Checks whether the pending frames complete the current chunk, returning to alignment if the chunk does not match.
+  bool CompleteChunk();
+
+  // Adds frames to the spans.
+  void AddMatched( const uint64_t position, const uint64_t frames );
+  bool AddUnmatched( const uint8_t* data, const uint64_t frames );
+
+  // Moves any frames which are still being aligned or tracked into the unmatched spans.
+  bool FlushUnmatched();
+
+  // Reads frames from the spill file.
+  bool ReadSpill( const uint64_t position, const uint64_t frames, uint8_t* data );
+
+  // Extends the matched spans over the partial chunks either side of them (which cannot be compared by hash), by comparing with the decoded audio instead.
+  void ExtendMatches( SourceDecoder& decoder );
+
+  // Returns the number of frames at the start (or end) of an unmatched span which match the decoded reference following (or preceding) the reference position.
+  uint64_t MatchForward( SourceDecoder& decoder, const Span& span, const uint64_t position );
+  uint64_t MatchBackward( SourceDecoder& decoder, const Span& span, const uint64_t position );
+
+  // Divides the output into copied and re-encoded regions at packet boundaries of the reference, returning false if nothing can be copied.
+  bool Plan( const std::vector<int64_t>& boundaries, const int lookahead, std::vector<Region>& regions, int64_t& preSkip ) const;
+
+  // Encodes a region of the output (setting the pre-skip at the start of the output, or trimming the end of the output).
+  bool EncodeRegion( OpusEncoder* encoder, SourceDecoder& decoder, PacketWriter& writer, const Region& region, const int64_t preSkip, const int lookahead, const float gain );
+
+  // Writes the output file from the copied and re-encoded regions.
+  bool WriteOutput( const std::string& filename, const std::map<std::string, std::string>& tags );
+
+  // Reads output audio (as interleaved floating point samples with a nominal range of +/-32768), with silence outside the audio written.
+  bool ReadOutput( SourceDecoder& decoder, const int64_t position, const uint32_t frames, float* output );
+
+  const std::shared_ptr<const OpusReference> m_Reference;
+  const Configure m_Configure;
+  const int m_EncoderFrameSize;
+  const uint32_t m_FrameSize;
+  uint64_t m_MaximumChunkFrames = 0;
+  State m_State = State::Aligning;
+
+  // The audio written so far, apart from the frames being aligned or tracked.
+  std::vector<Span> m_Spans;
+  uint64_t m_Output = 0;
+  bool m_Matched = false;
+
+  // Unmatched frames, held in a temporary file.
+  std::filesystem::path m_SpillFilename;
+  std::fstream m_Spill;
+  uint64_t m_SpillFrames = 0;
+
+  // Incoming frames which have not been aligned with a chunk, and the rolling hash of the latest frames.
+  std::vector<uint8_t> m_Window;
+  uint64_t m_RollingHash = 0;
+  uint64_t m_RollingPower = 1;
+
+  // The current chunk being compared, along with the incoming frames so far for that chunk.
+  size_t m_Chunk = 0;
+  uint64_t m_ChunkHash = 0;
+  std::vector<uint8_t> m_Pending;
+};
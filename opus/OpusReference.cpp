@@ -0,0 +1,85 @@
+#include "OpusReference.h"
+
+#include <algorithm>
+#include <cstring>
+
+std::mutex OpusReference::s_LastMutex;
+std::shared_ptr<const OpusReference> OpusReference::s_Last;
+
+uint64_t FrameHash::Value( const uint8_t* frame, const uint32_t frameSize )
+{
+  // Mix the frame bits, so that the polynomial hash is not dominated by the structure of the sample values.
+  uint64_t value = 0;
+  std::memcpy( &value, frame, std::min<uint32_t>( frameSize, sizeof( value ) ) );
+  value ^= value >> 31;
+  value *= 0x7fb5d329728ea185ull;
+  value ^= value >> 27;
+  value *= 0x81dadef4bc2dd44dull;
+  value ^= value >> 33;
+  return value;
+}
+
+OpusReference::OpusReference( const std::string& filename, const FileIdentity& identity, const uint32_t channels, const uint32_t bitsPerSample ) :
+  m_Filename( filename ),
+  m_Identity( identity ),
+  m_Channels( channels ),
+  m_BitsPerSample( bitsPerSample )
+{
+}
+
+void OpusReference::AddChunk( const uint8_t* data, const uint32_t frames )
+{
+  const uint32_t frameSize = GetFrameSize();
+  Chunk chunk;
+  chunk.Start = m_TotalFrames;
+  chunk.Frames = frames;
+  for ( uint32_t i = 0; i < frames; i++, data += frameSize ) {
+    chunk.Hash = FrameHash::Append( chunk.Hash, FrameHash::Value( data, frameSize ) );
+    if ( kAlignmentFrames == ( 1 + i ) )
+      m_Alignment.push_back( { chunk.Hash, static_cast<uint32_t>( m_Chunks.size() ) } );
+  }
+  m_Chunks.push_back( chunk );
+  m_TotalFrames += frames;
+}
+
+void OpusReference::Finalise()
+{
+  m_Chunks.shrink_to_fit();
+
+  // Remove alignment hashes shared by more than one chunk (e.g. for silence), as these cannot be used to align incoming audio.
+  std::sort( m_Alignment.begin(), m_Alignment.end() );
+  std::vector<std::pair<uint64_t, uint32_t>> alignment;
+  for ( auto entry = m_Alignment.begin(); m_Alignment.end() != entry; ) {
+    const auto next = std::find_if( entry, m_Alignment.end(), [ hash = entry->first ] ( const auto& other ) { return other.first != hash; } );
+    if ( 1 == std::distance( entry, next ) )
+      alignment.push_back( *entry );
+    entry = next;
+  }
+  m_Alignment = std::move( alignment );
+}
+
+bool OpusReference::IsCompatible( const uint32_t sampleRate, const uint32_t channels, const uint32_t bitsPerSample ) const
+{
+  return ( 48000 == sampleRate ) && ( m_Channels == channels ) && ( m_BitsPerSample == bitsPerSample ) && !m_Chunks.empty() &&
+    ( GetFileIdentity( UTF8ToWideString( m_Filename ) ) == m_Identity );
+}
+
+std::optional<size_t> OpusReference::FindChunk( const uint64_t alignmentHash ) const
+{
+  const auto entry = std::lower_bound( m_Alignment.begin(), m_Alignment.end(), std::make_pair( alignmentHash, uint32_t( 0 ) ) );
+  if ( ( m_Alignment.end() != entry ) && ( alignmentHash == entry->first ) )
+    return entry->second;
+  return std::nullopt;
+}
+
+void OpusReference::SetLast( std::shared_ptr<const OpusReference> reference )
+{
+  std::lock_guard<std::mutex> lock( s_LastMutex );
+  s_Last = std::move( reference );
+}
+
+std::shared_ptr<const OpusReference> OpusReference::GetLast()
+{
+  std::lock_guard<std::mutex> lock( s_LastMutex );
+  return s_Last;
+}
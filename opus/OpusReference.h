@@ -0,0 +1,78 @@
+#pragma once
+
+#include "utils.h"
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Polynomial hash over sample frames (of up to 8 bytes), which can be rolled over a fixed size window.
+struct FrameHash
+{
+  static constexpr uint64_t kBase = 0x100000001b3ull;
+
+  static uint64_t Value( const uint8_t* frame, const uint32_t frameSize );
+
+  static uint64_t Append( const uint64_t hash, const uint64_t value ) { return hash * kBase + value; }
+};
+
+// Hashes of the audio delivered to Cool Edit when an Opus file was decoded, one per decoded packet.
+// The encoder uses the reference for the last decoded file to recognise audio that has not been modified since it was opened.
+class OpusReference
+{
+public:
+  // Number of frames at the start of each chunk used to align incoming audio with the reference.
+  static constexpr uint32_t kAlignmentFrames = 120;
+
+  struct Chunk
+  {
+    uint64_t Start = 0;
+    uint32_t Frames = 0;
+    uint64_t Hash = 0;
+  };
+
+  OpusReference( const std::string& filename, const FileIdentity& identity, const uint32_t channels, const uint32_t bitsPerSample );
+
+  // Adds the next decoded chunk of sample frames.
+  void AddChunk( const uint8_t* data, const uint32_t frames );
+
+  // Called once the whole file has been decoded, to prepare the chunk alignment table.
+  void Finalise();
+
+  const std::string& GetFilename() const { return m_Filename; }
+  uint32_t GetChannels() const { return m_Channels; }
+  uint32_t GetBitsPerSample() const { return m_BitsPerSample; }
+  uint32_t GetFrameSize() const { return m_Channels * m_BitsPerSample / 8; }
+  uint64_t GetTotalFrames() const { return m_TotalFrames; }
+  const std::vector<Chunk>& GetChunks() const { return m_Chunks; }
+
+  // Returns whether audio in the given format can be compared with the reference, and the source file is unchanged.
+  bool IsCompatible( const uint32_t sampleRate, const uint32_t channels, const uint32_t bitsPerSample ) const;
+
+  // Returns the index of the chunk which starts with frames matching the alignment hash, if there is exactly one such chunk.
+  std::optional<size_t> FindChunk( const uint64_t alignmentHash ) const;
+
+  // Sets the reference for the last decoded file.
+  static void SetLast( std::shared_ptr<const OpusReference> reference );
+
+  // Returns the reference for the last decoded file, if there is one.
+  static std::shared_ptr<const OpusReference> GetLast();
+
+private:
+  const std::string m_Filename;
+  const FileIdentity m_Identity;
+  const uint32_t m_Channels;
+  const uint32_t m_BitsPerSample;
+
+  std::vector<Chunk> m_Chunks;
+  uint64_t m_TotalFrames = 0;
+
+  // Alignment hashes (of the first frames in each chunk) paired with chunk indices, sorted by hash, with ambiguous hashes removed.
+  std::vector<std::pair<uint64_t /*hash*/, uint32_t /*chunk*/>> m_Alignment;
+
+  static std::mutex s_LastMutex;
+  static std::shared_ptr<const OpusReference> s_Last;
+};
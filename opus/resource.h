@@ -4,6 +4,11 @@
 //
 #define IDD_CONFIG                    101
 #define IDC_BITRATE                   200
+#define IDC_LOUDNESSTAGS              201
+#define IDC_PRESET                    202
+#define IDC_BENCHMARK                 203
+#define IDC_PRESETSPEED               204
+#define IDC_SEGMENTEDDECODE           205
 
 // Next default values for new objects
 // 
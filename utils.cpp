@@ -5,6 +5,10 @@
 #include <array>
 #include <filesystem>
 #include <fstream>
+#include <algorithm>
+#include <chrono>
+#include <cwctype>
+#include <cstdio>
 
 #include <Windows.h>
 #include <ShlObj.h>
@@ -74,7 +78,7 @@ std::string AnsiCodePageToUTF8( const std::string& text )
   return WideStringToUTF8( AnsiCodePageToWideString( text ) );
 }
 
-std::filesystem::path GetSettingsFilename()
+std::filesystem::path GetSettingsFolder()
 {
   std::filesystem::path filepath;
   std::array<wchar_t, MAX_PATH> app = {};
@@ -83,11 +87,18 @@ std::filesystem::path GetSettingsFilename()
     std::error_code ec;
     if ( !std::filesystem::is_directory( filepath, ec ) )
       filepath = std::filesystem::temp_directory_path( ec );
-    filepath /= "CoolEditFltOptions.json";
   }
   return filepath;
 }
 
+std::filesystem::path GetSettingsFilename()
+{
+  std::filesystem::path filepath = GetSettingsFolder();
+  if ( !filepath.empty() )
+    filepath /= "CoolEditFltOptions.json";
+  return filepath;
+}
+
 std::optional<int32_t> ReadSetting( const std::string& name )
 {
   try {
@@ -118,4 +129,89 @@ void WriteSetting( const std::string& name, const int32_t value )
     std::ofstream filestream( GetSettingsFilename() );
     filestream << options;
   }
+}
+
+std::optional<FileIdentity> GetFileIdentity( const std::filesystem::path& filename )
+{
+  std::error_code ec;
+  const auto size = std::filesystem::file_size( filename, ec );
+  if ( ec )
+    return std::nullopt;
+  const auto lastWriteTime = std::filesystem::last_write_time( filename, ec );
+  if ( ec )
+    return std::nullopt;
+  return FileIdentity{ static_cast<uint64_t>( size ), static_cast<int64_t>( lastWriteTime.time_since_epoch().count() ) };
+}
+
+std::filesystem::path GetCacheFilename( const std::filesystem::path& filename, const std::string& extension )
+{
+  std::filesystem::path folder = GetSettingsFolder();
+  if ( folder.empty() )
+    return {};
+
+  std::error_code ec;
+  folder /= "CoolEditFltCache";
+  if ( !std::filesystem::is_directory( folder, ec ) && !std::filesystem::create_directories( folder, ec ) )
+    return {};
+
+  // Name the cache file using a 64-bit FNV-1a hash of the (case insensitive) absolute source path.
+  std::wstring source = std::filesystem::absolute( filename, ec ).wstring();
+  std::transform( source.begin(), source.end(), source.begin(), [] ( wchar_t c ) { return std::towlower( c ); } );
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for ( const char c : WideStringToUTF8( source ) ) {
+    hash ^= static_cast<uint8_t>( c );
+    hash *= 0x100000001b3ull;
+  }
+  std::array<char, 17> name = {};
+  snprintf( name.data(), name.size(), "%016llx", static_cast<unsigned long long>( hash ) );
+  return folder / ( std::string( name.data() ) + extension );
+}
+
+void TouchCacheFile( const std::filesystem::path& filename )
+{
+  std::error_code ec;
+  std::filesystem::last_write_time( filename, std::filesystem::file_time_type::clock::now(), ec );
+}
+
+void RemoveOldCacheFiles( const std::filesystem::path& keep, const std::string& extension, const uint64_t maximumSize )
+{
+  // Age after which a temporary file is assumed to have been abandoned by a cache which was never finished.
+  constexpr std::chrono::hours kAbandonedAge( 24 );
+
+  struct CacheFile
+  {
+    std::filesystem::path Filename;
+    uint64_t Size = 0;
+    std::filesystem::file_time_type LastWriteTime;
+  };
+  std::vector<CacheFile> cacheFiles;
+  uint64_t totalSize = 0;
+  const auto now = std::filesystem::file_time_type::clock::now();
+  std::error_code ec;
+  for ( std::filesystem::directory_iterator entry( keep.parent_path(), ec ), end; !ec && ( end != entry ); entry.increment( ec ) ) {
+    const std::filesystem::path& filename = entry->path();
+    const bool temporary = ( ".tmp" == filename.extension() ) && ( extension == filename.stem().extension() );
+    if ( !temporary && ( extension != filename.extension() ) )
+      continue;
+    std::error_code fileError;
+    const uint64_t size = entry->file_size( fileError );
+    const auto lastWriteTime = entry->last_write_time( fileError );
+    if ( fileError )
+      continue;
+    if ( temporary && ( now - lastWriteTime > kAbandonedAge ) )
+      std::filesystem::remove( filename, fileError );
+    else {
+      // Files which are still being written count towards the total, but are never removed.
+      totalSize += size;
+      if ( !temporary && ( filename != keep ) )
+        cacheFiles.push_back( { filename, size, lastWriteTime } );
+    }
+  }
+
+  std::sort( cacheFiles.begin(), cacheFiles.end(), [] ( const CacheFile& a, const CacheFile& b ) { return a.LastWriteTime < b.LastWriteTime; } );
+  for ( auto cacheFile = cacheFiles.begin(); ( cacheFiles.end() != cacheFile ) && ( totalSize > maximumSize ); ++cacheFile ) {
+    // Files which are open for reading cannot be removed.
+    if ( std::filesystem::remove( cacheFile->Filename, ec ) )
+      totalSize -= cacheFile->Size;
+  }
 }
\ No newline at end of file
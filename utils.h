@@ -2,6 +2,7 @@
 
 #include <string>
 #include <optional>
+#include <filesystem>
 
 std::wstring AnsiCodePageToWideString( const std::string& text );
 std::string WideStringToAnsiCodePage( const std::wstring& text );
@@ -10,4 +11,25 @@ std::string WideStringToUTF8( const std::wstring& text );
 std::string AnsiCodePageToUTF8( const std::string& text );
 
 std::optional<int32_t> ReadSetting( const std::string& name );
-void WriteSetting( const std::string& name, const int32_t value );
\ No newline at end of file
+void WriteSetting( const std::string& name, const int32_t value );
+
+// Identifies a particular version of a file, so that cached data can be validated against it.
+struct FileIdentity
+{
+  uint64_t Size = 0;
+  int64_t LastWriteTime = 0;
+
+  bool operator==( const FileIdentity& ) const = default;
+};
+
+std::optional<FileIdentity> GetFileIdentity( const std::filesystem::path& filename );
+
+// Returns the name of a file in the shared cache folder which can be used to hold data derived from the source file (an empty path if there is no cache folder).
+std::filesystem::path GetCacheFilename( const std::filesystem::path& filename, const std::string& extension );
+
+// Marks a file in the cache folder as recently used.
+void TouchCacheFile( const std::filesystem::path& filename );
+
+// Removes the least recently used cache files with the extension (apart from the one given) until they fit within the maximum total size.
+// Temporary files for the extension (with a further ".tmp" extension) count towards the total while they are being written, and are removed once abandoned.
+void RemoveOldCacheFiles( const std::filesystem::path& keep, const std::string& extension, const uint64_t maximumSize );
\ No newline at end of file